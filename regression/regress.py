@@ -1,11 +1,12 @@
 import os
 import sys
 import copy
+import glob
 import random
 import time
 import argparse
 from collections import deque
-from subprocess import call
+from subprocess import call, Popen
 
 os.chdir(os.path.join(os.path.dirname(__file__), ".."))
 sys.path.append('parsimony_python')
@@ -111,11 +112,12 @@ def run_python_baseline(file_name, outfile_name):
 
     write_result(outfile_name, result)
 
-def run_cpp_seq(file_name, outfile_name):
-    call(["./crun-seq", file_name, outfile_name])
+def run_cpp_seq(file_name, outfile_name, options=[]):
+    call(["./crun-seq", file_name, outfile_name] + options)
 
-def run_cpp_par(file_name, outfile_name, num_threads):
-    call(["./parsimony-omp-ispc", file_name, outfile_name, str(num_threads)])
+def run_cpp_par(file_name, outfile_name, num_threads, options=[]):
+    call(["./parsimony-omp-ispc", file_name, outfile_name, str(num_threads)] +
+         options)
 
 
 def get_tree_char(trees_list):
@@ -148,7 +150,7 @@ def get_tree_char(trees_list):
     return T_list
 
 
-def validate_tree(tree_tuple):
+def validate_tree(tree_tuple, distance=hamming_distance):
     score = tree_tuple[0]
     T = tree_tuple[1]
     chars = tree_tuple[2]
@@ -171,7 +173,7 @@ def validate_tree(tree_tuple):
         for child in T[top]:
             if child not in visited:
                 child_chars = chars[child]
-                tree_score += hamming_distance(top_chars, child_chars)
+                tree_score += distance(top_chars, child_chars)
                 q.append(child)
                 visited.add(child)
 
@@ -193,32 +195,25 @@ def get_leaves(tree_tuple):
     return leaves
 
 
-def compare_two_files(file_1_name, file_2_name):
-    trees_1 = []
-    trees_2 = []
+def read_trees(file_name):
+    trees = []
 
-    with open(file_1_name, 'r') as input_file:
+    with open(file_name, 'r') as input_file:
         tree = []
         for line in input_file:
             line = line.strip()
             if line != "-----":
                 tree.append(line)
             else:
-                trees_1.append(tree)
+                trees.append(tree)
                 tree = []
 
-    with open(file_2_name, 'r') as input_file:
-        tree = []
-        for line in input_file:
-            line = line.strip()
-            if line != "-----":
-                tree.append(line)
-            else:
-                trees_2.append(tree)
-                tree = []
+    return get_tree_char(trees)
+
 
-    T_list_1 = get_tree_char(trees_1)
-    T_list_2 = get_tree_char(trees_2)
+def compare_two_files(file_1_name, file_2_name):
+    T_list_1 = read_trees(file_1_name)
+    T_list_2 = read_trees(file_2_name)
     file_1_score = T_list_1[0][0]
     file_2_score = T_list_2[0][0]
 
@@ -250,6 +245,199 @@ def compare_two_files(file_1_name, file_2_name):
     return True, "Match"
 
 
+def get_splits(tree_tuple):
+    # the topology of a tree, as the leaf sets cut off by each of its edges
+    T = tree_tuple[1]
+    chars = tree_tuple[2]
+
+    def side_leaves(node, parent):
+        if len(T[node]) == 1:
+            return frozenset([chars[node]])
+        leaves = frozenset()
+        for child in T[node]:
+            if child != parent:
+                leaves |= side_leaves(child, node)
+        return leaves
+
+    all_leaves = get_leaves(tree_tuple)
+    first_leaf = min(all_leaves)
+    splits = set()
+    for node in T:
+        for neighbor in T[node]:
+            side = side_leaves(neighbor, node)
+            if first_leaf in side:
+                side = all_leaves - side
+            splits.add(frozenset(side))
+    return frozenset(splits)
+
+
+def compare_topologies(file_1_name, file_2_name):
+    topologies_1 = set(get_splits(each) for each in read_trees(file_1_name))
+    topologies_2 = set(get_splits(each) for each in read_trees(file_2_name))
+    if topologies_1 != topologies_2:
+        return False, "Topology Mismatch: file_1 [{}] trees file_2 [{}] trees".format(
+            len(topologies_1), len(topologies_2))
+    return compare_two_files(file_1_name, file_2_name)
+
+
+def fitch_score(edges, leaf_strs):
+    # unit cost score of an unrooted tree, rooted at leaf 0
+    T = {}
+    for a, b in edges:
+        connect_neighbor_pair(a, b, T)
+        connect_neighbor_pair(b, a, T)
+
+    def node_sets(node, parent):
+        if node < len(leaf_strs):
+            return [set([c]) for c in leaf_strs[node]], 0
+        sets = None
+        score = 0
+        for child in T[node]:
+            if child == parent:
+                continue
+            child_sets, child_score = node_sets(child, node)
+            score += child_score
+            if sets is None:
+                sets = child_sets
+                continue
+            for i in range(len(sets)):
+                if sets[i] & child_sets[i]:
+                    sets[i] = sets[i] & child_sets[i]
+                else:
+                    sets[i] = sets[i] | child_sets[i]
+                    score += 1
+        return sets, score
+
+    sets, score = node_sets(T[0][0], 0)
+    for i in range(len(sets)):
+        if leaf_strs[0][i] not in sets[i]:
+            score += 1
+    return score
+
+
+def enumerate_trees(num_leaves):
+    # every unrooted binary tree of the leaves once, adding each leaf on
+    # every edge of the trees of the leaves before it
+    trees = [[(0, num_leaves), (1, num_leaves), (2, num_leaves)]]
+    next_node = num_leaves + 1
+    for leaf in range(3, num_leaves):
+        new_trees = []
+        for edges in trees:
+            for i in range(len(edges)):
+                a, b = edges[i]
+                new_edges = edges[:i] + edges[i + 1:]
+                new_edges += [(a, next_node), (b, next_node), (leaf, next_node)]
+                new_trees.append(new_edges)
+        trees = new_trees
+        next_node += 1
+    return trees
+
+
+def check_exact(input_file, outfile, num_leaves, str_len):
+    # --exact writes every most parsimonious tree, found here by trying them all
+    tree = generate_tree_structure(num_leaves)
+    assigment = assign_strings(tree, str_len)
+    generate_input_file(tree, assigment, input_file)
+    run_cpp_seq(input_file, outfile, ["--exact"])
+
+    leaf_strs = [assigment[i] for i in range(num_leaves)]
+    best_score = None
+    best_topologies = set()
+    for edges in enumerate_trees(num_leaves):
+        score = fitch_score(edges, leaf_strs)
+        if best_score is not None and score > best_score:
+            continue
+        if best_score is None or score < best_score:
+            best_score = score
+            best_topologies = set()
+        T = {}
+        for a, b in edges:
+            connect_neighbor_pair(a, b, T)
+            connect_neighbor_pair(b, a, T)
+        chars = dict((i, leaf_strs[i]) for i in range(num_leaves))
+        best_topologies.add(get_splits((score, T, chars)))
+
+    T_list = read_trees(outfile)
+    if T_list[0][0] != best_score:
+        return False, "Exact Score Mismatch: exact [{}] enumerated [{}]".format(
+            T_list[0][0], best_score)
+    if set(get_splits(each) for each in T_list) != best_topologies:
+        return False, "Exact Trees Mismatch: exact [{}] enumerated [{}]".format(
+            len(T_list), len(best_topologies))
+    for each in T_list:
+        result, error_info = validate_tree(each)
+        if not result:
+            return result, error_info
+    return True, "Match"
+
+
+def check_cost_matrix(input_file, outfile, num_threads, options, cost_arr):
+    # the score under a step matrix is the cost of the written strings
+    idx = dict((c, i) for i, c in enumerate("ACGT"))
+
+    def step_distance(a, b):
+        return sum(cost_arr[idx[x] * 4 + idx[y]] for x, y in zip(a, b))
+
+    run_cpp_par(input_file, outfile, num_threads, options)
+    for each in read_trees(outfile):
+        result, error_info = validate_tree(each, step_distance)
+        if not result:
+            return result, error_info
+    return True, "Match"
+
+
+def transversion_cost_matrix(cost):
+    # A <-> G and C <-> T cost 1, the other changes cost
+    return [0 if i // 4 == i % 4 else 1 if (i // 4) % 2 == (i % 4) % 2 else cost
+            for i in range(16)]
+
+
+def write_cost_matrix(cost_arr, file_name):
+    with open(file_name, 'w') as outputfile:
+        for i in range(4):
+            outputfile.write(" ".join(str(c) for c in cost_arr[i * 4:i * 4 + 4]))
+            outputfile.write("\n")
+
+
+def random_cost_matrix():
+    # symmetric with a zero diagonal, not always a metric
+    cost_arr = [0] * 16
+    for i in range(4):
+        for j in range(i + 1, 4):
+            cost_arr[i * 4 + j] = cost_arr[j * 4 + i] = random.randint(1, 5)
+    return cost_arr
+
+
+def remove_checkpoint(checkpoint_file):
+    # the state, its trees and its topologies
+    for file_name in glob.glob(checkpoint_file) + glob.glob(checkpoint_file + ".*"):
+        os.remove(file_name)
+
+
+def check_checkpoint(input_file, outfile, checkpoint_file, num_threads):
+    # a search killed halfway and resumed from its checkpoint ends with the
+    # trees of a search that ran through
+    uninterrupted_outfile = outfile + ".full"
+    remove_checkpoint(checkpoint_file)
+    start_time = time.time()
+    run_cpp_par(input_file, uninterrupted_outfile, num_threads)
+    full_time = time.time() - start_time
+
+    options = ["--checkpoint=" + checkpoint_file, "--checkpoint-interval=1"]
+    process = Popen(["./parsimony-omp-ispc", input_file, outfile,
+                     str(num_threads)] + options)
+    time.sleep(full_time / 2)
+    process.kill()
+    process.wait()
+    run_cpp_par(input_file, outfile, num_threads, options)
+    remove_checkpoint(checkpoint_file)
+
+    with open(uninterrupted_outfile, 'r') as file_1, open(outfile, 'r') as file_2:
+        if file_1.read() != file_2.read():
+            return False, "Resumed Search Mismatch"
+    return True, "Match"
+
+
 def main():
 
     parser = argparse.ArgumentParser(description='Read arguments')
@@ -259,6 +447,8 @@ def main():
     parser.add_argument('-t', type=int, default=4, help='number of threads for OpenMP')
     parser.add_argument('-s', type=int, default=50, help='length of string')
     parser.add_argument('-e', type=int, default=10, help='number of epochs to run')
+    parser.add_argument('-x', type=int, default=7, help='number of leaves for --exact')
+    parser.add_argument('-c', type=int, default=500, help='number of leaves and length of string for --checkpoint')
 
     args = parser.parse_args()
 
@@ -269,6 +459,8 @@ def main():
     python_outfile = "output/python_result.txt"
     cpp_seq_outfile = "output/cpp_seq_result.txt"
     cpp_par_outfile = "output/cpp_par_result.txt"
+    cost_matrix_file = "output/cost_matrix.txt"
+    checkpoint_file = "output/checkpoint"
 
 
     run_python_version = args.p
@@ -276,6 +468,8 @@ def main():
     num_leaves = args.l
     str_len = args.s
     epoch = args.e
+    num_exact_leaves = args.x
+    num_checkpoint_leaves = args.c
 
     total_python_time = 0
     total_cpp_seq_time = 0
@@ -315,6 +509,43 @@ def main():
             print("result not match!")
             exit(1)
 
+        # the other searches, each checked on its own
+        for options in [["--spr-radius=2"], ["--tbr-radius=2"]]:
+            run_cpp_seq(new_input_file, cpp_seq_outfile, options)
+            run_cpp_par(new_input_file, cpp_par_outfile, num_threads, options)
+            result = compare_topologies(cpp_seq_outfile, cpp_par_outfile)
+            if not result[0]:
+                print("{} result not match! {}".format(options[0], result[1]))
+                exit(1)
+
+        cost_arr = random_cost_matrix()
+        write_cost_matrix(cost_arr, cost_matrix_file)
+        for options, matrix in [
+                (["--transversion-cost=3"], transversion_cost_matrix(3)),
+                (["--cost-matrix=" + cost_matrix_file], cost_arr)]:
+            result = check_cost_matrix(new_input_file, cpp_par_outfile,
+                                       num_threads, options, matrix)
+            if not result[0]:
+                print("{} result not match! {}".format(options[0], result[1]))
+                exit(1)
+
+        result = check_exact(new_input_file, cpp_seq_outfile,
+                             num_exact_leaves, str_len)
+        if not result[0]:
+            print("--exact result not match! {}".format(result[1]))
+            exit(1)
+
+        # long enough to be killed after its first checkpoint
+        tree = generate_tree_structure(num_checkpoint_leaves)
+        generate_input_file(tree,
+                            assign_strings(tree, num_checkpoint_leaves),
+                            new_input_file)
+        result = check_checkpoint(new_input_file, cpp_par_outfile,
+                                  checkpoint_file, num_threads)
+        if not result[0]:
+            print("--checkpoint result not match!")
+            exit(1)
+
     if run_python_version:
         avg_python_time = total_python_time / float(epoch) * 1000
     avg_cpp_seq_time = total_cpp_seq_time / float(epoch) * 1000
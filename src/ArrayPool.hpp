@@ -0,0 +1,70 @@
+//
+//  ArrayPool.hpp
+//  LargeParsimonyProblem
+//
+//  Fixed-length arrays that are handed out as shared_ptr and go back to the
+//  pool instead of the heap when the last owner lets go.
+//
+
+#ifndef ArrayPool_hpp
+#define ArrayPool_hpp
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+template <class T>
+class ArrayPool {
+ public:
+  // length of every array of the pool
+  int array_len_;
+
+  ArrayPool(int array_len) : array_len_{array_len}, free_list_{new FreeList} {}
+
+  ~ArrayPool() = default;
+
+  /**
+   * Take an array from the pool, or from the heap if the pool is empty. Safe
+   * to call from several threads.
+   *
+   * @return an array of length array_len_ with unspecified contents, it goes
+   * back to the pool when its last shared_ptr is gone (even after the pool
+   * itself is destroyed)
+   */
+  shared_ptr<T> acquire() {
+    T *array = nullptr;
+    {
+      lock_guard<mutex> guard(free_list_.get()->lock_);
+      if (!free_list_.get()->arrays_.empty()) {
+        array = free_list_.get()->arrays_.back();
+        free_list_.get()->arrays_.pop_back();
+      }
+    }
+    if (array == nullptr) {
+      array = new T[array_len_];
+    }
+    shared_ptr<FreeList> free_list = free_list_;
+    return shared_ptr<T>(array, [free_list](T *p) {
+      lock_guard<mutex> guard(free_list.get()->lock_);
+      free_list.get()->arrays_.push_back(p);
+    });
+  }
+
+ private:
+  // shared with the deleters, so arrays outliving the pool can still return
+  struct FreeList {
+    mutex lock_;
+    vector<T *> arrays_;
+    ~FreeList() {
+      for (T *p : arrays_) {
+        delete[] p;
+      }
+    }
+  };
+
+  shared_ptr<FreeList> free_list_;
+};
+
+#endif /* ArrayPool_hpp */
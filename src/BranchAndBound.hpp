@@ -0,0 +1,477 @@
+//
+//  BranchAndBound.hpp
+//  LargeParsimonyProblem
+//
+//  Exact search for few leaves. Adding the leaves one at a time on every
+//  edge of the tree so far makes each unrooted binary tree exactly once, and
+//  a partial tree is cut off as soon as its Fitch score plus a lower bound
+//  for the leaves still to add is over the best score found. That score is
+//  shared by every thread, each of which searches its own partial trees.
+//
+
+#ifndef BranchAndBound_hpp
+#define BranchAndBound_hpp
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <vector>
+#include "FitchParsimony.hpp"
+#include "SitePatterns.hpp"
+
+using namespace std;
+
+// a tree of the first leaves of the leaf order, searched from on its own
+struct BranchTask {
+  vector<int> unrooted_undirectional_tree;
+  int num_added;
+  int score;
+};
+
+class BranchAndBound {
+ public:
+  // the number of trees grows as (2n - 5)!!, past this many leaves the
+  // search is rejected instead of running for days
+  static const int max_num_leaves_ = 20;
+
+  // N, the leaves are node 0 ... num_leaves_ - 1
+  int num_nodes_;
+
+  int num_leaves_;
+
+  // n nodes, never change!!!
+  shared_ptr<int> unrooted_undirectional_idx_arr_;
+
+  // the informative patterns of the leaves, as the search scores them
+  shared_ptr<FitchParsimony> fitch_parsimony_;
+
+  // length of the bit-planes of one node
+  int node_state_len_;
+
+  // the leaves in the order they are added: each is the one whose cheapest
+  // edge on the tree of those before it costs the most, so that costly
+  // leaves come early and partial trees are cut early
+  vector<int> leaf_order_;
+
+  // no tree of the first k leaves gets the others for less than
+  // bound_arr_[k] more
+  vector<int> bound_arr_;
+
+  // lowest score found by any thread, partial trees over it are cut
+  atomic<int> best_score_;
+
+  /**
+   * @param unrooted_undirectional_idx_arr : index arr of every tree, a leaf
+   * has 1 neighbor and other nodes 3
+   * @param site_patterns : leaf sequences
+   * @param num_nodes : N
+   * @param num_leaves : number of leaves
+   * @param max_score : the score of a known tree over the informative
+   * patterns, the first bound
+   */
+  BranchAndBound(shared_ptr<int> unrooted_undirectional_idx_arr,
+                 shared_ptr<SitePatterns> site_patterns, int num_nodes,
+                 int num_leaves, int max_score)
+      : num_nodes_{num_nodes},
+        num_leaves_{num_leaves},
+        unrooted_undirectional_idx_arr_{unrooted_undirectional_idx_arr},
+        best_score_{max_score} {
+    fitch_parsimony_ = make_shared<FitchParsimony>(
+        site_patterns.get()->char_list_.get(),
+        site_patterns.get()->weight_arr_.get(),
+        site_patterns.get()->num_patterns_, num_nodes + 1, num_leaves);
+    node_state_len_ = fitch_parsimony_.get()->num_words_ * 4;
+    order_leaves();
+    bound_leaves();
+  }
+
+  ~BranchAndBound() = default;
+
+  /**
+   * The partial trees every search starts from, each is one task
+   *
+   * @param min_tasks : leaves are added until there are this many partial
+   * trees, or all of them
+   * @return the partial trees within the bound
+   */
+  vector<BranchTask> split(int min_tasks) {
+    int num_added = 3;
+    long long num_trees = 1;
+    while (num_added < num_leaves_ && num_trees < min_tasks) {
+      num_trees *= 2 * num_added - 3;
+      num_added++;
+    }
+    Workspace workspace(*this);
+    int score = start_tree(workspace);
+    vector<BranchTask> task_arr;
+    branch(workspace, 3, score, num_added, [&](int tree_score) {
+      task_arr.push_back(
+          BranchTask{workspace.unrooted_undirectional_tree, num_added,
+                     tree_score});
+    });
+    return task_arr;
+  }
+
+  /**
+   * Every tree with all leaves that grows from a partial tree and scores at
+   * most best_score_ at the time it is reached. Safe to call from several
+   * threads, each lowers best_score_ for all.
+   *
+   * @param task : the partial tree
+   * @param tree_arr : output, the trees are added in the order they are found
+   * @param score_arr : output, the score of each, trees scoring more than
+   * the final best_score_ are among them
+   */
+  void search(const BranchTask &task, vector<vector<int>> &tree_arr,
+              vector<int> &score_arr) {
+    Workspace workspace(*this);
+    workspace.unrooted_undirectional_tree = task.unrooted_undirectional_tree;
+    branch(workspace, task.num_added, task.score, num_leaves_,
+           [&](int score) {
+             int best_score = best_score_.load();
+             while (score < best_score &&
+                    !best_score_.compare_exchange_weak(best_score, score)) {
+             }
+             tree_arr.push_back(workspace.unrooted_undirectional_tree);
+             score_arr.push_back(score);
+           });
+  }
+
+ private:
+  // an edge (x, y) of a partial tree and the cost of the next leaf on it
+  struct BranchEdge {
+    int cost;
+    int x;
+    int y;
+  };
+
+  // the scratch of one search
+  struct Workspace {
+    // the partial tree, only its nodes are set
+    vector<int> unrooted_undirectional_tree;
+    // Fitch sets of the partial tree rooted at the first leaf: below each
+    // node, and outside of it seen from its parent edge
+    shared_ptr<uint64_t> down_state_arr;
+    shared_ptr<uint64_t> up_state_arr;
+    // the nodes of the partial tree but the root, parents first, and their
+    // parents
+    vector<int> order_arr;
+    vector<int> parent_arr;
+    int num_ordered;
+    // for each number of leaves, the edges of the partial tree left to try
+    vector<vector<BranchEdge>> edge_arr;
+
+    Workspace(const BranchAndBound &branch_and_bound)
+        : unrooted_undirectional_tree((branch_and_bound.num_nodes_ - 1) * 2,
+                                      -1),
+          order_arr(branch_and_bound.num_nodes_),
+          parent_arr(branch_and_bound.num_nodes_),
+          num_ordered{0},
+          edge_arr(branch_and_bound.num_leaves_ + 1) {
+      int state_arr_len =
+          branch_and_bound.fitch_parsimony_.get()->state_arr_len();
+      down_state_arr = shared_ptr<uint64_t>(new uint64_t[state_arr_len],
+                                            [](uint64_t *p) { delete[] p; });
+      up_state_arr = shared_ptr<uint64_t>(new uint64_t[state_arr_len],
+                                          [](uint64_t *p) { delete[] p; });
+    }
+  };
+
+  /**
+   * Add leaf order[num_added] on every edge within the bound, cheapest
+   * first, and go on until stop_added leaves are in
+   *
+   * @param visit : called with the score of every tree of stop_added leaves
+   * within the bound, while it is in workspace
+   */
+  template <class Visit>
+  void branch(Workspace &workspace, int num_added, int score, int stop_added,
+              const Visit &visit) {
+    if (score + bound_arr_[num_added] > best_score_.load()) {
+      return;
+    }
+    if (num_added == stop_added) {
+      visit(score);
+      return;
+    }
+    auto fitch_parsimony = fitch_parsimony_.get();
+    int leaf = leaf_order_[num_added];
+    const uint64_t *leaf_states =
+        fitch_parsimony->get_node_states(nullptr, leaf);
+    load_passes(workspace);
+    vector<BranchEdge> &edge_arr = workspace.edge_arr[num_added];
+    edge_arr.clear();
+    int max_cost = best_score_.load() - score - bound_arr_[num_added + 1];
+    for (int i = 0; i < workspace.num_ordered; i++) {
+      int cost = edge_cost(workspace, i, leaf_states);
+      if (cost <= max_cost) {
+        int x = workspace.order_arr[i];
+        edge_arr.push_back(BranchEdge{cost, x, workspace.parent_arr[x]});
+      }
+    }
+    stable_sort(edge_arr.begin(), edge_arr.end(),
+                [](const BranchEdge &e, const BranchEdge &f) {
+                  return e.cost < f.cost;
+                });
+
+    // node numbers follow the order the internal nodes are made in
+    int node = num_leaves_ + num_added - 2;
+    for (const BranchEdge &edge : edge_arr) {
+      insert_leaf(workspace, leaf, node, edge.x, edge.y);
+      branch(workspace, num_added + 1, score + edge.cost, stop_added, visit);
+      replace_neighbor(workspace, edge.x, node, edge.y);
+      replace_neighbor(workspace, edge.y, node, edge.x);
+    }
+  }
+
+  // put the first three leaves around the first internal node, and return
+  // the score of that tree
+  int start_tree(Workspace &workspace) {
+    auto fitch_parsimony = fitch_parsimony_.get();
+    const int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    int *tree = workspace.unrooted_undirectional_tree.data();
+    int center = num_leaves_;
+    for (int j = 0; j < 3; j++) {
+      tree[idx_arr[center] + j] = leaf_order_[j];
+      tree[idx_arr[leaf_order_[j]]] = center;
+    }
+    uint64_t *pair_states = workspace.down_state_arr.get();
+    int score = fitch_parsimony->fitch_join(
+        fitch_parsimony->get_node_states(nullptr, leaf_order_[0]),
+        fitch_parsimony->get_node_states(nullptr, leaf_order_[1]),
+        pair_states);
+    return score + fitch_parsimony->fitch_join(
+                       pair_states,
+                       fitch_parsimony->get_node_states(nullptr,
+                                                        leaf_order_[2]),
+                       workspace.up_state_arr.get());
+  }
+
+  // hang leaf on the edge (x, y) through the new internal node
+  void insert_leaf(Workspace &workspace, int leaf, int node, int x, int y) {
+    const int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    int *tree = workspace.unrooted_undirectional_tree.data();
+    replace_neighbor(workspace, x, y, node);
+    replace_neighbor(workspace, y, x, node);
+    tree[idx_arr[node]] = x;
+    tree[idx_arr[node] + 1] = y;
+    tree[idx_arr[node] + 2] = leaf;
+    tree[idx_arr[leaf]] = node;
+  }
+
+  void replace_neighbor(Workspace &workspace, int node, int old_neighbor,
+                        int new_neighbor) {
+    int *tree = workspace.unrooted_undirectional_tree.data();
+    int idx = unrooted_undirectional_idx_arr_.get()[node];
+    while (tree[idx] != old_neighbor) {
+      idx++;
+    }
+    tree[idx] = new_neighbor;
+  }
+
+  // cost of leaf_states on the edge of workspace.order_arr[i] and its parent
+  int edge_cost(const Workspace &workspace, int i,
+                const uint64_t *leaf_states) const {
+    auto fitch_parsimony = fitch_parsimony_.get();
+    int node = workspace.order_arr[i];
+    return fitch_parsimony->fitch_regraft_cost(
+        fitch_parsimony->get_node_states(workspace.down_state_arr.get(), node),
+        workspace.up_state_arr.get() + node * node_state_len_, leaf_states);
+  }
+
+  // Fitch sets on both sides of every edge of the partial tree, rooted at
+  // the first leaf of the order
+  void load_passes(Workspace &workspace) {
+    auto fitch_parsimony = fitch_parsimony_.get();
+    const int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    const int *tree = workspace.unrooted_undirectional_tree.data();
+    int *order_arr = workspace.order_arr.data();
+    int *parent_arr = workspace.parent_arr.data();
+    uint64_t *down_state_arr = workspace.down_state_arr.get();
+    uint64_t *up_state_arr = workspace.up_state_arr.get();
+    int root = leaf_order_[0];
+
+    // breadth first from the root leaf
+    int num_ordered = 0;
+    order_arr[num_ordered++] = tree[idx_arr[root]];
+    parent_arr[order_arr[0]] = root;
+    for (int i = 0; i < num_ordered; i++) {
+      int node = order_arr[i];
+      if (node < num_leaves_) {
+        continue;
+      }
+      for (int j = 0; j < 3; j++) {
+        int neighbor = tree[idx_arr[node] + j];
+        if (neighbor != parent_arr[node]) {
+          parent_arr[neighbor] = node;
+          order_arr[num_ordered++] = neighbor;
+        }
+      }
+    }
+    workspace.num_ordered = num_ordered;
+
+    // children before parents
+    for (int i = num_ordered - 1; i >= 0; i--) {
+      int node = order_arr[i];
+      if (node < num_leaves_) {
+        continue;
+      }
+      int child_arr[2];
+      int num_children = 0;
+      for (int j = 0; j < 3; j++) {
+        int neighbor = tree[idx_arr[node] + j];
+        if (neighbor != parent_arr[node]) {
+          child_arr[num_children++] = neighbor;
+        }
+      }
+      fitch_parsimony->fitch_join(
+          fitch_parsimony->get_node_states(down_state_arr, child_arr[0]),
+          fitch_parsimony->get_node_states(down_state_arr, child_arr[1]),
+          down_state_arr + node * node_state_len_);
+    }
+
+    // parents before children
+    const uint64_t *root_states =
+        fitch_parsimony->get_node_states(nullptr, root);
+    copy(root_states, root_states + node_state_len_,
+         up_state_arr + order_arr[0] * node_state_len_);
+    for (int i = 0; i < num_ordered; i++) {
+      int node = order_arr[i];
+      if (node < num_leaves_) {
+        continue;
+      }
+      int child_arr[2];
+      int num_children = 0;
+      for (int j = 0; j < 3; j++) {
+        int neighbor = tree[idx_arr[node] + j];
+        if (neighbor != parent_arr[node]) {
+          child_arr[num_children++] = neighbor;
+        }
+      }
+      for (int j = 0; j < 2; j++) {
+        fitch_parsimony->fitch_join(
+            up_state_arr + node * node_state_len_,
+            fitch_parsimony->get_node_states(down_state_arr, child_arr[1 - j]),
+            up_state_arr + child_arr[j] * node_state_len_);
+      }
+    }
+  }
+
+  // fill leaf_order_ (max-mini): the two leaves that differ the most, the
+  // leaf that costs the most on them, then one leaf at a time on the
+  // cheapest edge of the tree so far
+  void order_leaves() {
+    auto fitch_parsimony = fitch_parsimony_.get();
+    vector<bool> added(num_leaves_, false);
+    int first = 0;
+    int second = 1;
+    int max_cost = -1;
+    for (int i = 0; i < num_leaves_; i++) {
+      for (int j = i + 1; j < num_leaves_; j++) {
+        int cost = fitch_parsimony->fitch_join_cost(
+            fitch_parsimony->get_node_states(nullptr, i),
+            fitch_parsimony->get_node_states(nullptr, j), INT_MAX);
+        if (cost > max_cost) {
+          max_cost = cost;
+          first = i;
+          second = j;
+        }
+      }
+    }
+    leaf_order_.push_back(first);
+    leaf_order_.push_back(second);
+    added[first] = true;
+    added[second] = true;
+    int third = -1;
+    max_cost = -1;
+    for (int leaf = 0; leaf < num_leaves_; leaf++) {
+      if (added[leaf]) {
+        continue;
+      }
+      int cost = fitch_parsimony->fitch_regraft_cost(
+          fitch_parsimony->get_node_states(nullptr, first),
+          fitch_parsimony->get_node_states(nullptr, second),
+          fitch_parsimony->get_node_states(nullptr, leaf));
+      if (cost > max_cost) {
+        max_cost = cost;
+        third = leaf;
+      }
+    }
+    leaf_order_.push_back(third);
+    added[third] = true;
+
+    Workspace workspace(*this);
+    start_tree(workspace);
+    for (int num_added = 3; num_added < num_leaves_; num_added++) {
+      load_passes(workspace);
+      int next_leaf = -1;
+      int next_edge = -1;
+      max_cost = -1;
+      for (int leaf = 0; leaf < num_leaves_; leaf++) {
+        if (added[leaf]) {
+          continue;
+        }
+        const uint64_t *leaf_states =
+            fitch_parsimony->get_node_states(nullptr, leaf);
+        int min_edge = 0;
+        int min_cost = edge_cost(workspace, 0, leaf_states);
+        for (int i = 1; i < workspace.num_ordered; i++) {
+          int cost = edge_cost(workspace, i, leaf_states);
+          if (cost < min_cost) {
+            min_cost = cost;
+            min_edge = i;
+          }
+        }
+        if (min_cost > max_cost) {
+          max_cost = min_cost;
+          next_leaf = leaf;
+          next_edge = min_edge;
+        }
+      }
+      int x = workspace.order_arr[next_edge];
+      insert_leaf(workspace, next_leaf, num_leaves_ + num_added - 2, x,
+                  workspace.parent_arr[x]);
+      leaf_order_.push_back(next_leaf);
+      added[next_leaf] = true;
+    }
+  }
+
+  // fill bound_arr_: each state a later leaf has alone that no earlier leaf
+  // has at all is one more change
+  void bound_leaves() {
+    auto fitch_parsimony = fitch_parsimony_.get();
+    // the single-state sets of the leaves from k on, for every k
+    vector<vector<uint64_t>> later_state_arr(
+        num_leaves_ + 1, vector<uint64_t>(node_state_len_, 0));
+    for (int k = num_leaves_ - 1; k >= 0; k--) {
+      const uint64_t *leaf_states =
+          fitch_parsimony->get_node_states(nullptr, leaf_order_[k]);
+      for (int w = 0; w < node_state_len_; w += 4) {
+        for (int j = 0; j < 4; j++) {
+          uint64_t others = leaf_states[w + (j + 1) % 4] |
+                            leaf_states[w + (j + 2) % 4] |
+                            leaf_states[w + (j + 3) % 4];
+          later_state_arr[k][w + j] =
+              later_state_arr[k + 1][w + j] | (leaf_states[w + j] & ~others);
+        }
+      }
+    }
+    vector<uint64_t> earlier_states(node_state_len_, 0);
+    bound_arr_.resize(num_leaves_ + 1);
+    for (int k = 0; k <= num_leaves_; k++) {
+      bound_arr_[k] = fitch_parsimony->new_state_cost(
+          earlier_states.data(), later_state_arr[k].data());
+      if (k < num_leaves_) {
+        const uint64_t *leaf_states =
+            fitch_parsimony->get_node_states(nullptr, leaf_order_[k]);
+        for (int w = 0; w < node_state_len_; w++) {
+          earlier_states[w] |= leaf_states[w];
+        }
+      }
+    }
+  }
+};
+
+#endif /* BranchAndBound_hpp */
@@ -0,0 +1,386 @@
+//
+//  FitchParsimony.hpp
+//  LargeParsimonyProblem
+//
+//  Bit-parallel Fitch scoring for unit-cost DNA.
+//
+
+#ifndef FitchParsimony_hpp
+#define FitchParsimony_hpp
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+class FitchParsimony {
+  // trees here are all rooted and directed
+ public:
+  // number of sites (columns) scored
+  int num_char_trees_;
+
+  // 64 sites are packed into one word
+  int num_words_;
+
+  // N + 1, 1 is the root
+  int num_nodes_;
+
+  // leaves are always node 0 ... num_leaves_ - 1
+  int num_leaves_;
+
+  // weights are split into bits, the cost of a word is
+  // sum(popcount(empty & weight plane b) << b)
+  int num_weight_bits_;
+
+  // weight_plane_arr_[b * num_words_ + w] holds bit b of the weights of the
+  // sites in word w
+  shared_ptr<uint64_t> weight_plane_arr_;
+
+  // state sets of the leaves, stored as 4 bit-planes (A, C, G, T) per word
+  // length: num_leaves_ * num_words_ * 4
+  // data layout: [ACGT][ACGT][ACGT] ([ACGT] is the 4 planes of one word, the
+  // words of one node are contiguous)
+  shared_ptr<uint64_t> leaf_state_arr_;
+
+  /**
+   * Pack the leaf columns of a char list into bit-planes
+   *
+   * Characters other than A, C, G and T are treated as fully ambiguous. The
+   * unused bits of the last word get the full state set so that they never
+   * add to the score.
+   *
+   * @param char_list : length: (str_len) * (N + 1), raw 'A'/'C'/'G'/'T'
+   * @param weight_arr : length: str_len, the cost of a change at each site
+   * @param num_char_trees : str_len
+   * @param num_nodes : N + 1
+   * @param num_leaves : number of leaves
+   */
+  FitchParsimony(const char *char_list, const int *weight_arr,
+                 int num_char_trees, int num_nodes, int num_leaves)
+      : num_char_trees_{num_char_trees},
+        num_words_{(num_char_trees + 63) / 64},
+        num_nodes_{num_nodes},
+        num_leaves_{num_leaves},
+        num_weight_bits_{0} {
+    set_weights(weight_arr);
+
+    int leaf_state_arr_len = num_leaves_ * num_words_ * 4;
+    leaf_state_arr_ = shared_ptr<uint64_t>(new uint64_t[leaf_state_arr_len],
+                                           [](uint64_t *p) { delete[] p; });
+    uint64_t *leaf_state_arr = leaf_state_arr_.get();
+    for (int i = 0; i < leaf_state_arr_len; i++) {
+      leaf_state_arr[i] = 0;
+    }
+
+    for (int leaf = 0; leaf < num_leaves_; leaf++) {
+      uint64_t *planes = leaf_state_arr + leaf * num_words_ * 4;
+      for (int site = 0; site < num_words_ * 64; site++) {
+        uint64_t bit = uint64_t(1) << (site & 63);
+        uint64_t *word = planes + (site >> 6) * 4;
+        int state = site < num_char_trees_
+                        ? map_state(char_list[site * num_nodes_ + leaf])
+                        : -1;
+        if (state == -1) {
+          word[0] |= bit;
+          word[1] |= bit;
+          word[2] |= bit;
+          word[3] |= bit;
+        } else {
+          word[state] |= bit;
+        }
+      }
+    }
+  }
+
+  ~FitchParsimony() = default;
+
+  /**
+   * (Re)build the weight planes
+   *
+   * @param weight_arr : length: str_len, non-negative
+   */
+  void set_weights(const int *weight_arr) {
+    int max_weight = 0;
+    for (int site = 0; site < num_char_trees_; site++) {
+      max_weight = max(max_weight, weight_arr[site]);
+    }
+    num_weight_bits_ = 0;
+    while ((max_weight >> num_weight_bits_) > 0) {
+      num_weight_bits_++;
+    }
+
+    int weight_plane_arr_len = max(num_weight_bits_, 1) * num_words_;
+    weight_plane_arr_ = shared_ptr<uint64_t>(
+        new uint64_t[weight_plane_arr_len], [](uint64_t *p) { delete[] p; });
+    uint64_t *weight_plane_arr = weight_plane_arr_.get();
+    for (int i = 0; i < weight_plane_arr_len; i++) {
+      weight_plane_arr[i] = 0;
+    }
+    for (int site = 0; site < num_char_trees_; site++) {
+      uint64_t bit = uint64_t(1) << (site & 63);
+      for (int b = 0; b < num_weight_bits_; b++) {
+        if ((weight_arr[site] >> b) & 1) {
+          weight_plane_arr[b * num_words_ + (site >> 6)] |= bit;
+        }
+      }
+    }
+  }
+
+  // 'A' 'C' 'G' 'T' to plane index, -1 for anything else
+  static int map_state(char c) {
+    switch (c) {
+      case 'A':
+        return 0;
+      case 'C':
+        return 1;
+      case 'G':
+        return 2;
+      case 'T':
+        return 3;
+      default:
+        return -1;
+    }
+  }
+
+  // length of a state array covering every node of a rooted tree
+  int state_arr_len() const { return num_nodes_ * num_words_ * 4; }
+
+  // bit-planes of a node: leaves are read from leaf_state_arr_, internal nodes
+  // from the caller-owned state_arr
+  uint64_t *get_node_states(uint64_t *state_arr, int node) const {
+    if (node < num_leaves_) {
+      return leaf_state_arr_.get() + node * num_words_ * 4;
+    }
+    return state_arr + node * num_words_ * 4;
+  }
+
+  /**
+   * Fitch step for one node: parent = left & right where they intersect,
+   * left | right where they do not
+   *
+   * @param left : bit-planes of the left child
+   * @param right : bit-planes of the right child
+   * @param parent : output bit-planes
+   * @return the total weight of the sites with an empty intersection
+   */
+  int fitch_join(const uint64_t *left, const uint64_t *right,
+                 uint64_t *parent) const {
+    const uint64_t *weight_plane_arr = weight_plane_arr_.get();
+    int score = 0;
+    for (int w = 0; w < num_words_ * 4; w += 4) {
+      uint64_t a = left[w] & right[w];
+      uint64_t c = left[w + 1] & right[w + 1];
+      uint64_t g = left[w + 2] & right[w + 2];
+      uint64_t t = left[w + 3] & right[w + 3];
+      uint64_t empty = ~(a | c | g | t);
+
+      parent[w] = a | ((left[w] | right[w]) & empty);
+      parent[w + 1] = c | ((left[w + 1] | right[w + 1]) & empty);
+      parent[w + 2] = g | ((left[w + 2] | right[w + 2]) & empty);
+      parent[w + 3] = t | ((left[w + 3] | right[w + 3]) & empty);
+      for (int b = 0; b < num_weight_bits_; b++) {
+        score += __builtin_popcountll(
+                     empty & weight_plane_arr[b * num_words_ + (w >> 2)])
+                 << b;
+      }
+    }
+    return score;
+  }
+
+  /**
+   * Cost of a subtree hung on the edge between two Fitch sets: the Fitch
+   * step of the edge, then the one that joins the subtree. Nothing is stored.
+   *
+   * @param outside : bit-planes of one side of the edge
+   * @param inside : bit-planes of the other side of the edge
+   * @param subtree : bit-planes of the subtree
+   * @return the total weight of the sites where the subtree misses the Fitch
+   * set of the edge
+   */
+  int fitch_regraft_cost(const uint64_t *outside, const uint64_t *inside,
+                         const uint64_t *subtree) const {
+    const uint64_t *weight_plane_arr = weight_plane_arr_.get();
+    int score = 0;
+    for (int w = 0; w < num_words_ * 4; w += 4) {
+      uint64_t a = outside[w] & inside[w];
+      uint64_t c = outside[w + 1] & inside[w + 1];
+      uint64_t g = outside[w + 2] & inside[w + 2];
+      uint64_t t = outside[w + 3] & inside[w + 3];
+      uint64_t empty = ~(a | c | g | t);
+      a |= (outside[w] | inside[w]) & empty;
+      c |= (outside[w + 1] | inside[w + 1]) & empty;
+      g |= (outside[w + 2] | inside[w + 2]) & empty;
+      t |= (outside[w + 3] | inside[w + 3]) & empty;
+      uint64_t miss = ~((a & subtree[w]) | (c & subtree[w + 1]) |
+                        (g & subtree[w + 2]) | (t & subtree[w + 3]));
+      for (int b = 0; b < num_weight_bits_; b++) {
+        score += __builtin_popcountll(
+                     miss & weight_plane_arr[b * num_words_ + (w >> 2)])
+                 << b;
+      }
+    }
+    return score;
+  }
+
+  /**
+   * Total weight of the sites where two Fitch sets do not intersect, the cost
+   * of the edge that joins them. Gives up once it is over max_cost, the
+   * weights only add up.
+   *
+   * @param left : bit-planes of one side of the edge
+   * @param right : bit-planes of the other side
+   * @param max_cost : the highest cost still of interest
+   * @return the cost, or something over max_cost
+   */
+  int fitch_join_cost(const uint64_t *left, const uint64_t *right,
+                      int max_cost) const {
+    const uint64_t *weight_plane_arr = weight_plane_arr_.get();
+    int score = 0;
+    for (int w = 0; w < num_words_ * 4 && score <= max_cost; w += 4) {
+      uint64_t empty = ~((left[w] & right[w]) | (left[w + 1] & right[w + 1]) |
+                         (left[w + 2] & right[w + 2]) |
+                         (left[w + 3] & right[w + 3]));
+      for (int b = 0; b < num_weight_bits_; b++) {
+        score += __builtin_popcountll(
+                     empty & weight_plane_arr[b * num_words_ + (w >> 2)])
+                 << b;
+      }
+    }
+    return score;
+  }
+
+  /**
+   * Lower bound on the cost of adding leaves to a tree: at every site, each
+   * state that a leaf to add has as its only state, and no leaf of the tree
+   * has at all, takes at least one more change
+   *
+   * @param tree_states : bit-planes, the union of the leaf sets of the tree
+   * @param leaf_states : bit-planes, the union of the single-state sets of
+   * the leaves to add
+   * @return the total weight of those changes
+   */
+  int new_state_cost(const uint64_t *tree_states,
+                     const uint64_t *leaf_states) const {
+    const uint64_t *weight_plane_arr = weight_plane_arr_.get();
+    int score = 0;
+    for (int w = 0; w < num_words_ * 4; w++) {
+      uint64_t added = leaf_states[w] & ~tree_states[w];
+      for (int b = 0; b < num_weight_bits_; b++) {
+        score += __builtin_popcountll(
+                     added & weight_plane_arr[b * num_words_ + (w >> 2)])
+                 << b;
+      }
+    }
+    return score;
+  }
+
+  /**
+   * Score a rooted & directed tree over all sites
+   *
+   * @param rooted_directional_tree : children arr of the tree
+   * @param rooted_directional_idx_arr : rooted_directional_idx_arr[a] == b
+   * means that the children of a are stored at rooted_directional_tree[b]
+   * @param rooted_postorder_arr : the internal nodes, children before parents,
+   * the root last
+   * @param state_arr : scratch, length state_arr_len(); holds the Fitch sets
+   * of every internal node on return
+   * @return the small parsimony score of the tree
+   */
+  int run_fitch_score(int *rooted_directional_tree,
+                      int *rooted_directional_idx_arr,
+                      int *rooted_postorder_arr, uint64_t *state_arr) {
+    int score = 0;
+    for (int i = 0; i < num_nodes_ - num_leaves_; i++) {
+      int node = rooted_postorder_arr[i];
+      int bias = rooted_directional_idx_arr[node];
+      score += fitch_join(
+          get_node_states(state_arr, rooted_directional_tree[bias]),
+          get_node_states(state_arr, rooted_directional_tree[bias + 1]),
+          get_node_states(state_arr, node));
+    }
+    return score;
+  }
+
+  /**
+   * Fitch traceback: pick one most parsimonious char for every node and append
+   * it to the string list. Must follow run_fitch_score on the same tree.
+   *
+   * @param rooted_directional_tree : children arr of the tree
+   * @param rooted_directional_idx_arr : index arr of the tree
+   * @param rooted_postorder_arr : postorder of the internal nodes, walked
+   * backwards so that parents come first
+   * @param state_arr : the state arr filled by run_fitch_score, overwritten
+   * with the chosen (single) state of every internal node
+   * @param string_list : length N, the string of node i is written to
+   * string_list[i]
+   */
+  void run_fitch_ancestral(int *rooted_directional_tree,
+                           int *rooted_directional_idx_arr,
+                           int *rooted_postorder_arr, uint64_t *state_arr,
+                           string *string_list) {
+    int root = num_nodes_ - 1;
+    uint64_t *root_states = get_node_states(state_arr, root);
+    for (int w = 0; w < num_words_ * 4; w += 4) {
+      uint64_t taken = 0;
+      for (int k = 0; k < 4; k++) {
+        root_states[w + k] &= ~taken;
+        taken |= root_states[w + k];
+      }
+    }
+
+    unique_ptr<uint64_t[]> leaf_states(new uint64_t[num_words_ * 4]);
+    for (int i = num_nodes_ - num_leaves_ - 1; i >= 0; i--) {
+      int parent = rooted_postorder_arr[i];
+      const uint64_t *parent_states = get_node_states(state_arr, parent);
+      int bias = rooted_directional_idx_arr[parent];
+
+      for (int j = bias; j < bias + 2; j++) {
+        int child = rooted_directional_tree[j];
+        const uint64_t *child_sets = get_node_states(state_arr, child);
+        // leaves keep their input sets, decode their choice into a side buffer
+        uint64_t *child_states =
+            child < num_leaves_ ? leaf_states.get()
+                                : get_node_states(state_arr, child);
+
+        for (int w = 0; w < num_words_ * 4; w += 4) {
+          uint64_t keep[4];
+          uint64_t kept = 0;
+          for (int k = 0; k < 4; k++) {
+            keep[k] = parent_states[w + k] & child_sets[w + k];
+            kept |= keep[k];
+          }
+          // sites where the parent's char is not in the child's set take the
+          // first char of the child's set
+          uint64_t taken = kept;
+          for (int k = 0; k < 4; k++) {
+            uint64_t first = child_sets[w + k] & ~taken;
+            taken |= first;
+            child_states[w + k] = keep[k] | first;
+          }
+        }
+
+        append_states(child_states, string_list[child]);
+      }
+    }
+  }
+
+  // decode single-state bit-planes into chars and append them to str
+  void append_states(const uint64_t *states, string &str) const {
+    const char ACGT_arr[4] = {'A', 'C', 'G', 'T'};
+    size_t offset = str.size();
+    str.resize(offset + num_char_trees_);
+    for (int site = 0; site < num_char_trees_; site++) {
+      const uint64_t *word = states + (site >> 6) * 4;
+      uint64_t bit = uint64_t(1) << (site & 63);
+      int k = 0;
+      while (k < 3 && !(word[k] & bit)) {
+        k++;
+      }
+      str[offset + site] = ACGT_arr[k];
+    }
+  }
+};
+
+#endif /* FitchParsimony_hpp */
@@ -0,0 +1,188 @@
+//
+//  FitchSpr.hpp
+//  LargeParsimonyProblem
+//
+//  Score subtree prune-and-regraft moves from the Fitch sets of both sides
+//  of every edge. The tree without the pruned subtree scores the same
+//  wherever it is rooted, so each regraft edge only adds one Fitch step over
+//  the sites, and the sets of the edges are built outwards from the pruned
+//  node one step per edge.
+//
+
+#ifndef FitchSpr_hpp
+#define FitchSpr_hpp
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include "FitchParsimony.hpp"
+#include "FitchUpDown.hpp"
+#include "TopologyTable.hpp"
+
+using namespace std;
+
+class FitchSpr {
+ public:
+  shared_ptr<FitchParsimony> fitch_parsimony_;
+
+  int num_leaves_;
+
+  // length of the bit-planes of one node
+  int node_state_len_;
+
+  // regraft edges are at most this many edges away from the pruned node, 1
+  // gives the nearest neighbor interchanges
+  int radius_;
+
+  /**
+   * @param fitch_parsimony : the leaves and weights every tree is scored with
+   * @param radius : see radius_
+   */
+  FitchSpr(shared_ptr<FitchParsimony> fitch_parsimony, int radius)
+      : fitch_parsimony_{fitch_parsimony},
+        num_leaves_{fitch_parsimony.get()->num_leaves_},
+        node_state_len_{fitch_parsimony.get()->num_words_ * 4},
+        radius_{radius} {
+    // no path is longer than the tree has nodes
+    int num_levels = min(radius_, fitch_parsimony.get()->num_nodes_);
+    level_state_arr_ = shared_ptr<uint64_t>(
+        new uint64_t[(num_levels + 1) * node_state_len_],
+        [](uint64_t *p) { delete[] p; });
+  }
+
+  ~FitchSpr() = default;
+
+  /**
+   * Prune the subtree that hangs from s at its neighbor p, an internal node,
+   * and call visit(x, y, tree_hash) for every edge (x, y) of the rest of the
+   * tree within radius_ edges of p, x on the side of p. The edge p was
+   * pruned from is skipped, it gives back the loaded tree. up_down is left
+   * unchanged.
+   *
+   * @param up_down : Fitch sets of the tree
+   * @param topology_hash : split hashes of the same tree
+   * @param unrooted_undirectional_idx_arr : index arr of the same tree
+   * @param unrooted_undirectional_tree : the same tree, unrooted
+   * @param visit : tree_hash is the hash of the tree with the subtree
+   * regrafted on (x, y), visit may call regraft_score() for its score
+   */
+  template <class Visit>
+  void for_each_regraft(const FitchUpDown &up_down,
+                        const TopologyHash &topology_hash,
+                        const int *unrooted_undirectional_idx_arr,
+                        const int *unrooted_undirectional_tree, int p, int s,
+                        Visit visit) {
+    up_down_ = &up_down;
+    topology_hash_ = &topology_hash;
+    idx_arr_ = unrooted_undirectional_idx_arr;
+    tree_ = unrooted_undirectional_tree;
+
+    // p goes with the subtree, its other neighbors q and r are joined
+    int q = -1;
+    int r = -1;
+    for (int j = 0; j < 3; j++) {
+      int neighbor = tree_[idx_arr_[p] + j];
+      if (neighbor != s) {
+        (q == -1 ? q : r) = neighbor;
+      }
+    }
+    int score_s, score_q, score_r;
+    subtree_states_ = up_down.get_subtree(s, p, score_s);
+    const uint64_t *q_states = up_down.get_subtree(q, p, score_q);
+    const uint64_t *r_states = up_down.get_subtree(r, p, score_r);
+    // the scores of the pruned subtree and of the rest of the tree
+    base_score_ = score_s + score_q + score_r +
+                  fitch_parsimony_.get()->fitch_join(q_states, r_states,
+                                                     level_state_arr_.get());
+
+    // regrafted on the side of q, the edge (p, r) stays as (q, r) and the
+    // split of (p, q) is gone, and the other way round
+    subtree_key_ = topology_hash.get_subtree_key(s, p);
+    uint64_t q_key = topology_hash.get_subtree_key(q, p);
+    uint64_t r_key = topology_hash.get_subtree_key(r, p);
+    walk(q, p, r_states, 1,
+         topology_hash.tree_hash_ - topology_hash.split_hash(q_key), visit);
+    walk(r, p, q_states, 1,
+         topology_hash.tree_hash_ - topology_hash.split_hash(r_key), visit);
+  }
+
+  // small parsimony score of the tree with the subtree regrafted on the edge
+  // visit() was called with, only valid inside visit()
+  int regraft_score() const {
+    return base_score_ + fitch_parsimony_.get()->fitch_regraft_cost(
+                             outside_states_, inside_states_, subtree_states_);
+  }
+
+  // Fitch set of the rest of the tree rooted on the edge visit() was called
+  // with, only valid inside visit()
+  void regraft_states(uint64_t *states) const {
+    fitch_parsimony_.get()->fitch_join(outside_states_, inside_states_,
+                                       states);
+  }
+
+ private:
+  // level_state_arr_ + d * node_state_len_ holds the Fitch set of the near
+  // side of the edge being visited d edges away from the pruned node, level
+  // 0 is scratch
+  shared_ptr<uint64_t> level_state_arr_;
+
+  // the loaded tree and the move being walked
+  const FitchUpDown *up_down_;
+  const TopologyHash *topology_hash_;
+  const int *idx_arr_;
+  const int *tree_;
+  const uint64_t *subtree_states_;
+  uint64_t subtree_key_;
+  int base_score_;
+  // both sides of the edge being visited
+  const uint64_t *outside_states_;
+  const uint64_t *inside_states_;
+
+  /**
+   * Visit the edges from x away from prev, then the edges beyond them
+   *
+   * @param outside : Fitch set of everything on the side of prev, pruned
+   * subtree excluded
+   * @param depth : edges from the pruned node to the edges of x
+   * @param path_hash : hash of the tree with the pruned subtree moved to
+   * the far side of every edge between the pruned node and x, and without
+   * the split it was pruned from
+   */
+  template <class Visit>
+  void walk(int x, int prev, const uint64_t *outside, int depth,
+            uint64_t path_hash, Visit &visit) {
+    if (x < num_leaves_) {
+      return;
+    }
+    auto fitch_parsimony = fitch_parsimony_.get();
+    uint64_t *states = level_state_arr_.get() + depth * node_state_len_;
+    int bias = idx_arr_[x];
+    for (int j = 0; j < 3; j++) {
+      int y = tree_[bias + j];
+      if (y == prev) {
+        continue;
+      }
+      int y_other = tree_[bias + (j + 1) % 3];
+      if (y_other == prev) {
+        y_other = tree_[bias + (j + 2) % 3];
+      }
+      int score;
+      fitch_parsimony->fitch_join(
+          outside, up_down_->get_subtree(y_other, x, score), states);
+      outside_states_ = states;
+      inside_states_ = up_down_->get_subtree(y, x, score);
+
+      // the split of (x, y) is kept on the side of y, and the regraft adds
+      // the one with the subtree next to it
+      uint64_t key = topology_hash_->get_subtree_key(y, x);
+      uint64_t moved_hash = topology_hash_->split_hash(key ^ subtree_key_);
+      visit(x, y, path_hash + moved_hash);
+      if (depth < radius_) {
+        walk(y, x, states, depth + 1,
+             path_hash + moved_hash - topology_hash_->split_hash(key), visit);
+      }
+    }
+  }
+};
+
+#endif /* FitchSpr_hpp */
@@ -0,0 +1,202 @@
+//
+//  FitchTbr.hpp
+//  LargeParsimonyProblem
+//
+//  Score tree bisection-reconnection moves. Cutting an edge leaves two trees
+//  that each score the same wherever they are rooted, so a reconnection only
+//  adds the cost of the new edge between the Fitch sets of its two ends. The
+//  sets of every reconnection edge of one half are built once per cut, and
+//  each pair is then one bitwise pass that stops as soon as it is too costly.
+//
+
+#ifndef FitchTbr_hpp
+#define FitchTbr_hpp
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include "FitchParsimony.hpp"
+#include "FitchSpr.hpp"
+#include "FitchUpDown.hpp"
+#include "TopologyTable.hpp"
+
+using namespace std;
+
+class FitchTbr {
+ public:
+  shared_ptr<FitchParsimony> fitch_parsimony_;
+
+  int num_leaves_;
+
+  // length of the bit-planes of one node
+  int node_state_len_;
+
+  // reconnection edges are at most this many edges away from the cut, on
+  // either side
+  int radius_;
+
+  // most reconnection edges of one half, the edge its cut end is
+  // removed from included
+  int max_side_edges_;
+
+  /**
+   * @param fitch_parsimony : the leaves and weights every tree is scored with
+   * @param radius : see radius_
+   */
+  FitchTbr(shared_ptr<FitchParsimony> fitch_parsimony, int radius)
+      : fitch_parsimony_{fitch_parsimony},
+        num_leaves_{fitch_parsimony.get()->num_leaves_},
+        node_state_len_{fitch_parsimony.get()->num_words_ * 4},
+        radius_{radius},
+        fitch_spr_{fitch_parsimony, radius} {
+    // both walks from the cut end double at every step, and no half has
+    // more edges than the tree has nodes
+    int num_nodes = fitch_parsimony.get()->num_nodes_;
+    max_side_edges_ =
+        radius_ < 24 ? min(num_nodes, (1 << (radius_ + 2)) - 3) : num_nodes;
+    for (int side = 0; side < 2; side++) {
+      side_state_arr_[side] = shared_ptr<uint64_t>(
+          new uint64_t[max_side_edges_ * node_state_len_],
+          [](uint64_t *p) { delete[] p; });
+      side_edge_arr_[side] = shared_ptr<int>(new int[max_side_edges_ * 2],
+                                             [](int *p) { delete[] p; });
+      side_hash_arr_[side] = shared_ptr<uint64_t>(
+          new uint64_t[max_side_edges_], [](uint64_t *p) { delete[] p; });
+    }
+  }
+
+  ~FitchTbr() = default;
+
+  /**
+   * Cut the edge (a, b) and call visit(xa, ya, xb, yb, tree_hash, score) for
+   * every reconnection of the two halves that scores at most max_score: a
+   * goes onto the edge (xa, ya) of its half and b onto (xb, yb) of its own,
+   * each within radius_ edges of the cut. xa is -1 when the half of a is
+   * reconnected where it was cut, and xb likewise; the loaded tree itself is
+   * skipped. up_down is left unchanged.
+   *
+   * @param up_down : Fitch sets of the tree
+   * @param topology_hash : split hashes of the same tree
+   * @param unrooted_undirectional_idx_arr : index arr of the same tree
+   * @param unrooted_undirectional_tree : the same tree, unrooted
+   * @param max_score : read again for every reconnection, so the caller may
+   * lower it from visit
+   * @param visit : tree_hash is the hash of the reconnected tree and score
+   * its small parsimony score
+   */
+  template <class Visit>
+  void for_each_reconnection(const FitchUpDown &up_down,
+                             const TopologyHash &topology_hash,
+                             const int *unrooted_undirectional_idx_arr,
+                             const int *unrooted_undirectional_tree, int a,
+                             int b, const int &max_score, Visit visit) {
+    int base_score = 0;
+    int num_side_edges[2];
+    num_side_edges[0] = collect_side(up_down, topology_hash,
+                                     unrooted_undirectional_idx_arr,
+                                     unrooted_undirectional_tree, 0, a, b,
+                                     base_score);
+    num_side_edges[1] = collect_side(up_down, topology_hash,
+                                     unrooted_undirectional_idx_arr,
+                                     unrooted_undirectional_tree, 1, b, a,
+                                     base_score);
+    // no reconnection scores less than the two halves apart
+    if (base_score > max_score) {
+      return;
+    }
+
+    const uint64_t *a_state_arr = side_state_arr_[0].get();
+    const uint64_t *b_state_arr = side_state_arr_[1].get();
+    const int *a_edge_arr = side_edge_arr_[0].get();
+    const int *b_edge_arr = side_edge_arr_[1].get();
+    for (int i = 0; i < num_side_edges[0]; i++) {
+      for (int j = i == 0 ? 1 : 0; j < num_side_edges[1]; j++) {
+        int max_cost = max_score - base_score;
+        int cost = fitch_parsimony_.get()->fitch_join_cost(
+            a_state_arr + i * node_state_len_,
+            b_state_arr + j * node_state_len_, max_cost);
+        if (cost > max_cost) {
+          continue;
+        }
+        // the splits of each half only change on the path from its cut end
+        // to its reconnection edge
+        uint64_t tree_hash = topology_hash.tree_hash_ +
+                             side_hash_arr_[0].get()[i] +
+                             side_hash_arr_[1].get()[j];
+        visit(a_edge_arr[i * 2], a_edge_arr[i * 2 + 1], b_edge_arr[j * 2],
+              b_edge_arr[j * 2 + 1], tree_hash, base_score + cost);
+      }
+    }
+  }
+
+ private:
+  // the regrafts of one half around the other give its reconnection edges
+  FitchSpr fitch_spr_;
+
+  // for the half of a (0) and of b (1), edge i holds the Fitch set of the
+  // half rooted on it at side_state_arr_[side] + i * node_state_len_, its
+  // ends at side_edge_arr_[side][2 * i] and [2 * i + 1], and the change of
+  // the tree hash at side_hash_arr_[side][i]. Edge 0 is where the cut end
+  // was removed from, with -1 for its ends
+  shared_ptr<uint64_t> side_state_arr_[2];
+  shared_ptr<int> side_edge_arr_[2];
+  shared_ptr<uint64_t> side_hash_arr_[2];
+
+  /**
+   * Fill the reconnection edges of the half of a after cutting (a, b)
+   *
+   * @param base_score : the score of the half is added to it
+   * @return the number of reconnection edges
+   */
+  int collect_side(const FitchUpDown &up_down,
+                   const TopologyHash &topology_hash,
+                   const int *unrooted_undirectional_idx_arr,
+                   const int *unrooted_undirectional_tree, int side, int a,
+                   int b, int &base_score) {
+    uint64_t *state_arr = side_state_arr_[side].get();
+    int *edge_arr = side_edge_arr_[side].get();
+    uint64_t *hash_arr = side_hash_arr_[side].get();
+    edge_arr[0] = -1;
+    edge_arr[1] = -1;
+    hash_arr[0] = 0;
+    int score;
+    if (a < num_leaves_) {
+      // a single leaf, only reconnected by itself
+      const uint64_t *leaf_states = up_down.get_subtree(a, b, score);
+      copy(leaf_states, leaf_states + node_state_len_, state_arr);
+      return 1;
+    }
+
+    // a goes with the cut, its other neighbors q and r are joined
+    int q = -1;
+    int r = -1;
+    int bias = unrooted_undirectional_idx_arr[a];
+    for (int j = 0; j < 3; j++) {
+      int neighbor = unrooted_undirectional_tree[bias + j];
+      if (neighbor != b) {
+        (q == -1 ? q : r) = neighbor;
+      }
+    }
+    int score_q, score_r;
+    const uint64_t *q_states = up_down.get_subtree(q, a, score_q);
+    const uint64_t *r_states = up_down.get_subtree(r, a, score_r);
+    base_score += score_q + score_r +
+                  fitch_parsimony_.get()->fitch_join(q_states, r_states,
+                                                     state_arr);
+
+    int num_edges = 1;
+    fitch_spr_.for_each_regraft(
+        up_down, topology_hash, unrooted_undirectional_idx_arr,
+        unrooted_undirectional_tree, a, b,
+        [&](int x, int y, uint64_t tree_hash) {
+          fitch_spr_.regraft_states(state_arr + num_edges * node_state_len_);
+          edge_arr[num_edges * 2] = x;
+          edge_arr[num_edges * 2 + 1] = y;
+          hash_arr[num_edges] = tree_hash - topology_hash.tree_hash_;
+          num_edges++;
+        });
+    return num_edges;
+  }
+};
+
+#endif /* FitchTbr_hpp */
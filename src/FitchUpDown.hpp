@@ -0,0 +1,192 @@
+//
+//  FitchUpDown.hpp
+//  LargeParsimonyProblem
+//
+//  Fitch sets of both sides of every edge of one tree, so that every nearest
+//  neighbor interchange can be scored from the four subtrees around its edge.
+//
+
+#ifndef FitchUpDown_hpp
+#define FitchUpDown_hpp
+
+#include <stdint.h>
+#include <cstring>
+#include <memory>
+#include "FitchParsimony.hpp"
+
+using namespace std;
+
+class FitchUpDown {
+  // trees here are all rooted and directed
+ public:
+  shared_ptr<FitchParsimony> fitch_parsimony_;
+
+  // N + 1, 1 is the root
+  int num_nodes_;
+
+  int num_leaves_;
+
+  // length of the bit-planes of one node
+  int node_state_len_;
+
+  // -1 for the root
+  // length: N + 1
+  shared_ptr<int> parent_arr_;
+
+  // down pass: Fitch sets and cost of the subtree below each node
+  // fitch_parsimony_->state_arr_len(), leaves are read from fitch_parsimony_
+  shared_ptr<uint64_t> down_state_arr_;
+  // length: N + 1
+  shared_ptr<int> down_score_arr_;
+
+  // up pass: Fitch sets and cost of everything outside the subtree of each
+  // node, seen from its parent edge
+  // fitch_parsimony_->state_arr_len(), leaves included
+  shared_ptr<uint64_t> up_state_arr_;
+  // length: N + 1
+  shared_ptr<int> up_score_arr_;
+
+  // small parsimony score of the loaded tree
+  int total_score_;
+
+  FitchUpDown(shared_ptr<FitchParsimony> fitch_parsimony)
+      : fitch_parsimony_{fitch_parsimony},
+        num_nodes_{fitch_parsimony.get()->num_nodes_},
+        num_leaves_{fitch_parsimony.get()->num_leaves_},
+        node_state_len_{fitch_parsimony.get()->num_words_ * 4},
+        total_score_{0} {
+    parent_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    down_score_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    up_score_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    down_state_arr_ = shared_ptr<uint64_t>(
+        new uint64_t[fitch_parsimony_.get()->state_arr_len()],
+        [](uint64_t *p) { delete[] p; });
+    up_state_arr_ = shared_ptr<uint64_t>(
+        new uint64_t[fitch_parsimony_.get()->state_arr_len()],
+        [](uint64_t *p) { delete[] p; });
+  }
+
+  ~FitchUpDown() = default;
+
+  // length of the scratch buffer score_nearest_neighbor_interchage needs
+  int scratch_len() const { return 3 * node_state_len_; }
+
+  /**
+   * Run the down pass and the up pass over a rooted & directed tree
+   *
+   * @param rooted_directional_tree : children arr of the tree
+   * @param rooted_directional_idx_arr : index arr of the tree
+   * @param rooted_postorder_arr : internal nodes, children before parents
+   * @return the small parsimony score of the tree
+   */
+  int load_tree(int *rooted_directional_tree, int *rooted_directional_idx_arr,
+                int *rooted_postorder_arr) {
+    auto fitch_parsimony = fitch_parsimony_.get();
+    auto parent_arr = parent_arr_.get();
+    auto down_state_arr = down_state_arr_.get();
+    auto down_score_arr = down_score_arr_.get();
+    auto up_state_arr = up_state_arr_.get();
+    auto up_score_arr = up_score_arr_.get();
+    int num_internal_nodes = num_nodes_ - num_leaves_;
+
+    for (int i = 0; i < num_leaves_; i++) {
+      down_score_arr[i] = 0;
+    }
+    for (int p = 0; p < num_internal_nodes; p++) {
+      int node = rooted_postorder_arr[p];
+      int left = rooted_directional_tree[rooted_directional_idx_arr[node]];
+      int right = rooted_directional_tree[rooted_directional_idx_arr[node] + 1];
+      parent_arr[left] = node;
+      parent_arr[right] = node;
+      down_score_arr[node] =
+          down_score_arr[left] + down_score_arr[right] +
+          fitch_parsimony->fitch_join(
+              fitch_parsimony->get_node_states(down_state_arr, left),
+              fitch_parsimony->get_node_states(down_state_arr, right),
+              fitch_parsimony->get_node_states(down_state_arr, node));
+    }
+
+    int root = rooted_postorder_arr[num_internal_nodes - 1];
+    parent_arr[root] = -1;
+    total_score_ = down_score_arr[root];
+
+    // the two sides of the root edge see each other's down sets
+    int left = rooted_directional_tree[rooted_directional_idx_arr[root]];
+    int right = rooted_directional_tree[rooted_directional_idx_arr[root] + 1];
+    size_t node_bytes = node_state_len_ * sizeof(uint64_t);
+    memcpy(up_state_arr + left * node_state_len_,
+           fitch_parsimony->get_node_states(down_state_arr, right), node_bytes);
+    memcpy(up_state_arr + right * node_state_len_,
+           fitch_parsimony->get_node_states(down_state_arr, left), node_bytes);
+    up_score_arr[left] = down_score_arr[right];
+    up_score_arr[right] = down_score_arr[left];
+
+    // the postorder backwards visits parents before children
+    for (int p = num_internal_nodes - 2; p >= 0; p--) {
+      int node = rooted_postorder_arr[p];
+      int bias = rooted_directional_idx_arr[node];
+      for (int j = 0; j < 2; j++) {
+        int child = rooted_directional_tree[bias + j];
+        int sibling = rooted_directional_tree[bias + 1 - j];
+        up_score_arr[child] =
+            up_score_arr[node] + down_score_arr[sibling] +
+            fitch_parsimony->fitch_join(
+                up_state_arr + node * node_state_len_,
+                fitch_parsimony->get_node_states(down_state_arr, sibling),
+                up_state_arr + child * node_state_len_);
+      }
+    }
+    return total_score_;
+  }
+
+  // Fitch sets and cost of the subtree that hangs from x, seen from its
+  // neighbor y
+  const uint64_t *get_subtree(int x, int y, int &score) const {
+    if (parent_arr_.get()[x] == y) {
+      score = down_score_arr_.get()[x];
+      return fitch_parsimony_.get()->get_node_states(down_state_arr_.get(), x);
+    }
+    // x is above y, or both hang from the root
+    score = up_score_arr_.get()[y];
+    return up_state_arr_.get() + y * node_state_len_;
+  }
+
+  /**
+   * Score the nearest neighbor interchange that exchanges a_child (a neighbor
+   * of a) and b_child (a neighbor of b) across the internal edge (a, b) of the
+   * loaded tree, which it leaves unchanged.
+   *
+   * @param a_other : the third neighbor of a
+   * @param b_other : the third neighbor of b
+   * @param scratch : length scratch_len()
+   * @return the small parsimony score of the interchanged tree
+   */
+  int score_nearest_neighbor_interchage(int a, int b, int a_child,
+                                        int b_child, int a_other, int b_other,
+                                        uint64_t *scratch) const {
+    auto fitch_parsimony = fitch_parsimony_.get();
+    int score_a_child, score_b_child, score_a_other, score_b_other;
+    const uint64_t *a_child_states = get_subtree(a_child, a, score_a_child);
+    const uint64_t *b_child_states = get_subtree(b_child, b, score_b_child);
+    const uint64_t *a_other_states = get_subtree(a_other, a, score_a_other);
+    const uint64_t *b_other_states = get_subtree(b_other, b, score_b_other);
+
+    // after the interchange a holds (a_other, b_child), b holds
+    // (b_other, a_child)
+    uint64_t *a_states = scratch;
+    uint64_t *b_states = scratch + node_state_len_;
+    int score = score_a_child + score_b_child + score_a_other + score_b_other;
+    score += fitch_parsimony->fitch_join(a_other_states, b_child_states,
+                                         a_states);
+    score += fitch_parsimony->fitch_join(b_other_states, a_child_states,
+                                         b_states);
+    score += fitch_parsimony->fitch_join(a_states, b_states,
+                                         scratch + 2 * node_state_len_);
+    return score;
+  }
+};
+
+#endif /* FitchUpDown_hpp */
@@ -0,0 +1,282 @@
+//
+//  IncrementalFitch.hpp
+//  LargeParsimonyProblem
+//
+//  Keep the Fitch sets of one rooted tree and rescore subtree swaps by
+//  recomputing only the nodes above the swapped subtrees.
+//
+
+#ifndef IncrementalFitch_hpp
+#define IncrementalFitch_hpp
+
+#include <stdint.h>
+#include <cstring>
+#include <memory>
+#include "FitchParsimony.hpp"
+
+using namespace std;
+
+class IncrementalFitch {
+  // trees here are all rooted and directed
+ public:
+  shared_ptr<FitchParsimony> fitch_parsimony_;
+
+  // N + 1, 1 is the root
+  int num_nodes_;
+
+  int num_leaves_;
+
+  // length of the bit-planes of one node
+  int node_state_len_;
+
+  // children_arr_[2 * a], children_arr_[2 * a + 1] are the children of a
+  // length: 2 * (N + 1)
+  shared_ptr<int> children_arr_;
+
+  // -1 for the root
+  // length: N + 1
+  shared_ptr<int> parent_arr_;
+
+  // 0 for the root
+  // length: N + 1
+  shared_ptr<int> depth_arr_;
+
+  // Fitch sets of the internal nodes, fitch_parsimony_->state_arr_len()
+  shared_ptr<uint64_t> state_arr_;
+
+  // score added at each node
+  // length: N + 1
+  shared_ptr<int> node_score_arr_;
+
+  int total_score_;
+
+  // nodes recomputed by the last try_swap, in the order they were recomputed
+  // length: N + 1
+  shared_ptr<int> dirty_arr_;
+  int num_dirty_;
+
+  // sets and scores of the dirty nodes before the last try_swap
+  shared_ptr<uint64_t> undo_state_arr_;
+  shared_ptr<int> undo_score_arr_;
+
+  // the two subtrees swapped by the last try_swap, -1 if none
+  int swapped_x_;
+  int swapped_y_;
+
+  IncrementalFitch(shared_ptr<FitchParsimony> fitch_parsimony)
+      : fitch_parsimony_{fitch_parsimony},
+        num_nodes_{fitch_parsimony.get()->num_nodes_},
+        num_leaves_{fitch_parsimony.get()->num_leaves_},
+        node_state_len_{fitch_parsimony.get()->num_words_ * 4},
+        total_score_{0},
+        num_dirty_{0},
+        swapped_x_{-1},
+        swapped_y_{-1} {
+    children_arr_ =
+        shared_ptr<int>(new int[2 * num_nodes_], [](int *p) { delete[] p; });
+    parent_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    depth_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    node_score_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    dirty_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    undo_score_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    state_arr_ = shared_ptr<uint64_t>(
+        new uint64_t[fitch_parsimony_.get()->state_arr_len()],
+        [](uint64_t *p) { delete[] p; });
+    undo_state_arr_ = shared_ptr<uint64_t>(
+        new uint64_t[fitch_parsimony_.get()->state_arr_len()],
+        [](uint64_t *p) { delete[] p; });
+  }
+
+  ~IncrementalFitch() = default;
+
+  /**
+   * Load a rooted & directed tree and compute the Fitch sets of all nodes
+   *
+   * @param rooted_directional_tree : children arr of the tree
+   * @param rooted_directional_idx_arr : index arr of the tree
+   * @param rooted_postorder_arr : internal nodes, children before parents
+   * @return the small parsimony score of the tree
+   */
+  int load_tree(int *rooted_directional_tree, int *rooted_directional_idx_arr,
+                int *rooted_postorder_arr) {
+    auto children_arr = children_arr_.get();
+    auto parent_arr = parent_arr_.get();
+    auto depth_arr = depth_arr_.get();
+    auto node_score_arr = node_score_arr_.get();
+    int num_internal_nodes = num_nodes_ - num_leaves_;
+
+    for (int i = 0; i < num_nodes_; i++) {
+      int bias = rooted_directional_idx_arr[i];
+      children_arr[2 * i] = bias == -1 ? -1 : rooted_directional_tree[bias];
+      children_arr[2 * i + 1] =
+          bias == -1 ? -1 : rooted_directional_tree[bias + 1];
+      node_score_arr[i] = 0;
+    }
+
+    // the postorder backwards visits parents before children
+    int root = rooted_postorder_arr[num_internal_nodes - 1];
+    parent_arr[root] = -1;
+    depth_arr[root] = 0;
+    for (int p = num_internal_nodes - 1; p >= 0; p--) {
+      int node = rooted_postorder_arr[p];
+      for (int j = 0; j < 2; j++) {
+        int child = children_arr[2 * node + j];
+        parent_arr[child] = node;
+        depth_arr[child] = depth_arr[node] + 1;
+      }
+    }
+
+    total_score_ = 0;
+    for (int p = 0; p < num_internal_nodes; p++) {
+      total_score_ += recompute_node(rooted_postorder_arr[p]);
+    }
+    num_dirty_ = 0;
+    swapped_x_ = swapped_y_ = -1;
+    return total_score_;
+  }
+
+  // Fitch step of one internal node from its current children, updates
+  // node_score_arr_ and returns the new score of the node
+  int recompute_node(int node) {
+    auto children_arr = children_arr_.get();
+    auto state_arr = state_arr_.get();
+    auto fitch_parsimony = fitch_parsimony_.get();
+    node_score_arr_.get()[node] = fitch_parsimony->fitch_join(
+        fitch_parsimony->get_node_states(state_arr, children_arr[2 * node]),
+        fitch_parsimony->get_node_states(state_arr, children_arr[2 * node + 1]),
+        fitch_parsimony->get_node_states(state_arr, node));
+    return node_score_arr_.get()[node];
+  }
+
+  // replace child old_child of node with new_child
+  void replace_child(int node, int old_child, int new_child) {
+    auto children_arr = children_arr_.get();
+    int slot = children_arr[2 * node] == old_child ? 2 * node : 2 * node + 1;
+    children_arr[slot] = new_child;
+    parent_arr_.get()[new_child] = node;
+  }
+
+  /**
+   * Exchange subtree x and subtree y and rescore the nodes above them. Neither
+   * may be an ancestor of the other. Must be undone with rollback() before the
+   * next try_swap.
+   *
+   * @return the small parsimony score of the swapped tree
+   */
+  int try_swap(int x, int y) {
+    auto parent_arr = parent_arr_.get();
+    auto depth_arr = depth_arr_.get();
+    auto dirty_arr = dirty_arr_.get();
+    int px = parent_arr[x];
+    int py = parent_arr[y];
+    replace_child(px, x, y);
+    replace_child(py, y, x);
+    swapped_x_ = x;
+    swapped_y_ = y;
+
+    // walk up both paths, deeper node first, so every node comes after its
+    // dirty children
+    num_dirty_ = 0;
+    int u = px;
+    int v = py;
+    while (u != v) {
+      if (depth_arr[u] >= depth_arr[v]) {
+        dirty_arr[num_dirty_++] = u;
+        u = parent_arr[u];
+      } else {
+        dirty_arr[num_dirty_++] = v;
+        v = parent_arr[v];
+      }
+    }
+    int num_below_lca = num_dirty_;
+    for (; u != -1; u = parent_arr[u]) {
+      dirty_arr[num_dirty_++] = u;
+    }
+
+    auto state_arr = state_arr_.get();
+    auto undo_state_arr = undo_state_arr_.get();
+    auto node_score_arr = node_score_arr_.get();
+    auto undo_score_arr = undo_score_arr_.get();
+    size_t node_bytes = node_state_len_ * sizeof(uint64_t);
+    for (int i = 0; i < num_dirty_; i++) {
+      int node = dirty_arr[i];
+      uint64_t *states = state_arr + node * node_state_len_;
+      uint64_t *undo_states = undo_state_arr + i * node_state_len_;
+      memcpy(undo_states, states, node_bytes);
+      undo_score_arr[i] = node_score_arr[node];
+      total_score_ += recompute_node(node) - undo_score_arr[i];
+
+      // above both paths, an unchanged set leaves every ancestor unchanged
+      if (i >= num_below_lca && memcmp(undo_states, states, node_bytes) == 0) {
+        num_dirty_ = i + 1;
+        break;
+      }
+    }
+    return total_score_;
+  }
+
+  // undo the last try_swap
+  void rollback() {
+    if (swapped_x_ == -1) {
+      return;
+    }
+    auto parent_arr = parent_arr_.get();
+    int px = parent_arr[swapped_y_];
+    int py = parent_arr[swapped_x_];
+    replace_child(px, swapped_y_, swapped_x_);
+    replace_child(py, swapped_x_, swapped_y_);
+
+    size_t node_bytes = node_state_len_ * sizeof(uint64_t);
+    for (int i = num_dirty_ - 1; i >= 0; i--) {
+      int node = dirty_arr_.get()[i];
+      memcpy(state_arr_.get() + node * node_state_len_,
+             undo_state_arr_.get() + i * node_state_len_, node_bytes);
+      total_score_ += undo_score_arr_.get()[i] - node_score_arr_.get()[node];
+      node_score_arr_.get()[node] = undo_score_arr_.get()[i];
+    }
+    num_dirty_ = 0;
+    swapped_x_ = swapped_y_ = -1;
+  }
+
+  // is child a child of node in the current tree
+  bool is_child(int node, int child) const {
+    return children_arr_.get()[2 * node] == child ||
+           children_arr_.get()[2 * node + 1] == child;
+  }
+
+  // the child of node that is not child
+  int other_child(int node, int child) const {
+    auto children_arr = children_arr_.get();
+    return children_arr[2 * node] == child ? children_arr[2 * node + 1]
+                                           : children_arr[2 * node];
+  }
+
+  /**
+   * Score the nearest neighbor interchange that exchanges a_child (a neighbor
+   * of a) and b_child (a neighbor of b) across the internal edge (a, b) of the
+   * loaded tree. The move is mapped to a swap of two rooted subtrees giving
+   * the same unrooted topology.
+   *
+   * @return the small parsimony score of the interchanged tree
+   */
+  int try_nearest_neighbor_interchage(int a, int b, int a_child, int b_child) {
+    auto parent_arr = parent_arr_.get();
+    if (parent_arr[a] == b) {
+      swap(a, b);
+      swap(a_child, b_child);
+    }
+    // a is now the parent of b, or both hang from the root
+    if (parent_arr[b] == a && !is_child(a, a_child)) {
+      // a_child lies above a: exchange the other two subtrees instead
+      return try_swap(other_child(a, b), other_child(b, b_child));
+    }
+    return try_swap(a_child, b_child);
+  }
+};
+
+#endif /* IncrementalFitch_hpp */
@@ -0,0 +1,124 @@
+//
+//  IspcDispatch.hpp
+//  LargeParsimonyProblem
+//
+//  The ispc kernels are built once per instruction set (see ISPC_TARGETS in
+//  the Makefile). One build is picked at startup, from CPUID or from the
+//  command line, and called through a table of function pointers.
+//
+
+#ifndef IspcDispatch_hpp
+#define IspcDispatch_hpp
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// ispc suffixes the exported functions of every target with its name
+#define DECLARE_ISPC_TARGET(isa)                                              \
+  extern "C" {                                                                \
+  void array_copy_ispc_##isa(int32_t arr_len, int32_t *input,                 \
+                             int32_t *output);                                \
+  void array_init_ispc_##isa(int32_t arr_len, int32_t *output);               \
+  void map_char_idx_ispc_##isa(int32_t arr_len, int8_t *input,                \
+                               int8_t *output);                               \
+  void sankoff_leaves_ispc_##isa(int32_t num_sites, int32_t num_nodes,        \
+                                 int32_t num_leaves,                          \
+                                 int8_t *rooted_char_list, uint16_t *s_v_k);  \
+  void sankoff_node_ispc_##isa(int32_t num_sites, bool unit_cost,             \
+                               const int32_t *cost_arr, bool root,            \
+                               const uint16_t *left_states,                   \
+                               const uint16_t *right_states,                  \
+                               uint16_t *parent_states,                       \
+                               int8_t *back_track_arr);                       \
+  int32_t sankoff_root_ispc_##isa(int32_t num_sites, int32_t root,            \
+                                  uint16_t *s_v_k, int32_t *weight_arr,       \
+                                  int8_t *node_char_arr);                     \
+  void sankoff_traceback_ispc_##isa(int32_t num_sites, int32_t parent,        \
+                                    int32_t left, int32_t right,              \
+                                    int8_t *back_track_arr,                   \
+                                    int8_t *node_char_arr);                   \
+  }
+
+DECLARE_ISPC_TARGET(sse4)
+DECLARE_ISPC_TARGET(avx2)
+DECLARE_ISPC_TARGET(avx512skx)
+
+// the exported kernels of parsimony.ispc, built for one target
+struct IspcKernels {
+  // target name as given to --simd
+  const char *name_;
+  void (*array_copy_ispc)(int32_t, int32_t *, int32_t *);
+  void (*array_init_ispc)(int32_t, int32_t *);
+  void (*map_char_idx_ispc)(int32_t, int8_t *, int8_t *);
+  void (*sankoff_leaves_ispc)(int32_t, int32_t, int32_t, int8_t *,
+                              uint16_t *);
+  void (*sankoff_node_ispc)(int32_t, bool, const int32_t *, bool,
+                            const uint16_t *, const uint16_t *, uint16_t *,
+                            int8_t *);
+  int32_t (*sankoff_root_ispc)(int32_t, int32_t, uint16_t *, int32_t *,
+                               int8_t *);
+  void (*sankoff_traceback_ispc)(int32_t, int32_t, int32_t, int32_t, int8_t *,
+                                 int8_t *);
+};
+
+#define ISPC_TARGET_KERNELS(isa)                                    \
+  {                                                                 \
+    #isa, array_copy_ispc_##isa, array_init_ispc_##isa,             \
+        map_char_idx_ispc_##isa, sankoff_leaves_ispc_##isa,         \
+        sankoff_node_ispc_##isa, sankoff_root_ispc_##isa,           \
+        sankoff_traceback_ispc_##isa                                \
+  }
+
+// from the narrowest to the widest target
+const int num_ispc_targets = 3;
+const IspcKernels ispc_target_arr[num_ispc_targets] = {
+    ISPC_TARGET_KERNELS(sse4), ISPC_TARGET_KERNELS(avx2),
+    ISPC_TARGET_KERNELS(avx512skx)};
+
+/**
+ * Whether this CPU (and OS) can run the given target
+ *
+ * @param target : index into ispc_target_arr
+ */
+bool ispcTargetSupported(int target) {
+  __builtin_cpu_init();
+  switch (target) {
+    case 0:
+      return __builtin_cpu_supports("sse4.2");
+    case 1:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case 2:
+      return __builtin_cpu_supports("avx512f") &&
+             __builtin_cpu_supports("avx512cd") &&
+             __builtin_cpu_supports("avx512bw") &&
+             __builtin_cpu_supports("avx512dq") &&
+             __builtin_cpu_supports("avx512vl");
+    default:
+      return false;
+  }
+}
+
+/**
+ * Pick the kernels to run
+ *
+ * @param name : target name, empty for the widest one the CPU supports
+ * @return the kernels, nullptr if the target is unknown or the CPU cannot run
+ * it
+ */
+const IspcKernels *selectIspcKernels(const string &name) {
+  for (int target = num_ispc_targets - 1; target >= 0; target--) {
+    if (name.empty() || name == ispc_target_arr[target].name_) {
+      if (ispcTargetSupported(target)) {
+        return &ispc_target_arr[target];
+      }
+      if (!name.empty()) {
+        return nullptr;
+      }
+    }
+  }
+  return nullptr;
+}
+
+#endif /* IspcDispatch_hpp */
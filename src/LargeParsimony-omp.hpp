@@ -9,15 +9,34 @@
 #ifndef LargeParsimony_hpp
 #define LargeParsimony_hpp
 
+#include <limits.h>
 #include <omp.h>
 #include <stdio.h>
+#include <algorithm>
 #include <deque>
+#include <functional>
 #include <memory>
 #include <queue>
+#include <random>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
-#include "parsimony_ispc.h"
+#include <vector>
+#include "ArrayPool.hpp"
+#include "BranchAndBound.hpp"
+#include "FitchParsimony.hpp"
+#include "FitchSpr.hpp"
+#include "FitchTbr.hpp"
+#include "FitchUpDown.hpp"
+#include "IspcDispatch.hpp"
+#include "ParallelTempering.hpp"
+#include "SankoffParsimony.hpp"
+#include "SankoffUpDown.hpp"
+#include "SearchCheckpoint.hpp"
+#include "SearchExchange.hpp"
+#include "SitePatterns.hpp"
+#include "TopologyTable.hpp"
+#include "WorkStealing.hpp"
 #endif /* LargeParsimony_hpp */
 
 using namespace std;
@@ -31,17 +50,24 @@ class LargeParsimony {
   int num_edges_;
   int unrooted_undirectional_tree_len_;
   int rooted_directional_tree_len_;
+  int rooted_postorder_arr_len_;
   int rooted_char_list_len_;
 
   // n nodes, leaf has 1 edge, other 3, always change after calling
   shared_ptr<int> unrooted_undirectional_tree_;
   shared_ptr<int> unrooted_undirectional_idx_arr_;
+  // unique alignment columns and their weights
+  shared_ptr<SitePatterns> site_patterns_;
+  // (num_patterns)*(N + 1)
   shared_ptr<char> rooted_char_list_;
+  // bit-packed leaves of rooted_char_list_, scores every candidate tree
+  shared_ptr<FitchParsimony> fitch_parsimony_;
+  // the ispc kernels built for the instruction set picked at startup
+  const IspcKernels* ispc_kernels_;
 
   // for final result
   int min_large_parsimony_score_ = int(1e8);
   deque<shared_ptr<int>> unrooted_undirectional_tree_queue_;
-  deque<shared_ptr<string>> string_list_queue_;
 
   // for internal use
   // unrooted_undirectional_tree for internal exchange use
@@ -49,186 +75,235 @@ class LargeParsimony {
   shared_ptr<int> rooted_directional_tree_;
   // (n+1) nodes
   shared_ptr<int> rooted_directional_idx_arr_;
-  // for get_edges_from_unrooted_undirectional_tree() use
-  shared_ptr<int> edges_;
-  // for get_edges_from_unrooted_undirectional_tree use
-  shared_ptr<bool> visited_;
 
   deque<shared_ptr<int>> tmp_unrooted_undirectional_tree_queue_;
-  deque<shared_ptr<string>> tmp_string_list_queue_;
+  // every queued tree comes from here and returns here once dropped
+  shared_ptr<ArrayPool<int>> tree_pool_;
+  // per-round candidate output, grown to the widest round and then reused
+  // score_global_arr_[i] is the score of candidate i,
+  // move_global_arr_[4 * i] ... [4 * i + 3] holds its (a, b, a_child, b_child)
+  vector<int> score_global_arr_;
+  vector<int> move_global_arr_;
+  // hash_global_arr_[i] is the topology hash of candidate i
+  vector<uint64_t> hash_global_arr_;
+  // with spr_radius_ or tbr_radius_ only the candidates that may be kept
+  // are recorded, move_global_arr_[6 * i] ... [6 * i + 5] then holds their
+  // (a, b, xa, ya, xb, yb) and tree_global_arr_[i] their slice tree
+  vector<int> tree_global_arr_;
+  // every topology scored so far, shared by all threads
+  shared_ptr<TopologyTable> topology_table_;
+  // saves the search now and then and resumes it, none by default
+  shared_ptr<SearchCheckpoint> checkpoint_;
+  // with a checkpoint a round is scored in slices of about this many
+  // (tree, edge) tasks, and saved between two slices
+  static const int checkpoint_slice_tasks_ = 1 << 16;
+  // shares every slice with other processes, none by default
+  shared_ptr<SearchExchange> exchange_;
+
+  // Sankoff cost of changing char i to j at cost_arr_[4 * i + j], unit_cost_
+  // when every change costs 1 so the kernels skip the table
+  int cost_arr_[16];
+  bool unit_cost_;
+  // scores trees instead of fitch_parsimony_ when not unit_cost_, none
+  // otherwise
+  shared_ptr<SankoffParsimony> sankoff_parsimony_;
+  // sites per Sankoff kernel call, bounds its scratch
+  static const int sankoff_chunk_len_ = 1024;
+
+  // a site block is never narrower than this many 64-site words
+  static const int min_block_words_ = 16;
+  // a round with fewer (tree, edge) tasks per thread is split by sites
+  static const int min_tasks_per_thread_ = 4;
+  // site blocks of a wide alignment, empty when it is too narrow to split.
+  // block b holds patterns block_begin_arr_[b] ... block_begin_arr_[b + 1] - 1
+  // with its own Fitch engine, a score is the sum of the block scores
+  vector<int> block_begin_arr_;
+  vector<shared_ptr<FitchParsimony>> block_fitch_arr_;
+  vector<shared_ptr<FitchUpDown>> block_up_down_arr_;
+  vector<shared_ptr<uint64_t>> block_state_arr_;
+  vector<shared_ptr<uint64_t>> block_scratch_arr_;
+
+  // farthest regraft of a pruned subtree in edges, 0 to search by nearest
+  // neighbor interchanges instead
+  int spr_radius_ = 0;
+  // farthest reconnection from a cut edge in edges, searches by tree
+  // bisection-reconnection when not 0 and takes over from spr_radius_
+  int tbr_radius_ = 0;
+  // proposals of every tempering chain, 0 to walk the plateau only
+  int tempering_steps_ = 0;
+  int tempering_chains_ = 0;
+  double tempering_temperature_ = 0;
+  uint32_t tempering_seed_ = 0;
+  // the chains offer to swap temperatures after this many proposals each
+  static const int tempering_swap_steps_ = 64;
+  // a regraft or reconnection that scored at most new_score, move is as in
+  // tree_bisection_reconnection()
+  struct MoveCandidate {
+    int task;
+    // visit order within the task
+    int order;
+    int score;
+    uint64_t tree_hash;
+    int move[6];
+  };
+  // the candidates of every thread in the current slice
+  vector<vector<MoveCandidate>> move_candidate_arr_;
 
   LargeParsimony(shared_ptr<int> unrooted_undirectional_tree,
                  shared_ptr<int> unrooted_undirectional_idx_arr,
-                 shared_ptr<char> rooted_char_list, int num_nodes,
-                 int num_leaves, int num_char_trees, int num_threads)
+                 shared_ptr<SitePatterns> site_patterns, int num_nodes,
+                 int num_leaves, int num_threads,
+                 const IspcKernels* ispc_kernels)
       : num_threads_{num_threads},
-        num_char_trees_{num_char_trees},
+        num_char_trees_{site_patterns.get()->num_patterns_},
         num_nodes_{num_nodes},
         num_leaves_{num_leaves},
         num_edges_{num_nodes - num_leaves - 1},
         unrooted_undirectional_tree_len_{(num_nodes - 1) * 2},
         rooted_directional_tree_len_{(num_nodes + 1 - num_leaves) * 2},
-        rooted_char_list_len_{(num_nodes + 1) * num_char_trees},
+        rooted_postorder_arr_len_{num_nodes + 1 - num_leaves},
+        rooted_char_list_len_{(num_nodes + 1) * num_char_trees_},
         unrooted_undirectional_tree_{unrooted_undirectional_tree},
         unrooted_undirectional_idx_arr_{unrooted_undirectional_idx_arr},
-        rooted_char_list_{rooted_char_list} {
+        site_patterns_{site_patterns},
+        rooted_char_list_{site_patterns.get()->char_list_},
+        ispc_kernels_{ispc_kernels} {
+    fitch_parsimony_ = make_shared<FitchParsimony>(
+        rooted_char_list_.get(), site_patterns_.get()->weight_arr_.get(),
+        num_char_trees_, num_nodes + 1, num_leaves);
     rooted_directional_tree_ = shared_ptr<int>(
         new int[rooted_directional_tree_len_], [](int* p) { delete[] p; });
     rooted_directional_idx_arr_ =
         shared_ptr<int>(new int[num_nodes + 1], [](int* p) { delete[] p; });
+    tree_pool_ = make_shared<ArrayPool<int>>(unrooted_undirectional_tree_len_);
+    topology_table_ = make_shared<TopologyTable>();
+    for (int i = 0; i < 16; i++) {
+      cost_arr_[i] = int(i / 4 != i % 4);
+    }
+    unit_cost_ = true;
 
-    // below for get_edges_from_unrooted_undirectional_tree() use
-    edges_ =
-        shared_ptr<int>(new int[num_edges_ * 2], [](int* p) { delete[] p; });
-    visited_ =
-        shared_ptr<bool>(new bool[num_nodes_], [](bool* p) { delete[] p; });
+    // word-aligned blocks, one per thread at most
+    int num_words = fitch_parsimony_.get()->num_words_;
+    int num_blocks = min(num_threads_, num_words / min_block_words_);
+    if (num_blocks > 1) {
+      for (int block = 0; block <= num_blocks; block++) {
+        block_begin_arr_.push_back(
+            min(num_char_trees_, 64 * (num_words * block / num_blocks)));
+      }
+      for (int block = 0; block < num_blocks; block++) {
+        int begin = block_begin_arr_[block];
+        shared_ptr<FitchParsimony> block_fitch = make_shared<FitchParsimony>(
+            rooted_char_list_.get() + begin * (num_nodes + 1),
+            site_patterns_.get()->weight_arr_.get() + begin,
+            block_begin_arr_[block + 1] - begin, num_nodes + 1, num_leaves);
+        shared_ptr<FitchUpDown> block_up_down =
+            make_shared<FitchUpDown>(block_fitch);
+        block_fitch_arr_.push_back(block_fitch);
+        block_up_down_arr_.push_back(block_up_down);
+        block_state_arr_.push_back(shared_ptr<uint64_t>(
+            new uint64_t[block_fitch.get()->state_arr_len()],
+            [](uint64_t* p) { delete[] p; }));
+        block_scratch_arr_.push_back(shared_ptr<uint64_t>(
+            new uint64_t[block_up_down.get()->scratch_len()],
+            [](uint64_t* p) { delete[] p; }));
+      }
+    }
   }
 
   ~LargeParsimony() = default;
 
+  /**
+   * Sankoff small parsimony of a tree under cost_arr_, one gang of sites at a
+   * time in the ispc kernels
+   *
+   * @param rooted_char_list : (num_char_trees) * (num_nodes), the leaf chars
+   * @param string_list : length num_nodes - 1, the assigned string of every
+   * node but the root
+   * @return the weighted small parsimony score of the tree
+   */
   int run_small_parsimony_string(int num_char_trees, char* rooted_char_list,
-                                 int* rooted_directional_tree,
+                                 int* weight_arr, int* rooted_directional_tree,
                                  int* rooted_directional_idx_arr,
+                                 int* rooted_postorder_arr,
                                  string* string_list, int num_nodes) {
     int total_score = 0;
     char ACGT_arr[4] = {'A', 'C', 'G', 'T'};
-    for (int i = 0; i < num_char_trees; i++) {
-      char* cur_rooted_char_list_idx = rooted_char_list + i * num_nodes;
-      int cur_score = run_small_parsimony_char(
-          cur_rooted_char_list_idx, rooted_directional_tree,
-          rooted_directional_idx_arr, num_nodes);
-      // add to final total score
-      total_score += cur_score;
-      // append char list to current string list
-      for (int i = 0; i < num_nodes - 1; i++) {
-        string_list[i] += ACGT_arr[int(cur_rooted_char_list_idx[i])];
-      }
+    int num_internal_nodes = num_nodes - num_leaves_;
+    int root = rooted_postorder_arr[num_internal_nodes - 1];
+    // scratch shared by every chunk of the call, see parsimony.ispc for the
+    // layout
+    int chunk_len = min(int(sankoff_chunk_len_), num_char_trees);
+    unique_ptr<uint16_t[]> s_v_k(new uint16_t[num_nodes * 4 * chunk_len]);
+    unique_ptr<int8_t[]> back_track_arr(new int8_t[num_nodes * 8 * chunk_len]);
+    unique_ptr<int8_t[]> node_char_arr(new int8_t[num_nodes * chunk_len]);
+    // size the strings once instead of growing them site by site
+    for (int i = 0; i < num_nodes - 1; i++) {
+      string_list[i].resize(num_char_trees);
     }
-    return total_score;
-  }
 
-  /** use current char list and global tree structure to calculate
-   * input: char list; directional & rooted tree given as
-   * rooted_directional_tree return: the small parsimony score of the char
-   * tree and also write the assigned chars to the global rooted_char_list
-   */
-  int run_small_parsimony_char(char* rooted_char_list,
-                               int* rooted_directional_tree,
-                               int* rooted_directional_idx_arr, int num_nodes) {
-    // indicate the score of node v choosing k char
-    unique_ptr<int[]> s_v_k(new int[num_nodes * 4]);
-    // indicate if the noed i is ripe
-    unique_ptr<unsigned char[]> tag(new unsigned char[num_nodes]);
-    // indicate for each node, chosen a char of 4, what is the best char for its
-    // left & right children.
-    unique_ptr<unsigned char[]> back_track_arr(
-        new unsigned char[num_nodes * 8]);
-
-    // initialization (no need to initialize back_track_arr)
-    int infinity = int(1e8);
-
-    ispc::initialize_small_parsimony_ispc(num_nodes, infinity, s_v_k.get(),
-                                          tag.get(), (int8_t*)rooted_char_list,
-                                          rooted_directional_idx_arr);
-
-    // cur node
-    int root = -1;
-    int min_parsimony_score = infinity;
-    int root_char_idx = '#';
-
-    while (true) {
-      // find a ripe node in the tree
-      int ripe_node = -1;
-      int daughter = -1;
-      int son = -1;
-      for (int i = 0; i < num_nodes; i++) {
-        // if tag(i) is 0
-        if (!tag.get()[i]) {
-          int bias = rooted_directional_idx_arr[i];
-          daughter = rooted_directional_tree[bias];
-          son = rooted_directional_tree[bias + 1];
-          if (tag.get()[daughter] && tag.get()[son]) {
-            ripe_node = i;
-            break;
-          }
-        }
+    for (int begin = 0; begin < num_char_trees; begin += chunk_len) {
+      int num_sites = min(chunk_len, num_char_trees - begin);
+      ispc_kernels_->sankoff_leaves_ispc(
+          num_sites, num_nodes, num_leaves_,
+          (int8_t*)rooted_char_list + begin * num_nodes, s_v_k.get());
+      // the postorder hands out the nodes in ripe order
+      for (int p = 0; p < num_internal_nodes; p++) {
+        int parent = rooted_postorder_arr[p];
+        int bias = rooted_directional_idx_arr[parent];
+        int left = rooted_directional_tree[bias];
+        int right = rooted_directional_tree[bias + 1];
+        ispc_kernels_->sankoff_node_ispc(
+            num_sites, unit_cost_, cost_arr_, parent == root,
+            s_v_k.get() + left * 4 * num_sites,
+            s_v_k.get() + right * 4 * num_sites,
+            s_v_k.get() + parent * 4 * num_sites,
+            back_track_arr.get() + parent * 8 * num_sites);
       }
-
-      // if no ripe, root has been found and dealed with
-      if (ripe_node == -1) {
-        break;
+      // one pattern stands for weight_arr[i] sites
+      total_score += ispc_kernels_->sankoff_root_ispc(
+          num_sites, root, s_v_k.get(), weight_arr + begin,
+          node_char_arr.get());
+      // walking the postorder backwards fills up the chars parents first
+      for (int p = num_internal_nodes - 1; p >= 0; p--) {
+        int parent = rooted_postorder_arr[p];
+        int bias = rooted_directional_idx_arr[parent];
+        ispc_kernels_->sankoff_traceback_ispc(
+            num_sites, parent, rooted_directional_tree[bias],
+            rooted_directional_tree[bias + 1], back_track_arr.get(),
+            node_char_arr.get());
       }
-      // find one ripe node
-      root = ripe_node;
-      min_parsimony_score = infinity;
-      root_char_idx = '#';
-      tag.get()[root] = 1;
-      for (int i = 0; i < 4; i++) {
-        char min_left_char_idx = '#';
-        char min_right_char_idx = '#';
-
-        int left_min_score = infinity;
-        int right_min_score = infinity;
-
-        int offset_left = 4 * daughter;
-        int offset_right = 4 * son;
-
-        for (int left_i = 0; left_i < 4; left_i++) {
-          int tmp_score = s_v_k.get()[offset_left + left_i] + int(i != left_i);
-          if (tmp_score < left_min_score) {
-            left_min_score = tmp_score;
-            min_left_char_idx = left_i;
-          }
-        }
-        for (int right_i = 0; right_i < 4; right_i++) {
-          int tmp_score =
-              s_v_k.get()[offset_right + right_i] + int(i != right_i);
-          if (tmp_score < right_min_score) {
-            right_min_score = tmp_score;
-            min_right_char_idx = right_i;
-          }
-        }
-        int cur_total_score = left_min_score + right_min_score;
-        s_v_k.get()[root * 4 + i] = cur_total_score;
-        if (cur_total_score < min_parsimony_score) {
-          min_parsimony_score = cur_total_score;
-          root_char_idx = i;
+      for (int j = 0; j < num_nodes - 1; j++) {
+        int8_t* node_chars = node_char_arr.get() + j * num_sites;
+        for (int i = 0; i < num_sites; i++) {
+          string_list[j][begin + i] = ACGT_arr[int(node_chars[i])];
         }
-        int back_track_arr_offset = root * 8 + i * 2;
-        back_track_arr.get()[back_track_arr_offset] = min_left_char_idx;
-        back_track_arr.get()[back_track_arr_offset + 1] = min_right_char_idx;
       }
     }
+    return total_score;
+  }
 
-    // No ripe node any more, root is the fianl root now, calcuate the final
-    // score and fill up the char array (tree)
-    queue<int> q;
-    q.push(root);
-    rooted_char_list[root] = root_char_idx;
-    while (!q.empty()) {
-      int parent = q.front();
-      q.pop();
-      char min_char_idx = rooted_char_list[parent];
-      int child_idx = rooted_directional_idx_arr[parent];
-      // if it is not a leaf
-      if (child_idx != -1) {
-        int left_child_id = rooted_directional_tree[child_idx];
-        int right_child_id = rooted_directional_tree[child_idx + 1];
-
-        int tmp_idx = parent * 8 + 2 * min_char_idx;
-        char left_min_char_idx = back_track_arr.get()[tmp_idx];
-        char right_min_char_idx = back_track_arr.get()[tmp_idx + 1];
-
-        rooted_char_list[left_child_id] = left_min_char_idx;
-        rooted_char_list[right_child_id] = right_min_char_idx;
-
-        if (rooted_directional_idx_arr[left_child_id] != -1)
-          q.push(left_child_id);
-        if (rooted_directional_idx_arr[right_child_id] != -1)
-          q.push(right_child_id);
-      }
+  /**
+   * Set the Sankoff cost of every char change. Any other than unit cost is
+   * searched by nearest neighbor interchanges only. Call before
+   * run_large_parsimony().
+   *
+   * @param cost_arr : length 16, cost_arr[4 * i + j] is the cost of i -> j
+   * with A, C, G, T as 0 ... 3, see SankoffParsimony::fits()
+   */
+  void set_cost_matrix(const int* cost_arr) {
+    for (int i = 0; i < 16; i++) {
+      cost_arr_[i] = cost_arr[i];
+    }
+    unit_cost_ = SankoffParsimony::is_unit_cost(cost_arr_);
+    sankoff_parsimony_.reset();
+    if (!unit_cost_) {
+      sankoff_parsimony_ = make_shared<SankoffParsimony>(
+          rooted_char_list_.get(), site_patterns_.get()->weight_arr_.get(),
+          num_char_trees_, num_nodes_ + 1, num_leaves_, cost_arr_);
+      // the candidates go through the kernel of the ancestral strings
+      sankoff_parsimony_.get()->set_node_kernel(
+          ispc_kernels_->sankoff_node_ispc);
     }
-    return min_parsimony_score;
   }
 
   /**
@@ -264,15 +339,62 @@ class LargeParsimony {
     cur_unrooted_undirectional_tree[idx_b_child] = a;
   }
 
+  /**
+   * Move the subtree that hangs from s at p onto the edge (x, y): the other
+   * two neighbors of p are joined, and p goes between x and y
+   */
+  void subtree_prune_regraft(int p, int s, int x, int y,
+                             int* unrooted_undirectional_idx_arr,
+                             int* cur_unrooted_undirectional_tree) {
+    int idx_p = unrooted_undirectional_idx_arr[p];
+    int q = -1;
+    int r = -1;
+    for (int k = idx_p; k < idx_p + 3; k++) {
+      if (cur_unrooted_undirectional_tree[k] != s) {
+        (q == -1 ? q : r) = cur_unrooted_undirectional_tree[k];
+      }
+    }
+    int move_arr[6][3] = {{q, p, r}, {r, p, q}, {x, y, p},
+                          {y, x, p}, {p, q, x}, {p, r, y}};
+    // each is (node, old neighbor, new neighbor)
+    for (auto& move : move_arr) {
+      int idx = unrooted_undirectional_idx_arr[move[0]];
+      while (cur_unrooted_undirectional_tree[idx] != move[1]) {
+        idx++;
+      }
+      cur_unrooted_undirectional_tree[idx] = move[2];
+    }
+  }
+
+  /**
+   * Cut the edge (a, b) and reconnect the halves by putting a on the edge
+   * (xa, ya) and b on (xb, yb), xa or xb -1 for a half that stays as it was
+   */
+  void tree_bisection_reconnection(int a, int b, int xa, int ya, int xb,
+                                   int yb, int* unrooted_undirectional_idx_arr,
+                                   int* cur_unrooted_undirectional_tree) {
+    // each half is a regraft of the other one
+    if (xa != -1) {
+      subtree_prune_regraft(a, b, xa, ya, unrooted_undirectional_idx_arr,
+                            cur_unrooted_undirectional_tree);
+    }
+    if (xb != -1) {
+      subtree_prune_regraft(b, a, xb, yb, unrooted_undirectional_idx_arr,
+                            cur_unrooted_undirectional_tree);
+    }
+  }
+
   /**
    * Make the unrooted & undirectional tree rooted & directional call this
-   * function every time before small parsimony to generate input for it
+   * function every time before small parsimony to generate input for it. The
+   * BFS order, reversed, is written to rooted_postorder_arr so that every site
+   * of the tree can walk the nodes without searching for them.
    */
   void make_tree_rooted_directional(int* unrooted_undirectional_idx_arr,
                                     int* cur_unrooted_undirectional_tree,
                                     int* rooted_directional_idx_arr,
                                     int* rooted_directional_tree,
-                                    int num_nodes) {
+                                    int* rooted_postorder_arr, int num_nodes) {
     // a deep copy for rooted_char_list (we want to keep a clean original copy
     // of this) unrooted_undirectional_tree to rooted_directional_tree
     // unrooted_undirectional_idx_arr to rooted_directional_idx_arr
@@ -280,15 +402,18 @@ class LargeParsimony {
     auto tmp_neighbor_arr = cur_unrooted_undirectional_tree;
     auto tmp_directed_idx = rooted_directional_idx_arr;
     auto tmp_children_arr = rooted_directional_tree;
+    auto tmp_postorder_arr = rooted_postorder_arr;
 
     int root = num_nodes;
+    int next_postorder = num_nodes - num_leaves_;
     int left = num_nodes - 1;
     int right = tmp_neighbor_arr[tmp_undirected_idx[left]];
     int next_children = 0;
 
-    ispc::array_init_ispc(num_nodes + 1, tmp_directed_idx);
+    ispc_kernels_->array_init_ispc(num_nodes + 1, tmp_directed_idx);
 
     auto temp_start = next_children;
+    tmp_postorder_arr[next_postorder--] = root;
     tmp_directed_idx[root] = temp_start;
     tmp_children_arr[temp_start++] = left;
     tmp_children_arr[temp_start++] = right;
@@ -310,6 +435,7 @@ class LargeParsimony {
         continue;
       }
 
+      tmp_postorder_arr[next_postorder--] = cur_node;
       auto undirected_start_pos = tmp_undirected_idx[cur_node];
       auto directed_start_pos = next_children;
       tmp_directed_idx[cur_node] = directed_start_pos;
@@ -352,17 +478,377 @@ class LargeParsimony {
     }
   }
 
-  // creat a deep copy of shared_ptr array and add the ptr to deque
-  template <class T>
-  void deep_copy_push_back(deque<shared_ptr<T>>& queue, shared_ptr<T> array,
-                           int num) {
-    // first make a deep copy of array
-    shared_ptr<T> array_copy =
-        shared_ptr<T>(new T[num], [](T* p) { delete[] p; });
-    for (int i = 0; i < num; i++) {
-      array_copy.get()[i] = array.get()[i];
+  /**
+   * Ancestral strings of a tree, must follow run_fitch_score on the same tree
+   * and state_arr
+   */
+  shared_ptr<string> build_string_list(int* rooted_directional_tree,
+                                       int* rooted_directional_idx_arr,
+                                       int* rooted_postorder_arr,
+                                       uint64_t* state_arr) {
+    unique_ptr<string[]> pattern_string_list(new string[num_nodes_]);
+    fitch_parsimony_.get()->run_fitch_ancestral(
+        rooted_directional_tree, rooted_directional_idx_arr,
+        rooted_postorder_arr, state_arr, pattern_string_list.get());
+    shared_ptr<string> string_list = shared_ptr<string>(
+        new string[num_nodes_], [](string* p) { delete[] p; });
+    site_patterns_.get()->expand_string_list(pattern_string_list.get(),
+                                             string_list.get(), num_nodes_);
+    return string_list;
+  }
+
+  // ancestral strings of a tree under cost_arr_, from the ispc kernels
+  shared_ptr<string> build_sankoff_string_list(int* rooted_directional_tree,
+                                               int* rooted_directional_idx_arr,
+                                               int* rooted_postorder_arr) {
+    unique_ptr<string[]> pattern_string_list(new string[num_nodes_]);
+    run_small_parsimony_string(
+        num_char_trees_, rooted_char_list_.get(),
+        site_patterns_.get()->weight_arr_.get(), rooted_directional_tree,
+        rooted_directional_idx_arr, rooted_postorder_arr,
+        pattern_string_list.get(), num_nodes_ + 1);
+    shared_ptr<string> string_list = shared_ptr<string>(
+        new string[num_nodes_], [](string* p) { delete[] p; });
+    site_patterns_.get()->expand_string_list(pattern_string_list.get(),
+                                             string_list.get(), num_nodes_);
+    return string_list;
+  }
+
+  /**
+   * Ancestral strings of a tree, one site block per thread. Runs its own
+   * parallel region, for the trees of a plateau too small to fill the threads
+   */
+  shared_ptr<string> build_string_list_by_blocks(
+      int* rooted_directional_tree, int* rooted_directional_idx_arr,
+      int* rooted_postorder_arr) {
+    int num_blocks = block_fitch_arr_.size();
+    vector<unique_ptr<string[]>> block_string_lists(num_blocks);
+    int block;
+    omp_set_num_threads(num_threads_);
+#pragma omp parallel for private(block)
+    for (block = 0; block < num_blocks; block++) {
+      auto block_fitch = block_fitch_arr_[block].get();
+      auto block_state_arr = block_state_arr_[block].get();
+      block_string_lists[block].reset(new string[num_nodes_]);
+      block_fitch->run_fitch_score(rooted_directional_tree,
+                                   rooted_directional_idx_arr,
+                                   rooted_postorder_arr, block_state_arr);
+      block_fitch->run_fitch_ancestral(
+          rooted_directional_tree, rooted_directional_idx_arr,
+          rooted_postorder_arr, block_state_arr,
+          block_string_lists[block].get());
+    }
+
+    // blocks are in pattern order, so the pattern strings are their
+    // concatenation
+    unique_ptr<string[]> pattern_string_list(new string[num_nodes_]);
+    for (int i = 0; i < num_nodes_; i++) {
+      pattern_string_list[i].reserve(num_char_trees_);
+      for (block = 0; block < num_blocks; block++) {
+        pattern_string_list[i] += block_string_lists[block][i];
+      }
     }
-    queue.push_back(array_copy);
+    shared_ptr<string> string_list = shared_ptr<string>(
+        new string[num_nodes_], [](string* p) { delete[] p; });
+    site_patterns_.get()->expand_string_list(pattern_string_list.get(),
+                                             string_list.get(), num_nodes_);
+    return string_list;
+  }
+
+  /**
+   * Small parsimony score of a tree, split by site blocks across the threads
+   * when the alignment has them
+   *
+   * @param state_arr : scratch of fitch_parsimony_, used without blocks only
+   */
+  int run_fitch_score_by_blocks(int* rooted_directional_tree,
+                                int* rooted_directional_idx_arr,
+                                int* rooted_postorder_arr,
+                                uint64_t* state_arr) {
+    int num_blocks = block_fitch_arr_.size();
+    if (num_blocks == 0) {
+      return fitch_parsimony_.get()->run_fitch_score(
+          rooted_directional_tree, rooted_directional_idx_arr,
+          rooted_postorder_arr, state_arr);
+    }
+    int score = 0;
+    int block;
+    omp_set_num_threads(num_threads_);
+#pragma omp parallel for private(block) reduction(+ : score)
+    for (block = 0; block < num_blocks; block++) {
+      score += block_fitch_arr_[block].get()->run_fitch_score(
+          rooted_directional_tree, rooted_directional_idx_arr,
+          rooted_postorder_arr, block_state_arr_[block].get());
+    }
+    return score;
+  }
+
+  // the neighbor of internal node a that is neither x nor y
+  int get_third_neighbor(int a, int x, int y,
+                         int* unrooted_undirectional_idx_arr,
+                         int* unrooted_undirectional_tree) {
+    int idx_a = unrooted_undirectional_idx_arr[a];
+    for (int k = idx_a; k < idx_a + 3; k++) {
+      int neighbor = unrooted_undirectional_tree[k];
+      if (neighbor != x && neighbor != y) {
+        return neighbor;
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * Fill in the move and the topology hash of candidate global_arr_idx, the
+   * j-th interchange across the internal edge (a, b) of a loaded tree, and
+   * record its topology
+   *
+   * @param j : 0 or 1, b's first or last neighbor other than a is exchanged
+   * with a's first neighbor other than b
+   * @param other : output, the third neighbors of a and b
+   * @return false when the candidate needs no score: its topology was scored
+   * in an earlier round and cannot beat new_score
+   */
+  bool record_nearest_neighbor_interchage(
+      int global_arr_idx, int a, int b, int j, int* unrooted_undirectional_tree,
+      const TopologyHash& topology_hash, int round, int* other) {
+    int a_child_idx = unrooted_undirectional_idx_arr_.get()[a];
+    int a_child = unrooted_undirectional_tree[a_child_idx];
+    a_child =
+        a_child == b ? unrooted_undirectional_tree[a_child_idx + 1] : a_child;
+    int b_child_idx = unrooted_undirectional_idx_arr_.get()[b];
+    int b_child = -1;
+    if (j) {
+      for (int k = 2; k >= 0; k--) {
+        b_child = unrooted_undirectional_tree[b_child_idx + k];
+        if (b_child != a) break;
+      }
+    } else {
+      for (int k = 0; k < 3; k++) {
+        b_child = unrooted_undirectional_tree[b_child_idx + k];
+        if (b_child != a) break;
+      }
+    }
+
+    other[0] = get_third_neighbor(a, b, a_child,
+                                  unrooted_undirectional_idx_arr_.get(),
+                                  unrooted_undirectional_tree);
+    other[1] = get_third_neighbor(b, a, b_child,
+                                  unrooted_undirectional_idx_arr_.get(),
+                                  unrooted_undirectional_tree);
+    uint64_t tree_hash = topology_hash.nearest_neighbor_interchage_hash(
+        a, b, a_child, b_child, other[0], other[1]);
+    hash_global_arr_[global_arr_idx] = tree_hash;
+    int* move = move_global_arr_.data() + global_arr_idx * 4;
+    move[0] = a;
+    move[1] = b;
+    move[2] = a_child;
+    move[3] = b_child;
+    // repeats within this round are dropped when picking the kept ones so
+    // that the pick does not depend on thread timing
+    int first_round;
+    bool is_new = topology_table_.get()->insert(tree_hash, round, first_round);
+    return is_new || first_round == round;
+  }
+
+  /**
+   * Search by subtree prune-and-regraft instead of nearest neighbor
+   * interchange. Every task prunes one subtree and scores all of its
+   * regrafts. Call before run_large_parsimony().
+   *
+   * @param radius : farthest regraft from the pruned node in edges, 1 gives
+   * the nearest neighbor interchanges
+   */
+  void set_spr_radius(int radius) {
+    spr_radius_ = radius;
+    move_candidate_arr_.resize(num_threads_);
+  }
+
+  /**
+   * Search by tree bisection-reconnection instead of nearest neighbor
+   * interchange or subtree prune-and-regraft. Every task cuts one edge and
+   * scores all of its reconnections. Call before run_large_parsimony().
+   *
+   * @param radius : farthest reconnection from the cut edge in edges, on
+   * either side
+   */
+  void set_tbr_radius(int radius) {
+    tbr_radius_ = radius;
+    move_candidate_arr_.resize(num_threads_);
+  }
+
+  // move the candidates of every thread to the global arrays, in task order
+  // so that the pick does not depend on thread timing
+  void merge_move_candidates(int tasks_per_tree) {
+    vector<MoveCandidate> candidate_arr;
+    for (auto& thread_candidate_arr : move_candidate_arr_) {
+      candidate_arr.insert(candidate_arr.end(), thread_candidate_arr.begin(),
+                           thread_candidate_arr.end());
+      thread_candidate_arr.clear();
+    }
+    sort(candidate_arr.begin(), candidate_arr.end(),
+         [](const MoveCandidate& x, const MoveCandidate& y) {
+           return x.task != y.task ? x.task < y.task : x.order < y.order;
+         });
+    int num_candidates = candidate_arr.size();
+    score_global_arr_.resize(num_candidates);
+    move_global_arr_.resize(num_candidates * 6);
+    hash_global_arr_.resize(num_candidates);
+    tree_global_arr_.resize(num_candidates);
+    for (int i = 0; i < num_candidates; i++) {
+      const MoveCandidate& candidate = candidate_arr[i];
+      score_global_arr_[i] = candidate.score;
+      hash_global_arr_[i] = candidate.tree_hash;
+      tree_global_arr_[i] = candidate.task / tasks_per_tree;
+      for (int k = 0; k < 6; k++) {
+        move_global_arr_[i * 6 + k] = candidate.move[k];
+      }
+    }
+  }
+
+  /**
+   * Walk parallel tempering chains from the input tree before the plateau
+   * walk, which then starts from the best trees they have been on. The
+   * chains propose regrafts within spr_radius_, nearest neighbor
+   * interchanges without it. Call before run_large_parsimony().
+   *
+   * @param num_steps : proposals of each chain
+   * @param num_chains : number of chains
+   * @param max_temperature : temperature of the hottest chain, the coldest
+   * one runs at a sixteenth of it
+   * @param seed : the chain i walks with seed + i
+   */
+  void set_tempering(int num_steps, int num_chains, double max_temperature,
+                     uint32_t seed) {
+    tempering_steps_ = num_steps;
+    tempering_chains_ = num_chains;
+    tempering_temperature_ = max_temperature;
+    tempering_seed_ = seed;
+  }
+
+  /**
+   * Save the search from time to time, and resume it if the checkpoint
+   * exists. Call before run_large_parsimony().
+   */
+  void set_checkpoint(shared_ptr<SearchCheckpoint> checkpoint) {
+    checkpoint_ = checkpoint;
+  }
+
+  /**
+   * Split the search with other processes, which all run it from the same
+   * tree with the same settings and end with the same trees. Call before
+   * run_large_parsimony(), not together with set_checkpoint().
+   */
+  void set_exchange(shared_ptr<SearchExchange> exchange) {
+    exchange_ = exchange;
+    // the new topologies of every slice go to the other processes
+    topology_table_.get()->set_journal(true);
+  }
+
+  /**
+   * Give every process the moves of all that score at most new_score, in
+   * the global arrays as if it had scored every task of the slice itself
+   *
+   * @param first_task : the first task of the slice this process scored
+   * @param num_tasks : the number of tasks it scored
+   */
+  void exchange_candidates(bool moving, int new_score, int first_task,
+                           int num_tasks) {
+    vector<MoveCandidate> candidate_arr;
+    if (moving) {
+      for (auto& thread_candidate_arr : move_candidate_arr_) {
+        for (auto& candidate : thread_candidate_arr) {
+          if (candidate.score <= new_score) {
+            candidate_arr.push_back(candidate);
+          }
+        }
+        thread_candidate_arr.clear();
+      }
+    } else {
+      for (int i = first_task * 2; i < (first_task + num_tasks) * 2; i++) {
+        if (score_global_arr_[i] <= new_score) {
+          const int* move = move_global_arr_.data() + i * 4;
+          candidate_arr.push_back(MoveCandidate{
+              i / 2, i % 2, score_global_arr_[i], hash_global_arr_[i],
+              {move[0], move[1], move[2], move[3], -1, -1}});
+        }
+      }
+    }
+    vector<MoveCandidate> all_candidate_arr;
+    exchange_.get()->all_gather(candidate_arr, all_candidate_arr);
+    if (moving) {
+      // merge_move_candidates() puts them in task order
+      move_candidate_arr_[0] = all_candidate_arr;
+      return;
+    }
+    fill(score_global_arr_.begin(), score_global_arr_.end(), INT_MAX);
+    for (auto& candidate : all_candidate_arr) {
+      int i = candidate.task * 2 + candidate.order;
+      score_global_arr_[i] = candidate.score;
+      hash_global_arr_[i] = candidate.tree_hash;
+      copy(candidate.move, candidate.move + 4, move_global_arr_.data() + i * 4);
+    }
+  }
+
+  // give every process the topologies all of them have seen
+  void exchange_topologies() {
+    vector<pair<uint64_t, int>> entry_arr;
+    topology_table_.get()->drain_journal(entry_arr);
+    vector<pair<uint64_t, int>> all_entry_arr;
+    exchange_.get()->all_gather(entry_arr, all_entry_arr);
+    int first_round;
+    for (auto& entry : all_entry_arr) {
+      topology_table_.get()->insert(entry.first, entry.second, first_round);
+    }
+    // known everywhere now
+    entry_arr.clear();
+    topology_table_.get()->drain_journal(entry_arr);
+  }
+
+  // restore the search from checkpoint_, false if it starts from the input
+  // tree
+  bool load_checkpoint(int& round, int& new_score, int& next_tree) {
+    if (checkpoint_.get() == nullptr) {
+      return false;
+    }
+    SearchState state;
+    bool loaded = checkpoint_.get()->load(state, *tree_pool_.get());
+    if (loaded) {
+      round = state.round;
+      new_score = state.new_score;
+      next_tree = state.next_tree;
+      min_large_parsimony_score_ = state.min_large_parsimony_score;
+      unrooted_undirectional_tree_queue_ = state.plateau_queue;
+      tmp_unrooted_undirectional_tree_queue_ = state.tmp_queue;
+      int first_round;
+      for (auto& entry : state.topology_arr) {
+        topology_table_.get()->insert(entry.first, entry.second, first_round);
+      }
+    }
+    // from here on every new topology goes to the next checkpoint as well
+    topology_table_.get()->set_journal(true);
+    return loaded;
+  }
+
+  // hand the search state to checkpoint_, which writes it in the background
+  void save_checkpoint(int round, int new_score, int next_tree) {
+    SearchState state;
+    state.round = round;
+    state.new_score = new_score;
+    state.min_large_parsimony_score = min_large_parsimony_score_;
+    state.next_tree = next_tree;
+    state.plateau_queue = unrooted_undirectional_tree_queue_;
+    state.tmp_queue = tmp_unrooted_undirectional_tree_queue_;
+    topology_table_.get()->drain_journal(state.topology_arr);
+    checkpoint_.get()->save(state);
+  }
+
+  // creat a copy of a tree in a pooled array and add the ptr to deque
+  void pooled_copy_push_back(deque<shared_ptr<int>>& queue,
+                             shared_ptr<int> tree) {
+    shared_ptr<int> tree_copy = tree_pool_.get()->acquire();
+    ispc_kernels_->array_copy_ispc(unrooted_undirectional_tree_len_,
+                                   tree.get(), tree_copy.get());
+    queue.push_back(tree_copy);
   }
 
   // creat a shallow copy of shared_ptr array and add the ptr to deque
@@ -373,8 +859,73 @@ class LargeParsimony {
   }
 
   /**
-   * input is undirected & unrooted tree; string list each time run a
-   * SmallParsimony, we got a directional&rooted array as well as a string list
+   * Run the tempering chains from the input tree, and put the best trees
+   * they have been on into tmp_unrooted_undirectional_tree_queue_
+   *
+   * @param round : the search round, for the topology table
+   * @param new_score : output, the score of those trees
+   */
+  void run_tempering(int round, int& new_score) {
+    TemperingCollector collector;
+    vector<unique_ptr<TemperingChain>> chain_arr(tempering_chains_);
+    vector<TemperingChain*> chain_ptr_arr(tempering_chains_);
+    for (int i = 0; i < tempering_chains_; i++) {
+      chain_arr[i].reset(new TemperingChain(fitch_parsimony_,
+                                            unrooted_undirectional_idx_arr_,
+                                            max(1, spr_radius_),
+                                            tempering_seed_ + i));
+      chain_ptr_arr[i] = chain_arr[i].get();
+      // geometric from the hottest chain down to the coldest
+      chain_arr[i].get()->temperature_ =
+          tempering_temperature_ *
+          pow(1.0 / 16, tempering_chains_ > 1
+                            ? double(i) / (tempering_chains_ - 1)
+                            : 0.0);
+      chain_arr[i].get()->load(unrooted_undirectional_tree_.get());
+      collector.offer(*chain_arr[i].get());
+    }
+
+    // the chains walk on their own between two rounds of swaps
+    mt19937 swap_generator(tempering_seed_);
+    for (int step = 0; step < tempering_steps_;
+         step += tempering_swap_steps_) {
+      int num_steps = tempering_steps_ - step;
+      if (num_steps > tempering_swap_steps_) {
+        num_steps = tempering_swap_steps_;
+      }
+#pragma omp parallel for schedule(static) num_threads(num_threads_)
+      for (int i = 0; i < tempering_chains_; i++) {
+        TemperingChain* chain = chain_arr[i].get();
+        for (int k = 0; k < num_steps; k++) {
+          if (chain->step()) {
+            collector.offer(*chain);
+          }
+        }
+      }
+      TemperingChain::swap_temperatures(chain_ptr_arr, swap_generator);
+    }
+
+    vector<vector<int>> tree_arr;
+    vector<uint64_t> hash_arr;
+    collector.get_trees(tree_arr, hash_arr);
+    new_score = collector.best_score_;
+    tmp_unrooted_undirectional_tree_queue_.clear();
+    for (auto& tree : tree_arr) {
+      shared_ptr<int> tree_copy = tree_pool_.get()->acquire();
+      ispc_kernels_->array_copy_ispc(unrooted_undirectional_tree_len_,
+                                     tree.data(), tree_copy.get());
+      shallow_copy_push_back<int>(tmp_unrooted_undirectional_tree_queue_,
+                                  tree_copy);
+    }
+    int first_round;
+    for (uint64_t tree_hash : hash_arr) {
+      topology_table_.get()->insert(tree_hash, round, first_round);
+    }
+  }
+
+  /**
+   * input is undirected & unrooted tree; string list each time a tree is
+   * scored, we got a directional&rooted array as well as a string list
    * denoted the string for each node. Keep recording the minumum one.
    */
   void run_large_parsimony() {
@@ -384,206 +935,729 @@ class LargeParsimony {
         shared_ptr<int>(new int[num_nodes_ + 1], [](int* p) { delete[] p; });
     shared_ptr<int> cur_rooted_directional_tree = shared_ptr<int>(
         new int[rooted_directional_tree_len_], [](int* p) { delete[] p; });
-    shared_ptr<char> cur_rooted_char_list = shared_ptr<char>(
-        new char[rooted_char_list_len_], [](char* p) { delete[] p; });
-    shared_ptr<string> cur_string_list = shared_ptr<string>(
-        new string[num_nodes_], [](string* p) { delete[] p; });
+    shared_ptr<int> cur_rooted_postorder_arr = shared_ptr<int>(
+        new int[rooted_postorder_arr_len_], [](int* p) { delete[] p; });
+    shared_ptr<uint64_t> cur_state_arr = shared_ptr<uint64_t>(
+        new uint64_t[fitch_parsimony_.get()->state_arr_len()],
+        [](uint64_t* p) { delete[] p; });
 
-    ispc::array_copy_ispc(unrooted_undirectional_tree_len_,
-                          unrooted_undirectional_tree_.get(),
-                          cur_unrooted_undirectional_tree.get());
+    int small_parsimony_total_score;
+    int new_score;
+    int round = 0;
+    int first_round = 0;
+    // also loads the plateau trees of the rounds that are split by sites
+    TopologyHash site_topology_hash(num_nodes_ + 1, num_leaves_);
+    // the plateau trees before next_tree are searched already
+    int next_tree = 0;
+    // topologies of the trees kept for the next round
+    unordered_set<uint64_t> kept_hashes;
+    if (load_checkpoint(round, new_score, next_tree)) {
+      for (auto tree : tmp_unrooted_undirectional_tree_queue_) {
+        make_tree_rooted_directional(
+            unrooted_undirectional_idx_arr_.get(), tree.get(),
+            cur_rooted_directional_idx_arr.get(),
+            cur_rooted_directional_tree.get(), cur_rooted_postorder_arr.get(),
+            num_nodes_);
+        kept_hashes.insert(
+            site_topology_hash.load_tree(cur_rooted_directional_tree.get(),
+                                         cur_rooted_directional_idx_arr.get(),
+                                         cur_rooted_postorder_arr.get()));
+      }
+    } else {
+      ispc_kernels_->array_copy_ispc(unrooted_undirectional_tree_len_,
+                                     unrooted_undirectional_tree_.get(),
+                                     cur_unrooted_undirectional_tree.get());
 
-    make_tree_rooted_directional(unrooted_undirectional_idx_arr_.get(),
-                                 cur_unrooted_undirectional_tree.get(),
-                                 cur_rooted_directional_idx_arr.get(),
-                                 cur_rooted_directional_tree.get(), num_nodes_);
+      make_tree_rooted_directional(unrooted_undirectional_idx_arr_.get(),
+                                   cur_unrooted_undirectional_tree.get(),
+                                   cur_rooted_directional_idx_arr.get(),
+                                   cur_rooted_directional_tree.get(),
+                                   cur_rooted_postorder_arr.get(), num_nodes_);
 
-    ispc::map_char_idx_ispc(rooted_char_list_len_,
-                            (int8_t*)rooted_char_list_.get(),
-                            (int8_t*)cur_rooted_char_list.get());
+      // run small parsimony
+      if (sankoff_parsimony_.get() != nullptr) {
+        unique_ptr<uint16_t[]> sankoff_state_arr(
+            new uint16_t[sankoff_parsimony_.get()->state_arr_len()]);
+        small_parsimony_total_score =
+            sankoff_parsimony_.get()->run_sankoff_score(
+                cur_rooted_directional_tree.get(),
+                cur_rooted_directional_idx_arr.get(),
+                cur_rooted_postorder_arr.get(), sankoff_state_arr.get());
+      } else {
+        small_parsimony_total_score = run_fitch_score_by_blocks(
+            cur_rooted_directional_tree.get(),
+            cur_rooted_directional_idx_arr.get(),
+            cur_rooted_postorder_arr.get(), cur_state_arr.get());
+      }
+      topology_table_.get()->insert(
+          site_topology_hash.load_tree(cur_rooted_directional_tree.get(),
+                                       cur_rooted_directional_idx_arr.get(),
+                                       cur_rooted_postorder_arr.get()),
+          round, first_round);
 
-    for (int i = 0; i < num_nodes_; i++) {
-      cur_string_list.get()[i] = "";
-    }
-
-    // run small parsimony
-    int small_parsimony_total_score = run_small_parsimony_string(
-        num_char_trees_, cur_rooted_char_list.get(),
-        cur_rooted_directional_tree.get(), cur_rooted_directional_idx_arr.get(),
-        cur_string_list.get(), num_nodes_ + 1);
-
-    // initialization
-    int new_score = small_parsimony_total_score;
-    deep_copy_push_back<int>(tmp_unrooted_undirectional_tree_queue_,
-                             cur_unrooted_undirectional_tree,
-                             unrooted_undirectional_tree_len_);
-    deep_copy_push_back<string>(tmp_string_list_queue_, cur_string_list,
-                                num_nodes_);
-
-    while (!tmp_unrooted_undirectional_tree_queue_.empty()) {
-      // record tmp list to final list
-      unrooted_undirectional_tree_queue_ =
-          tmp_unrooted_undirectional_tree_queue_;
-      string_list_queue_ = tmp_string_list_queue_;
-      // clear up tmp list
-      tmp_unrooted_undirectional_tree_queue_ = deque<shared_ptr<int>>();
-      tmp_string_list_queue_ = deque<shared_ptr<string>>();
-
-      // should use new_score -1 is for comparation (here compatible with
-      // weichen's code)
-      min_large_parsimony_score_ = new_score--;
-
-      auto tree_start = unrooted_undirectional_tree_queue_.begin();
-      auto tree_end = unrooted_undirectional_tree_queue_.end();
-      auto string_i_ptr = string_list_queue_.begin();
-
-      // Allocate global internal array
-      int global_arr_len =
-          unrooted_undirectional_tree_queue_.size() * num_edges_ * 2;
-      shared_ptr<shared_ptr<int>> unrooted_undirectional_tree_global_arr =
-          shared_ptr<shared_ptr<int>>(new shared_ptr<int>[global_arr_len],
-                                      [](shared_ptr<int>* p) { delete[] p; });
-      shared_ptr<shared_ptr<int>> rooted_directional_tree_global_arr =
-          shared_ptr<shared_ptr<int>>(new shared_ptr<int>[global_arr_len],
-                                      [](shared_ptr<int>* p) { delete[] p; });
-      shared_ptr<shared_ptr<int>> rooted_directional_idx_global_arr =
-          shared_ptr<shared_ptr<int>>(new shared_ptr<int>[global_arr_len],
-                                      [](shared_ptr<int>* p) { delete[] p; });
-      shared_ptr<shared_ptr<char>> rooted_char_list_global_arr =
-          shared_ptr<shared_ptr<char>>(new shared_ptr<char>[global_arr_len],
-                                       [](shared_ptr<char>* p) { delete[] p; });
-      // Allocate global output array
-      shared_ptr<int> score_global_arr =
-          shared_ptr<int>(new int[global_arr_len], [](int* p) { delete[] p; });
-      shared_ptr<shared_ptr<string>> string_list_global_arr =
-          shared_ptr<shared_ptr<string>>(
-              new shared_ptr<string>[global_arr_len],
-              [](shared_ptr<string>* p) { delete[] p; });
-
-      for (auto tree_i_ptr = tree_start; tree_i_ptr != tree_end;
-           ++tree_i_ptr, ++string_i_ptr) {
-        unrooted_undirectional_tree_ = *tree_i_ptr;
-        // get all edges for unrooted_undirectional_tree_
-        // write to edges; visited
-        get_edges_from_unrooted_undirectional_tree(
-            num_leaves_, num_nodes_, unrooted_undirectional_idx_arr_.get(),
-            unrooted_undirectional_tree_.get(), edges_.get(), visited_.get());
-
-        // For each edge, exchange the internal edges to get 2 new trees
-        int length = num_edges_ * 2;
-        int i = 0;
-        omp_set_num_threads(num_threads_);
-#pragma omp parallel for private(i, cur_unrooted_undirectional_tree, \
-                                 cur_rooted_directional_idx_arr,     \
-                                 cur_rooted_directional_tree,        \
-                                 cur_rooted_char_list, cur_string_list)
-        for (i = 0; i < length; i += 2) {
-          int a = edges_.get()[i];
-          int b = edges_.get()[i + 1];
-          int a_child_idx = unrooted_undirectional_idx_arr_.get()[a];
-          int a_child = unrooted_undirectional_tree_.get()[a_child_idx];
-          a_child = a_child == b
-                        ? unrooted_undirectional_tree_.get()[a_child_idx + 1]
-                        : a_child;
-          int b_child_idx = unrooted_undirectional_idx_arr_.get()[b];
-          int b_child = -1;
-
-          // exchange b's j_th child in unrooted & undirectional tree
-          for (int j = 0; j < 2; j++) {
-            if (j) {
-              for (int k = 2; k >= 0; k--) {
-                b_child = unrooted_undirectional_tree_.get()[b_child_idx + k];
-                if (b_child != a) break;
-              }
-            } else {
-              for (int k = 0; k < 3; k++) {
-                b_child = unrooted_undirectional_tree_.get()[b_child_idx + k];
-                if (b_child != a) break;
-              }
+      // initialization
+      new_score = small_parsimony_total_score;
+      pooled_copy_push_back(tmp_unrooted_undirectional_tree_queue_,
+                            cur_unrooted_undirectional_tree);
+      if (tempering_steps_ > 0) {
+        run_tempering(round, new_score);
+      }
+    }
+    // the plateau trees slice_begin ... slice_end - 1 are being scored
+    int slice_begin = 0;
+    int slice_end = 0;
+
+    // every (tree, edge) pair of a round is one task, so a wide plateau of
+    // small trees keeps all threads busy
+    WorkStealingRange task_range(num_threads_);
+    // a round with too few tasks instead scores its trees one by one, each
+    // thread taking a site block of every candidate, with Fitch only
+    int num_blocks = unit_cost_ ? int(block_fitch_arr_.size()) : 0;
+    bool site_parallel = false;
+    unique_ptr<int[]> site_edges(new int[num_edges_ * 2]);
+    unique_ptr<bool[]> site_visited(new bool[num_nodes_]);
+    // third neighbors of every candidate of the tree being scored
+    unique_ptr<int[]> site_other_arr(new int[num_edges_ * 2 * 2]);
+    // a task is one edge with interchanges, one pruned subtree with
+    // regrafts: both sides of every edge at an internal node, or one cut
+    // edge with reconnections: each edge from its internal end with the
+    // lower number, the other slots are empty tasks
+    bool moving = spr_radius_ > 0 || tbr_radius_ > 0;
+    int tasks_per_tree = moving ? 3 * (num_nodes_ - num_leaves_) : num_edges_;
+    bool searching = true;
+    // the tasks of the slice this process scores, all without exchange_
+    int first_task = 0;
+    int num_share_tasks = 0;
+    vector<int> kept;
+    vector<shared_ptr<int>> kept_trees;
+
+    // one parallel region for the whole search, the queue bookkeeping is
+    // done by a single thread between the phases of each round
+    omp_set_num_threads(num_threads_);
+#pragma omp parallel
+    {
+      int thread_id = omp_get_thread_num();
+      // the plateau tree this thread has loaded, -1 for none
+      int loaded_tree = -1;
+      // split hashes of the loaded tree
+      TopologyHash topology_hash(num_nodes_ + 1, num_leaves_);
+      unique_ptr<int[]> edges(new int[num_edges_ * 2]);
+      unique_ptr<bool[]> visited(new bool[num_nodes_]);
+      unique_ptr<int[]> rooted_directional_idx_arr(new int[num_nodes_ + 1]);
+      unique_ptr<int[]> rooted_directional_tree(
+          new int[rooted_directional_tree_len_]);
+      unique_ptr<int[]> rooted_postorder_arr(
+          new int[rooted_postorder_arr_len_]);
+      // down & up costs of the loaded tree, Fitch sets for unit costs and
+      // Sankoff costs under a step matrix, only one of them is built
+      unique_ptr<FitchUpDown> fitch_up_down;
+      unique_ptr<uint64_t[]> scratch;
+      unique_ptr<SankoffUpDown> sankoff_up_down;
+      unique_ptr<uint16_t[]> sankoff_scratch;
+      if (sankoff_parsimony_.get() != nullptr) {
+        sankoff_up_down.reset(new SankoffUpDown(sankoff_parsimony_));
+        sankoff_scratch.reset(new uint16_t[sankoff_up_down->scratch_len()]);
+      } else {
+        fitch_up_down.reset(new FitchUpDown(fitch_parsimony_));
+        scratch.reset(new uint64_t[fitch_up_down->scratch_len()]);
+      }
+      unique_ptr<FitchSpr> fitch_spr;
+      unique_ptr<FitchTbr> fitch_tbr;
+      if (tbr_radius_ > 0) {
+        fitch_tbr.reset(new FitchTbr(fitch_parsimony_, tbr_radius_));
+      } else if (spr_radius_ > 0) {
+        fitch_spr.reset(new FitchSpr(fitch_parsimony_, spr_radius_));
+      }
+
+      while (true) {
+#pragma omp single
+        {
+          int num_trees = unrooted_undirectional_tree_queue_.size();
+          if (next_tree == num_trees) {
+            searching = !tmp_unrooted_undirectional_tree_queue_.empty();
+            if (searching) {
+              // record tmp list to final list
+              unrooted_undirectional_tree_queue_ =
+                  tmp_unrooted_undirectional_tree_queue_;
+              // clear up tmp list
+              tmp_unrooted_undirectional_tree_queue_ =
+                  deque<shared_ptr<int>>();
+
+              // should use new_score -1 is for comparation (here compatible
+              // with weichen's code)
+              // the search only scores informative columns, the dropped
+              // ones cost the same on every tree
+              min_large_parsimony_score_ =
+                  new_score-- + site_patterns_.get()->uninformative_score_;
+              round++;
+              num_trees = unrooted_undirectional_tree_queue_.size();
+              next_tree = 0;
+              kept_hashes.clear();
             }
+          }
+          if (searching) {
+            // the whole round is one slice unless it has to be saved on the
+            // way
+            slice_begin = next_tree;
+            int slice_len = num_trees;
+            if (checkpoint_.get() != nullptr) {
+              slice_len =
+                  max(1, checkpoint_slice_tasks_ / max(1, tasks_per_tree));
+            }
+            slice_end = min(num_trees, slice_begin + slice_len);
 
-            // Gather all information
-            // Duplication spaces
-            cur_unrooted_undirectional_tree =
-                shared_ptr<int>(new int[unrooted_undirectional_tree_len_],
-                                [](int* p) { delete[] p; });
-            cur_rooted_directional_idx_arr = shared_ptr<int>(
-                new int[num_nodes_ + 1], [](int* p) { delete[] p; });
-            cur_rooted_directional_tree =
-                shared_ptr<int>(new int[rooted_directional_tree_len_],
-                                [](int* p) { delete[] p; });
-            cur_rooted_char_list = shared_ptr<char>(
-                new char[rooted_char_list_len_], [](char* p) { delete[] p; });
-            cur_string_list = shared_ptr<string>(new string[num_nodes_],
-                                                 [](string* p) { delete[] p; });
-
-            // must reinitialize below
-            ispc::array_copy_ispc(unrooted_undirectional_tree_len_,
-                                  unrooted_undirectional_tree_.get(),
-                                  cur_unrooted_undirectional_tree.get());
-
-            // writed to cur_unrooted_undirectional_tree
-            nearest_neighbor_interchage(a, b, a_child, b_child,
-                                        unrooted_undirectional_idx_arr_.get(),
-                                        cur_unrooted_undirectional_tree.get());
-            make_tree_rooted_directional(unrooted_undirectional_idx_arr_.get(),
-                                         cur_unrooted_undirectional_tree.get(),
+            int num_tasks = (slice_end - slice_begin) * tasks_per_tree;
+            site_parallel = false;
+            if (!moving) {
+              // global output array, only reallocated when the slice is the
+              // widest so far
+              score_global_arr_.resize(num_tasks * 2);
+              move_global_arr_.resize(num_tasks * 2 * 4);
+              hash_global_arr_.resize(num_tasks * 2);
+              site_parallel =
+                  num_blocks > 1 &&
+                  num_tasks < num_threads_ * min_tasks_per_thread_;
+            }
+            first_task = 0;
+            num_share_tasks = num_tasks;
+            if (exchange_.get() != nullptr) {
+              exchange_.get()->share_tasks(num_tasks, first_task,
+                                           num_share_tasks);
+            }
+            task_range.reset(site_parallel ? 0 : num_share_tasks,
+                             omp_get_num_threads(), first_task);
+          }
+        }
+        if (!searching) {
+          break;
+        }
+
+        int site_slice_end = site_parallel ? slice_end : slice_begin;
+        for (int tree_idx = slice_begin; tree_idx < site_slice_end;
+             tree_idx++) {
+          int num_candidates = num_edges_ * 2;
+          int slice_idx = tree_idx - slice_begin;
+          int* score_arr =
+              score_global_arr_.data() + slice_idx * num_candidates;
+#pragma omp single
+          {
+            int* unrooted_undirectional_tree =
+                unrooted_undirectional_tree_queue_[tree_idx].get();
+            get_edges_from_unrooted_undirectional_tree(
+                num_leaves_, num_nodes_, unrooted_undirectional_idx_arr_.get(),
+                unrooted_undirectional_tree, site_edges.get(),
+                site_visited.get());
+            make_tree_rooted_directional(
+                unrooted_undirectional_idx_arr_.get(),
+                unrooted_undirectional_tree,
+                cur_rooted_directional_idx_arr.get(),
+                cur_rooted_directional_tree.get(),
+                cur_rooted_postorder_arr.get(), num_nodes_);
+            site_topology_hash.load_tree(cur_rooted_directional_tree.get(),
                                          cur_rooted_directional_idx_arr.get(),
-                                         cur_rooted_directional_tree.get(),
-                                         num_nodes_);
+                                         cur_rooted_postorder_arr.get());
+            // the block scores are summed into score_arr
+            for (int c = 0; c < num_candidates; c++) {
+              bool to_score = record_nearest_neighbor_interchage(
+                  slice_idx * num_candidates + c, site_edges[c / 2 * 2],
+                  site_edges[c / 2 * 2 + 1], c % 2, unrooted_undirectional_tree,
+                  site_topology_hash, round, site_other_arr.get() + c * 2);
+              score_arr[c] = to_score ? 0 : INT_MAX;
+            }
+          }
+
+#pragma omp for schedule(static)
+          for (int block = 0; block < num_blocks; block++) {
+            auto block_up_down = block_up_down_arr_[block].get();
+            block_up_down->load_tree(cur_rooted_directional_tree.get(),
+                                     cur_rooted_directional_idx_arr.get(),
+                                     cur_rooted_postorder_arr.get());
+            for (int c = 0; c < num_candidates; c++) {
+              if (score_arr[c] == INT_MAX) {
+                continue;
+              }
+              int* move = move_global_arr_.data() +
+                          (slice_idx * num_candidates + c) * 4;
+              int block_score =
+                  block_up_down->score_nearest_neighbor_interchage(
+                      move[0], move[1], move[2], move[3], site_other_arr[c * 2],
+                      site_other_arr[c * 2 + 1],
+                      block_scratch_arr_[block].get());
+#pragma omp atomic
+              score_arr[c] += block_score;
+            }
+          }
+        }
 
-            ispc::map_char_idx_ispc(rooted_char_list_len_,
-                                    (int8_t*)rooted_char_list_.get(),
-                                    (int8_t*)cur_rooted_char_list.get());
+        loaded_tree = -1;
+        int task;
+        while (task_range.next(thread_id, task)) {
+          int tree_idx = slice_begin + task / tasks_per_tree;
+          int* unrooted_undirectional_tree =
+              unrooted_undirectional_tree_queue_[tree_idx].get();
+          if (tree_idx != loaded_tree) {
+            // one up/down pass, then every interchange is scored from the
+            // four subtrees around its edge
+            get_edges_from_unrooted_undirectional_tree(
+                num_leaves_, num_nodes_,
+                unrooted_undirectional_idx_arr_.get(),
+                unrooted_undirectional_tree, edges.get(), visited.get());
+            make_tree_rooted_directional(
+                unrooted_undirectional_idx_arr_.get(),
+                unrooted_undirectional_tree, rooted_directional_idx_arr.get(),
+                rooted_directional_tree.get(), rooted_postorder_arr.get(),
+                num_nodes_);
+            if (sankoff_up_down.get() != nullptr) {
+              sankoff_up_down->load_tree(rooted_directional_tree.get(),
+                                         rooted_directional_idx_arr.get(),
+                                         rooted_postorder_arr.get());
+            } else {
+              fitch_up_down->load_tree(rooted_directional_tree.get(),
+                                       rooted_directional_idx_arr.get(),
+                                       rooted_postorder_arr.get());
+            }
+            topology_hash.load_tree(rooted_directional_tree.get(),
+                                    rooted_directional_idx_arr.get(),
+                                    rooted_postorder_arr.get());
+            loaded_tree = tree_idx;
+          }
 
-            for (int i = 0; i < num_nodes_; i++) {
-              cur_string_list.get()[i] = "";
+          if (tbr_radius_ > 0) {
+            int k = task % tasks_per_tree;
+            int a = num_leaves_ + k / 3;
+            int b = unrooted_undirectional_tree
+                [unrooted_undirectional_idx_arr_.get()[a] + k % 3];
+            if (b >= num_leaves_ && b < a) {
+              continue;
             }
+            vector<MoveCandidate>& candidate_arr =
+                move_candidate_arr_[thread_id];
+            int order = 0;
+            fitch_tbr.get()->for_each_reconnection(
+                *fitch_up_down, topology_hash,
+                unrooted_undirectional_idx_arr_.get(),
+                unrooted_undirectional_tree, a, b, new_score,
+                [&](int xa, int ya, int xb, int yb, uint64_t tree_hash,
+                    int score) {
+                  order++;
+                  int first_round;
+                  bool is_new = topology_table_.get()->insert(
+                      tree_hash, round, first_round);
+                  if (is_new || first_round == round) {
+                    candidate_arr.push_back(MoveCandidate{
+                        task, order, score, tree_hash, {a, b, xa, ya, xb, yb}});
+                  }
+                });
+            continue;
+          }
+          if (spr_radius_ > 0) {
+            int k = task % tasks_per_tree;
+            int p = num_leaves_ + k / 3;
+            int s = unrooted_undirectional_tree
+                [unrooted_undirectional_idx_arr_.get()[p] + k % 3];
+            vector<MoveCandidate>& candidate_arr =
+                move_candidate_arr_[thread_id];
+            int order = 0;
+            fitch_spr.get()->for_each_regraft(
+                *fitch_up_down, topology_hash,
+                unrooted_undirectional_idx_arr_.get(),
+                unrooted_undirectional_tree, p, s,
+                [&](int x, int y, uint64_t tree_hash) {
+                  order++;
+                  // as for the interchanges, repeats within this round are
+                  // scored again
+                  int first_round;
+                  bool is_new = topology_table_.get()->insert(
+                      tree_hash, round, first_round);
+                  if (!is_new && first_round != round) {
+                    return;
+                  }
+                  int score = fitch_spr.get()->regraft_score();
+                  if (score <= new_score) {
+                    candidate_arr.push_back(MoveCandidate{
+                        task, order, score, tree_hash, {p, s, x, y, -1, -1}});
+                  }
+                });
+            continue;
+          }
 
+          // For each edge, exchange the internal edges to get 2 new trees
+          int i = (task % num_edges_) * 2;
+          for (int j = 0; j < 2; j++) {
             // Global assignment
-            int global_arr_idx =
-                (tree_i_ptr - tree_start) * num_edges_ * 2 + i + j;
-            unrooted_undirectional_tree_global_arr.get()[global_arr_idx] =
-                cur_unrooted_undirectional_tree;
-            rooted_directional_idx_global_arr.get()[global_arr_idx] =
-                cur_rooted_directional_idx_arr;
-            rooted_directional_tree_global_arr.get()[global_arr_idx] =
-                cur_rooted_directional_tree;
-            rooted_char_list_global_arr.get()[global_arr_idx] =
-                cur_rooted_char_list;
-            string_list_global_arr.get()[global_arr_idx] = cur_string_list;
+            int global_arr_idx = task * 2 + j;
+            int other[2];
+            bool to_score = record_nearest_neighbor_interchage(
+                global_arr_idx, edges[i], edges[i + 1], j,
+                unrooted_undirectional_tree, topology_hash, round, other);
+            int* move = move_global_arr_.data() + global_arr_idx * 4;
+            int score = INT_MAX;
+            if (to_score && sankoff_up_down.get() != nullptr) {
+              score = sankoff_up_down->score_nearest_neighbor_interchage(
+                  move[0], move[1], move[2], move[3], other[0], other[1],
+                  sankoff_scratch.get());
+            } else if (to_score) {
+              score = fitch_up_down->score_nearest_neighbor_interchage(
+                  move[0], move[1], move[2], move[3], other[0], other[1],
+                  scratch.get());
+            }
+            score_global_arr_[global_arr_idx] = score;
           }
         }
-      }
-      int i;
-      omp_set_num_threads(num_threads_);
-#pragma omp parallel for private(i, small_parsimony_total_score)
-      for (i = 0; i < global_arr_len; i++) {
-        small_parsimony_total_score = run_small_parsimony_string(
-            num_char_trees_, rooted_char_list_global_arr.get()[i].get(),
-            rooted_directional_tree_global_arr.get()[i].get(),
-            rooted_directional_idx_global_arr.get()[i].get(),
-            string_list_global_arr.get()[i].get(), num_nodes_ + 1);
-        score_global_arr.get()[i] = small_parsimony_total_score;
-      }
-
-      // record the minmal one
-      for (i = 0; i < global_arr_len; i++) {
-        small_parsimony_total_score = score_global_arr.get()[i];
-        if (small_parsimony_total_score <= new_score) {
-          if (small_parsimony_total_score < new_score) {
-            // first clear tmp list
-            tmp_unrooted_undirectional_tree_queue_.clear();
-            tmp_string_list_queue_.clear();
-            new_score = small_parsimony_total_score;
+#pragma omp barrier
+
+#pragma omp single
+        {
+          // every process picks from the moves of all, a slice scored by
+          // sites is scored by each of them
+          if (exchange_.get() != nullptr) {
+            exchange_candidates(moving, new_score, first_task,
+                                num_share_tasks);
+          }
+          if (moving) {
+            merge_move_candidates(tasks_per_tree);
+          }
+          // record the minmal one, each topology once, the slices of a round
+          // add to the trees kept by the earlier ones
+          kept.clear();
+          int global_arr_len = score_global_arr_.size();
+          for (int i = 0; i < global_arr_len; i++) {
+            small_parsimony_total_score = score_global_arr_[i];
+            if (small_parsimony_total_score <= new_score) {
+              if (small_parsimony_total_score < new_score) {
+                // first clear tmp list
+                kept.clear();
+                kept_hashes.clear();
+                tmp_unrooted_undirectional_tree_queue_.clear();
+                new_score = small_parsimony_total_score;
+              }
+              if (kept_hashes.insert(hash_global_arr_[i]).second) {
+                kept.push_back(i);
+              }
+            }
+          }
+          kept_trees.assign(kept.size(), shared_ptr<int>());
+        }
+
+        // only the kept trees are built
+        int num_kept = kept.size();
+#pragma omp for
+        for (int i = 0; i < num_kept; i++) {
+          int idx = kept[i];
+          int* move = move_global_arr_.data() + idx * (moving ? 6 : 4);
+          shared_ptr<int> tree = tree_pool_.get()->acquire();
+          int tree_idx = slice_begin + (moving ? tree_global_arr_[idx]
+                                               : idx / (num_edges_ * 2));
+          ispc_kernels_->array_copy_ispc(
+              unrooted_undirectional_tree_len_,
+              unrooted_undirectional_tree_queue_[tree_idx].get(), tree.get());
+          if (moving) {
+            tree_bisection_reconnection(move[0], move[1], move[2], move[3],
+                                        move[4], move[5],
+                                        unrooted_undirectional_idx_arr_.get(),
+                                        tree.get());
+          } else {
+            nearest_neighbor_interchage(move[0], move[1], move[2], move[3],
+                                        unrooted_undirectional_idx_arr_.get(),
+                                        tree.get());
+          }
+          kept_trees[i] = tree;
+        }
+
+#pragma omp single
+        {
+          for (int i = 0; i < num_kept; i++) {
+            shallow_copy_push_back<int>(tmp_unrooted_undirectional_tree_queue_,
+                                        kept_trees[i]);
+          }
+          next_tree = slice_end;
+          if (exchange_.get() != nullptr) {
+            exchange_topologies();
+          }
+          if (checkpoint_.get() != nullptr && checkpoint_.get()->due()) {
+            save_checkpoint(round, new_score, next_tree);
           }
+        }
+      }
+    }
+
+    // a rerun after the search ended goes straight to the output
+    if (checkpoint_.get() != nullptr) {
+      save_checkpoint(round, new_score, next_tree);
+      checkpoint_.get()->finish();
+    }
+  }
+
+  // a search like this one over site_patterns from tree, run to its end on
+  // the calling thread
+  shared_ptr<LargeParsimony> ratchet_search(
+      shared_ptr<int> tree, shared_ptr<SitePatterns> site_patterns) {
+    shared_ptr<LargeParsimony> search = make_shared<LargeParsimony>(
+        tree, unrooted_undirectional_idx_arr_, site_patterns, num_nodes_,
+        num_leaves_, 1, ispc_kernels_);
+    search.get()->set_cost_matrix(cost_arr_);
+    if (tbr_radius_ > 0) {
+      search.get()->set_tbr_radius(tbr_radius_);
+    } else if (spr_radius_ > 0) {
+      search.get()->set_spr_radius(spr_radius_);
+    }
+    search.get()->run_large_parsimony();
+    return search;
+  }
+
+  /**
+   * Add the trees of a search that score as low as the best ones, or take
+   * them instead when they score less
+   *
+   * @param search : a finished search over site_patterns_
+   * @param best_hash_set : split hashes of the best trees, each is kept once
+   */
+  void merge_ratchet_search(LargeParsimony& search,
+                            unordered_set<uint64_t>& best_hash_set) {
+    int score = search.min_large_parsimony_score_;
+    if (score > min_large_parsimony_score_) {
+      return;
+    }
+    if (score < min_large_parsimony_score_) {
+      min_large_parsimony_score_ = score;
+      unrooted_undirectional_tree_queue_.clear();
+      best_hash_set.clear();
+    }
+    int num_trees = search.unrooted_undirectional_tree_queue_.size();
+    for (int i = 0; i < num_trees; i++) {
+      if (best_hash_set.insert(search.get_tree_hash(i)).second) {
+        unrooted_undirectional_tree_queue_.push_back(
+            search.unrooted_undirectional_tree_queue_[i]);
+      }
+    }
+  }
+
+  /**
+   * Parsimony ratchet after run_large_parsimony(): each iteration searches
+   * from the last tree with some columns weighing double, then from the
+   * tree that gives with the input weights again. num_threads_ iterations
+   * run side by side from the same tree, one per thread, and the next ones
+   * go on from the best tree of them. The best trees of every iteration join
+   * unrooted_undirectional_tree_queue_, in iteration order.
+   *
+   * @param num_iterations : number of iterations
+   * @param upweight : chance of a column to weigh double in an iteration
+   * @param seed : the same seed reweighs the same way
+   */
+  void run_ratchet(int num_iterations, double upweight, uint32_t seed) {
+    unordered_set<uint64_t> best_hash_set;
+    for (int i = 0; i < int(unrooted_undirectional_tree_queue_.size()); i++) {
+      best_hash_set.insert(get_tree_hash(i));
+    }
+    // one seed per iteration, whichever thread runs it
+    mt19937 generator(seed);
+    vector<uint32_t> seed_arr(num_iterations);
+    for (auto& iteration_seed : seed_arr) {
+      iteration_seed = generator();
+    }
+
+    shared_ptr<int> tree = unrooted_undirectional_tree_queue_[0];
+    for (int first = 0; first < num_iterations; first += num_threads_) {
+      int num_batch = min(num_threads_, num_iterations - first);
+      vector<shared_ptr<LargeParsimony>> search_arr(num_batch);
+#pragma omp parallel for schedule(dynamic) num_threads(num_threads_)
+      for (int i = 0; i < num_batch; i++) {
+        mt19937 iteration_generator(seed_arr[first + i]);
+        shared_ptr<LargeParsimony> perturbed_search = ratchet_search(
+            tree, site_patterns_.get()->reweighted(iteration_generator,
+                                                   upweight));
+        search_arr[i] = ratchet_search(
+            perturbed_search.get()->unrooted_undirectional_tree_queue_[0],
+            site_patterns_);
+      }
+      int next = 0;
+      for (int i = 0; i < num_batch; i++) {
+        merge_ratchet_search(*search_arr[i].get(), best_hash_set);
+        if (search_arr[i].get()->min_large_parsimony_score_ <
+            search_arr[next].get()->min_large_parsimony_score_) {
+          next = i;
+        }
+      }
+      tree = search_arr[next].get()->unrooted_undirectional_tree_queue_[0];
+    }
+  }
+
+  /**
+   * Replace the trees found with every most parsimonious tree, by branch and
+   * bound from the score they have. The partial trees of a few leaves are
+   * shared out to the threads, which cut their own partial trees with the
+   * best score any of them has found. With exchange_ every process searches
+   * a contiguous share of them, in batches after which the processes take
+   * the best score of all. Only for few leaves, see BranchAndBound.hpp.
+   */
+  void run_branch_and_bound() {
+    // the search scores the informative patterns only
+    int max_score =
+        min_large_parsimony_score_ - site_patterns_.get()->uninformative_score_;
+    BranchAndBound branch_and_bound(unrooted_undirectional_idx_arr_,
+                                    site_patterns_, num_nodes_, num_leaves_,
+                                    max_score);
+    // enough tasks to even out the threads of every process
+    int num_ranks =
+        exchange_.get() != nullptr ? exchange_.get()->num_ranks_ : 1;
+    vector<BranchTask> task_arr =
+        branch_and_bound.split(num_threads_ * 16 * num_ranks);
+    int num_tasks = task_arr.size();
+    // the tasks of this process, all without exchange_
+    int first_task = 0;
+    int num_local_tasks = num_tasks;
+    int batch_len = num_tasks;
+    if (exchange_.get() != nullptr) {
+      exchange_.get()->share_tasks(num_tasks, first_task, num_local_tasks);
+      batch_len = num_threads_ * 4;
+    }
+    // every process runs as many batches as the largest share needs
+    int max_local_tasks = (num_tasks + num_ranks - 1) / num_ranks;
+    int num_batches = (max_local_tasks + batch_len - 1) / batch_len;
+
+    vector<vector<vector<int>>> tree_arr(num_local_tasks);
+    vector<vector<int>> score_arr(num_local_tasks);
+    for (int batch = 0; batch < num_batches; batch++) {
+      int begin = min(batch * batch_len, num_local_tasks);
+      int end = min(begin + batch_len, num_local_tasks);
+#pragma omp parallel for schedule(dynamic) num_threads(num_threads_)
+      for (int t = begin; t < end; t++) {
+        branch_and_bound.search(task_arr[first_task + t], tree_arr[t],
+                                score_arr[t]);
+      }
+      if (exchange_.get() != nullptr) {
+        vector<int> best_score_arr;
+        exchange_.get()->all_gather(
+            vector<int>{branch_and_bound.best_score_.load()}, best_score_arr);
+        branch_and_bound.best_score_ =
+            *min_element(best_score_arr.begin(), best_score_arr.end());
+      }
+    }
+
+    // in task order, so that the order does not depend on thread timing, and
+    // the shares of the processes follow each other in rank order
+    int best_score = branch_and_bound.best_score_;
+    vector<int> best_tree_arr;
+    for (int t = 0; t < num_local_tasks; t++) {
+      for (int i = 0; i < int(tree_arr[t].size()); i++) {
+        if (score_arr[t][i] == best_score) {
+          best_tree_arr.insert(best_tree_arr.end(), tree_arr[t][i].begin(),
+                               tree_arr[t][i].end());
+        }
+      }
+    }
+    if (exchange_.get() != nullptr) {
+      vector<int> all_best_tree_arr;
+      exchange_.get()->all_gather(best_tree_arr, all_best_tree_arr);
+      best_tree_arr.swap(all_best_tree_arr);
+    }
+    unrooted_undirectional_tree_queue_.clear();
+    for (int i = 0; i < int(best_tree_arr.size());
+         i += unrooted_undirectional_tree_len_) {
+      shared_ptr<int> tree = tree_pool_.get()->acquire();
+      copy(best_tree_arr.begin() + i,
+           best_tree_arr.begin() + i + unrooted_undirectional_tree_len_,
+           tree.get());
+      unrooted_undirectional_tree_queue_.push_back(tree);
+    }
+    min_large_parsimony_score_ =
+        best_score + site_patterns_.get()->uninformative_score_;
+  }
+
+  /**
+   * Split hash of a tree of unrooted_undirectional_tree_queue_, equal for
+   * the same topology in any search
+   *
+   * @param i : index of the tree in the queue
+   */
+  uint64_t get_tree_hash(int i) {
+    unique_ptr<int[]> rooted_directional_idx_arr(new int[num_nodes_ + 1]);
+    unique_ptr<int[]> rooted_directional_tree(
+        new int[rooted_directional_tree_len_]);
+    unique_ptr<int[]> rooted_postorder_arr(new int[rooted_postorder_arr_len_]);
+    make_tree_rooted_directional(
+        unrooted_undirectional_idx_arr_.get(),
+        unrooted_undirectional_tree_queue_[i].get(),
+        rooted_directional_idx_arr.get(), rooted_directional_tree.get(),
+        rooted_postorder_arr.get(), num_nodes_);
+    TopologyHash topology_hash(num_nodes_ + 1, num_leaves_);
+    return topology_hash.load_tree(rooted_directional_tree.get(),
+                                   rooted_directional_idx_arr.get(),
+                                   rooted_postorder_arr.get());
+  }
+
+  /**
+   * Ancestral strings of every tree in unrooted_undirectional_tree_queue_,
+   * the search itself only scores
+   *
+   * @param on_string_list : called with the index and the strings of each
+   * tree as soon as they are built, in queue order and from one thread at a
+   * time
+   */
+  void build_string_lists(
+      const function<void(int, shared_ptr<string>)>& on_string_list) {
+    int num_trees = unrooted_undirectional_tree_queue_.size();
+    if (unit_cost_ && block_fitch_arr_.size() > 1 && num_trees < num_threads_) {
+      // too few trees to go around, split each of them by sites instead
+      unique_ptr<int[]> rooted_directional_idx_arr(new int[num_nodes_ + 1]);
+      unique_ptr<int[]> rooted_directional_tree(
+          new int[rooted_directional_tree_len_]);
+      unique_ptr<int[]> rooted_postorder_arr(
+          new int[rooted_postorder_arr_len_]);
+      for (int i = 0; i < num_trees; i++) {
+        make_tree_rooted_directional(
+            unrooted_undirectional_idx_arr_.get(),
+            unrooted_undirectional_tree_queue_[i].get(),
+            rooted_directional_idx_arr.get(), rooted_directional_tree.get(),
+            rooted_postorder_arr.get(), num_nodes_);
+        shared_ptr<string> string_list = build_string_list_by_blocks(
+            rooted_directional_tree.get(), rooted_directional_idx_arr.get(),
+            rooted_postorder_arr.get());
+        on_string_list(i, string_list);
+      }
+      return;
+    }
 
-          shallow_copy_push_back<int>(
-              tmp_unrooted_undirectional_tree_queue_,
-              unrooted_undirectional_tree_global_arr.get()[i]);
-          shallow_copy_push_back<string>(tmp_string_list_queue_,
-                                         string_list_global_arr.get()[i]);
+    int i;
+    omp_set_num_threads(num_threads_);
+#pragma omp parallel private(i)
+    {
+      shared_ptr<uint64_t> cur_state_arr = shared_ptr<uint64_t>(
+          new uint64_t[fitch_parsimony_.get()->state_arr_len()],
+          [](uint64_t* p) { delete[] p; });
+      shared_ptr<int> cur_rooted_directional_idx_arr =
+          shared_ptr<int>(new int[num_nodes_ + 1], [](int* p) { delete[] p; });
+      shared_ptr<int> cur_rooted_directional_tree = shared_ptr<int>(
+          new int[rooted_directional_tree_len_], [](int* p) { delete[] p; });
+      shared_ptr<int> cur_rooted_postorder_arr = shared_ptr<int>(
+          new int[rooted_postorder_arr_len_], [](int* p) { delete[] p; });
+      // trees are handed on in order while later ones are still being built
+#pragma omp for ordered schedule(dynamic)
+      for (i = 0; i < num_trees; i++) {
+        make_tree_rooted_directional(
+            unrooted_undirectional_idx_arr_.get(),
+            unrooted_undirectional_tree_queue_[i].get(),
+            cur_rooted_directional_idx_arr.get(),
+            cur_rooted_directional_tree.get(), cur_rooted_postorder_arr.get(),
+            num_nodes_);
+        shared_ptr<string> string_list;
+        if (unit_cost_) {
+          fitch_parsimony_.get()->run_fitch_score(
+              cur_rooted_directional_tree.get(),
+              cur_rooted_directional_idx_arr.get(),
+              cur_rooted_postorder_arr.get(), cur_state_arr.get());
+          string_list = build_string_list(
+              cur_rooted_directional_tree.get(),
+              cur_rooted_directional_idx_arr.get(),
+              cur_rooted_postorder_arr.get(), cur_state_arr.get());
+        } else {
+          string_list = build_sankoff_string_list(
+              cur_rooted_directional_tree.get(),
+              cur_rooted_directional_idx_arr.get(),
+              cur_rooted_postorder_arr.get());
         }
+#pragma omp ordered
+        on_string_list(i, string_list);
       }
     }
   }
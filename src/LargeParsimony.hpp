@@ -11,11 +11,27 @@
 
 #include <stdio.h>
 #include <deque>
+#include <functional>
 #include <memory>
+#include <queue>
+#include <random>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
-#include "SmallParsimony.hpp"
+#include <vector>
+#include "ArrayPool.hpp"
+#include "BranchAndBound.hpp"
+#include "FitchParsimony.hpp"
+#include "FitchSpr.hpp"
+#include "FitchTbr.hpp"
+#include "ParallelTempering.hpp"
+#include "FitchUpDown.hpp"
+#include "IncrementalFitch.hpp"
+#include "SankoffParsimony.hpp"
+#include "SankoffUpDown.hpp"
+#include "SearchCheckpoint.hpp"
+#include "SitePatterns.hpp"
+#include "TopologyTable.hpp"
 #endif /* LargeParsimony_hpp */
 using namespace std;
 
@@ -33,13 +49,51 @@ public:
   shared_ptr<int> unrooted_undirectional_tree_;
   // n nodes, never change!!!
   shared_ptr<int> unrooted_undirectional_idx_arr_;
-  // (str_len)*(N + 1), never change!!!
+  // unique alignment columns and their weights, never change!!!
+  shared_ptr<SitePatterns> site_patterns_;
+  // (num_patterns)*(N + 1), never change!!!
   shared_ptr<char> rooted_char_list_;
+  // bit-packed leaves of rooted_char_list_, scores every candidate tree
+  shared_ptr<FitchParsimony> fitch_parsimony_;
+  // Fitch sets of the tree whose neighbors are being scored, every
+  // interchange is tried on it and rolled back
+  shared_ptr<IncrementalFitch> incremental_fitch_;
+  // split hashes of the same tree, give the hash of every neighbor in O(1)
+  shared_ptr<TopologyHash> topology_hash_;
+  // every topology scored so far, a known one is never scored again
+  shared_ptr<TopologyTable> topology_table_;
+  // farthest regraft of a pruned subtree in edges, 0 to search by nearest
+  // neighbor interchanges instead
+  int spr_radius_;
+  // farthest reconnection from a cut edge in edges, searches by tree
+  // bisection-reconnection when not 0 and takes over from spr_radius_
+  int tbr_radius_;
+  // Fitch sets of both sides of every edge of the tree whose regrafts or
+  // reconnections are being scored, only with spr_radius_ or tbr_radius_
+  shared_ptr<FitchUpDown> fitch_up_down_;
+  shared_ptr<FitchSpr> fitch_spr_;
+  shared_ptr<FitchTbr> fitch_tbr_;
+  // proposals of every tempering chain, 0 to walk the plateau only
+  int tempering_steps_ = 0;
+  int tempering_chains_ = 0;
+  double tempering_temperature_ = 0;
+  uint32_t tempering_seed_ = 0;
+  // the chains offer to swap temperatures after this many proposals each
+  static const int tempering_swap_steps_ = 64;
+  // Sankoff cost of changing char i to j at cost_arr_[4 * i + j]
+  int cost_arr_[16];
+  // scores trees instead of fitch_parsimony_ unless every change costs 1,
+  // none then
+  shared_ptr<SankoffParsimony> sankoff_parsimony_;
+  // its scratch, sankoff_parsimony_->state_arr_len()
+  shared_ptr<uint16_t> sankoff_state_arr_;
+  // scores the interchanges instead of incremental_fitch_, with its scratch
+  shared_ptr<SankoffUpDown> sankoff_up_down_;
+  shared_ptr<uint16_t> sankoff_scratch_;
 
   // for final result
   int min_large_parsimony_score_;
   deque<shared_ptr<int>> unrooted_undirectional_tree_queue_;
-  deque<shared_ptr<string>> string_list_queue_;
 
   // for internal use
   // must have a copy of
@@ -49,25 +103,34 @@ public:
   shared_ptr<int> rooted_directional_tree_;
   // (n+1) nodes
   shared_ptr<int> rooted_directional_idx_arr_;
-  // (n+1) * (str_len) nodes
-  shared_ptr<char> cur_rooted_char_list_;
+  // (n+1-leaves) internal nodes, children before parents, root last
+  shared_ptr<int> rooted_postorder_arr_;
+  // Fitch sets of the candidate tree, fitch_parsimony_->state_arr_len()
+  shared_ptr<uint64_t> cur_state_arr_;
   // for get_edges_from_unrooted_undirectional_tree() use
   shared_ptr<int> edges_;
   // for get_edges_from_unrooted_undirectional_tree use
   shared_ptr<bool> visited_;
   deque<shared_ptr<int>> tmp_unrooted_undirectional_tree_queue_;
-  deque<shared_ptr<string>> tmp_string_list_queue_;
+  // every queued tree comes from here and returns here once dropped
+  shared_ptr<ArrayPool<int>> tree_pool_;
+  // saves the search now and then and resumes it, none by default
+  shared_ptr<SearchCheckpoint> checkpoint_;
 
   LargeParsimony(shared_ptr<int> unrooted_undirectional_tree,
                  shared_ptr<int> unrooted_undirectional_idx_arr,
-                 shared_ptr<char> rooted_char_list, int num_nodes,
-                 int num_leaves, int num_char_trees)
-      : num_char_trees_{num_char_trees}, num_nodes_{num_nodes},
+                 shared_ptr<SitePatterns> site_patterns, int num_nodes,
+                 int num_leaves)
+      : num_char_trees_{site_patterns.get()->num_patterns_},
+        num_nodes_{num_nodes},
         num_leaves_{num_leaves}, num_edges_{num_nodes - num_leaves - 1},
         unrooted_undirectional_tree_len_{(num_nodes - 1) * 2},
         unrooted_undirectional_tree_{unrooted_undirectional_tree},
         unrooted_undirectional_idx_arr_{unrooted_undirectional_idx_arr},
-        rooted_char_list_{rooted_char_list},
+        site_patterns_{site_patterns},
+        rooted_char_list_{site_patterns.get()->char_list_},
+        spr_radius_{0},
+        tbr_radius_{0},
         min_large_parsimony_score_{int(1e8)} {
 
     cur_unrooted_undirectional_tree_ = shared_ptr<int>(
@@ -81,19 +144,28 @@ public:
         new int[(num_nodes + 1 - num_leaves) * 2], [](int *p) { delete[] p; });
     rooted_directional_idx_arr_ =
         shared_ptr<int>(new int[num_nodes + 1], [](int *p) { delete[] p; });
-    int rooted_char_list_len = (num_nodes + 1) * num_char_trees;
-    // need to get the char list copy below
-    cur_rooted_char_list_ = shared_ptr<char>(new char[rooted_char_list_len],
-                                             [](char *p) { delete[] p; });
-    for (int i = 0; i < rooted_char_list_len; i++) {
-      cur_rooted_char_list_.get()[i] = rooted_char_list_.get()[i];
-    }
+    rooted_postorder_arr_ = shared_ptr<int>(
+        new int[num_nodes + 1 - num_leaves], [](int *p) { delete[] p; });
+    fitch_parsimony_ = make_shared<FitchParsimony>(
+        rooted_char_list_.get(), site_patterns_.get()->weight_arr_.get(),
+        num_char_trees_, num_nodes + 1, num_leaves);
+    cur_state_arr_ = shared_ptr<uint64_t>(
+        new uint64_t[fitch_parsimony_.get()->state_arr_len()],
+        [](uint64_t *p) { delete[] p; });
+    incremental_fitch_ = make_shared<IncrementalFitch>(fitch_parsimony_);
+    topology_hash_ = make_shared<TopologyHash>(num_nodes + 1, num_leaves);
+    topology_table_ = make_shared<TopologyTable>();
+    tree_pool_ =
+        make_shared<ArrayPool<int>>(unrooted_undirectional_tree_len_);
     // below for get_edges_from_unrooted_undirectional_tree() use
 
     edges_ =
         shared_ptr<int>(new int[num_edges_ * 2], [](int *p) { delete[] p; });
     visited_ =
         shared_ptr<bool>(new bool[num_nodes_], [](bool *p) { delete[] p; });
+    for (int i = 0; i < 16; i++) {
+      cost_arr_[i] = int(i / 4 != i % 4);
+    }
   }
 
   ~LargeParsimony() = default;
@@ -129,9 +201,60 @@ public:
     cur_unrooted_undirectional_tree_.get()[idx_b_child] = a;
   }
 
+  /*
+      move the subtree that hangs from s at p onto the edge (x, y) of
+      cur_unrooted_undirectional_tree_: the other two neighbors of p are
+      joined, and p goes between x and y
+   */
+  void subtree_prune_regraft(int p, int s, int x, int y) {
+    int *tree = cur_unrooted_undirectional_tree_.get();
+    int idx_p = unrooted_undirectional_idx_arr_.get()[p];
+    int q = -1;
+    int r = -1;
+    for (int k = idx_p; k < idx_p + 3; k++) {
+      if (tree[k] != s) {
+        (q == -1 ? q : r) = tree[k];
+      }
+    }
+    replace_neighbor(q, p, r);
+    replace_neighbor(r, p, q);
+    replace_neighbor(x, y, p);
+    replace_neighbor(y, x, p);
+    replace_neighbor(p, q, x);
+    replace_neighbor(p, r, y);
+  }
+
+  /*
+      cut the edge (a, b) of cur_unrooted_undirectional_tree_ and reconnect
+      the halves by putting a on the edge (xa, ya) and b on (xb, yb), xa or
+      xb -1 for a half that stays as it was
+   */
+  void tree_bisection_reconnection(int a, int b, int xa, int ya, int xb,
+                                   int yb) {
+    // each half is a regraft of the other one
+    if (xa != -1) {
+      subtree_prune_regraft(a, b, xa, ya);
+    }
+    if (xb != -1) {
+      subtree_prune_regraft(b, a, xb, yb);
+    }
+  }
+
+  // in cur_unrooted_undirectional_tree_, make new_neighbor a neighbor of node
+  // in place of old_neighbor
+  void replace_neighbor(int node, int old_neighbor, int new_neighbor) {
+    int *tree = cur_unrooted_undirectional_tree_.get();
+    int idx = unrooted_undirectional_idx_arr_.get()[node];
+    while (tree[idx] != old_neighbor) {
+      idx++;
+    }
+    tree[idx] = new_neighbor;
+  }
+
   // make the unrooted & undirectional tree rooted & directional
   // call this function every time before small parsimony to generate input for
-  // it
+  // it. The BFS order, reversed, is written to rooted_postorder_arr_ so that
+  // every site of the tree can walk the nodes without searching for them.
   void make_tree_rooted_directional() {
     // a deep copy for rooted_char_list (we want to keep a clean original copy
     // of this) unrooted_undirectional_tree to rooted_directional_tree
@@ -140,8 +263,10 @@ public:
     auto tmp_neighbor_arr = cur_unrooted_undirectional_tree_.get();
     auto tmp_directed_idx = rooted_directional_idx_arr_.get();
     auto tmp_children_arr = rooted_directional_tree_.get();
+    auto tmp_postorder_arr = rooted_postorder_arr_.get();
 
     int root = num_nodes_;
+    int next_postorder = num_nodes_ - num_leaves_;
     int left = num_nodes_ - 1;
     int right = tmp_neighbor_arr[tmp_undirected_idx[left]];
     int next_children = 0;
@@ -151,6 +276,7 @@ public:
     }
 
     auto temp_start = next_children;
+    tmp_postorder_arr[next_postorder--] = root;
     tmp_directed_idx[root] = temp_start;
     tmp_children_arr[temp_start++] = left;
     tmp_children_arr[temp_start++] = right;
@@ -172,6 +298,7 @@ public:
         continue;
       }
 
+      tmp_postorder_arr[next_postorder--] = cur_node;
       auto undirected_start_pos = tmp_undirected_idx[cur_node];
       auto directed_start_pos = next_children;
       tmp_directed_idx[cur_node] = directed_start_pos;
@@ -187,6 +314,18 @@ public:
     }
   }
 
+  // the neighbor of internal node a that is neither x nor y
+  int get_third_neighbor(int a, int x, int y) {
+    int idx_a = unrooted_undirectional_idx_arr_.get()[a];
+    for (int k = idx_a; k < idx_a + 3; k++) {
+      int neighbor = unrooted_undirectional_tree_.get()[k];
+      if (neighbor != x && neighbor != y) {
+        return neighbor;
+      }
+    }
+    return -1;
+  }
+
   // return edges array containing only the internal edges denoted as (a, b) for
   // the internal exchange for unrooted & undirectional tree
   shared_ptr<int> get_edges_from_unrooted_undirectional_tree() {
@@ -211,137 +350,670 @@ public:
     return edges_;
   }
 
-  // creat a deep copy of shared_ptr array and add the ptr to deque
-  template <class T>
-  void deep_copy_push_back(deque<shared_ptr<T>> &queue, shared_ptr<T> array,
-                           int num) {
-    // first make a deep copy of array
-    shared_ptr<T> array_copy =
-        shared_ptr<T>(new T[num], [](T *p) { delete[] p; });
-    for (int i = 0; i < num; i++) {
-      array_copy.get()[i] = array.get()[i];
-    }
-    queue.push_back(array_copy);
+  // string list of the tree last scored into cur_state_arr_, or of the
+  // tree in rooted_directional_tree_ under a step matrix
+  shared_ptr<string> get_cur_string_list() {
+    unique_ptr<string[]> pattern_string_list(new string[num_nodes_]);
+    if (sankoff_parsimony_.get() != nullptr) {
+      sankoff_parsimony_.get()->run_sankoff_ancestral(
+          rooted_directional_tree_.get(), rooted_directional_idx_arr_.get(),
+          rooted_postorder_arr_.get(), sankoff_state_arr_.get(),
+          pattern_string_list.get());
+    } else {
+      fitch_parsimony_.get()->run_fitch_ancestral(
+          rooted_directional_tree_.get(), rooted_directional_idx_arr_.get(),
+          rooted_postorder_arr_.get(), cur_state_arr_.get(),
+          pattern_string_list.get());
+    }
+    shared_ptr<string> string_list = shared_ptr<string>(
+        new string[num_nodes_], [](string *p) { delete[] p; });
+    site_patterns_.get()->expand_string_list(pattern_string_list.get(),
+                                             string_list.get(), num_nodes_);
+    return string_list;
+  }
+
+  /**
+   * Split hash of a tree of unrooted_undirectional_tree_queue_, equal for
+   * the same topology in any search
+   *
+   * @param i : index of the tree in the queue
+   */
+  uint64_t get_tree_hash(int i) {
+    for (int k = 0; k < unrooted_undirectional_tree_len_; k++) {
+      cur_unrooted_undirectional_tree_.get()[k] =
+          unrooted_undirectional_tree_queue_[i].get()[k];
+    }
+    make_tree_rooted_directional();
+    return topology_hash_.get()->load_tree(rooted_directional_tree_.get(),
+                                           rooted_directional_idx_arr_.get(),
+                                           rooted_postorder_arr_.get());
+  }
+
+  /**
+   * Ancestral strings of every tree in unrooted_undirectional_tree_queue_,
+   * the search itself only scores
+   *
+   * @param on_string_list : called with the index and the strings of each
+   * tree as soon as they are built, in queue order
+   */
+  void build_string_lists(
+      const function<void(int, shared_ptr<string>)> &on_string_list) {
+    int num_trees = unrooted_undirectional_tree_queue_.size();
+    for (int t = 0; t < num_trees; t++) {
+      int *tree = unrooted_undirectional_tree_queue_[t].get();
+      for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+        cur_unrooted_undirectional_tree_.get()[i] = tree[i];
+      }
+      make_tree_rooted_directional();
+      if (sankoff_parsimony_.get() == nullptr) {
+        fitch_parsimony_.get()->run_fitch_score(
+            rooted_directional_tree_.get(), rooted_directional_idx_arr_.get(),
+            rooted_postorder_arr_.get(), cur_state_arr_.get());
+      }
+      on_string_list(t, get_cur_string_list());
+    }
+  }
+
+  /**
+   * Set the Sankoff cost of every char change. Any other than unit cost is
+   * searched by nearest neighbor interchanges only. Call before
+   * run_large_parsimony().
+   *
+   * @param cost_arr : length 16, cost_arr[4 * i + j] is the cost of i -> j
+   * with A, C, G, T as 0 ... 3, see SankoffParsimony::fits()
+   */
+  void set_cost_matrix(const int *cost_arr) {
+    for (int i = 0; i < 16; i++) {
+      cost_arr_[i] = cost_arr[i];
+    }
+    sankoff_parsimony_.reset();
+    sankoff_up_down_.reset();
+    if (!SankoffParsimony::is_unit_cost(cost_arr_)) {
+      sankoff_parsimony_ = make_shared<SankoffParsimony>(
+          rooted_char_list_.get(), site_patterns_.get()->weight_arr_.get(),
+          num_char_trees_, num_nodes_ + 1, num_leaves_, cost_arr_);
+      sankoff_state_arr_ = shared_ptr<uint16_t>(
+          new uint16_t[sankoff_parsimony_.get()->state_arr_len()],
+          [](uint16_t *p) { delete[] p; });
+      sankoff_up_down_ = make_shared<SankoffUpDown>(sankoff_parsimony_);
+      sankoff_scratch_ = shared_ptr<uint16_t>(
+          new uint16_t[sankoff_up_down_.get()->scratch_len()],
+          [](uint16_t *p) { delete[] p; });
+    }
   }
+
+  /**
+   * Search by subtree prune-and-regraft instead of nearest neighbor
+   * interchange. Call before run_large_parsimony().
+   *
+   * @param radius : farthest regraft from the pruned node in edges, 1 gives
+   * the nearest neighbor interchanges
+   */
+  void set_spr_radius(int radius) {
+    spr_radius_ = radius;
+    fitch_up_down_ = make_shared<FitchUpDown>(fitch_parsimony_);
+    fitch_spr_ = make_shared<FitchSpr>(fitch_parsimony_, radius);
+  }
+
+  /**
+   * Search by tree bisection-reconnection instead of nearest neighbor
+   * interchange or subtree prune-and-regraft. Call before
+   * run_large_parsimony().
+   *
+   * @param radius : farthest reconnection from the cut edge in edges, on
+   * either side
+   */
+  void set_tbr_radius(int radius) {
+    tbr_radius_ = radius;
+    fitch_up_down_ = make_shared<FitchUpDown>(fitch_parsimony_);
+    fitch_tbr_ = make_shared<FitchTbr>(fitch_parsimony_, radius);
+  }
+
+  /**
+   * Walk parallel tempering chains from the input tree before the plateau
+   * walk, which then starts from the best trees they have been on. The
+   * chains propose regrafts within spr_radius_, nearest neighbor
+   * interchanges without it. Call before run_large_parsimony().
+   *
+   * @param num_steps : proposals of each chain
+   * @param num_chains : number of chains
+   * @param max_temperature : temperature of the hottest chain, the coldest
+   * one runs at a sixteenth of it
+   * @param seed : the chain i walks with seed + i
+   */
+  void set_tempering(int num_steps, int num_chains, double max_temperature,
+                     uint32_t seed) {
+    tempering_steps_ = num_steps;
+    tempering_chains_ = num_chains;
+    tempering_temperature_ = max_temperature;
+    tempering_seed_ = seed;
+  }
+
+  /**
+   * Save the search from time to time, and resume it if the checkpoint
+   * exists. Call before run_large_parsimony().
+   */
+  void set_checkpoint(shared_ptr<SearchCheckpoint> checkpoint) {
+    checkpoint_ = checkpoint;
+  }
+
+  // restore the search from checkpoint_, false if it starts from the input
+  // tree
+  bool load_checkpoint(int &round, int &new_score, int &next_tree) {
+    if (checkpoint_.get() == nullptr) {
+      return false;
+    }
+    SearchState state;
+    bool loaded = checkpoint_.get()->load(state, *tree_pool_.get());
+    if (loaded) {
+      round = state.round;
+      new_score = state.new_score;
+      next_tree = state.next_tree;
+      min_large_parsimony_score_ = state.min_large_parsimony_score;
+      unrooted_undirectional_tree_queue_ = state.plateau_queue;
+      tmp_unrooted_undirectional_tree_queue_ = state.tmp_queue;
+      int first_round;
+      for (auto &entry : state.topology_arr) {
+        topology_table_.get()->insert(entry.first, entry.second, first_round);
+      }
+    }
+    // from here on every new topology goes to the next checkpoint as well
+    topology_table_.get()->set_journal(true);
+    return loaded;
+  }
+
+  // hand the search state to checkpoint_, which writes it in the background
+  void save_checkpoint(int round, int new_score, int next_tree) {
+    SearchState state;
+    state.round = round;
+    state.new_score = new_score;
+    state.min_large_parsimony_score = min_large_parsimony_score_;
+    state.next_tree = next_tree;
+    state.plateau_queue = unrooted_undirectional_tree_queue_;
+    state.tmp_queue = tmp_unrooted_undirectional_tree_queue_;
+    topology_table_.get()->drain_journal(state.topology_arr);
+    checkpoint_.get()->save(state);
+  }
+
+  // creat a copy of a tree in a pooled array and add the ptr to deque
+  void pooled_copy_push_back(deque<shared_ptr<int>> &queue,
+                             shared_ptr<int> tree) {
+    shared_ptr<int> tree_copy = tree_pool_.get()->acquire();
+    for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+      tree_copy.get()[i] = tree.get()[i];
+    }
+    queue.push_back(tree_copy);
+  }
+
+  /**
+   * Keep every nearest neighbor interchange of the plateau tree
+   * unrooted_undirectional_tree_ that scores at most new_score
+   *
+   * @param round : the search round, for the topology table
+   * @param new_score : lowered when an interchange scores less, the trees
+   * kept so far are dropped then
+   */
+  void search_nearest_neighbor_interchages(int round, int &new_score) {
+    int first_round;
+    // get all edges for unrooted_undirectional_tree_
+    // write to edges_ visited_
+    shared_ptr<int> edges = get_edges_from_unrooted_undirectional_tree();
+    // load the tree once, each interchange below only rescores the nodes
+    // above the two exchanged subtrees
+    for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+      cur_unrooted_undirectional_tree_.get()[i] =
+          unrooted_undirectional_tree_.get()[i];
+    }
+    make_tree_rooted_directional();
+    if (sankoff_up_down_.get() != nullptr) {
+      sankoff_up_down_.get()->load_tree(rooted_directional_tree_.get(),
+                                        rooted_directional_idx_arr_.get(),
+                                        rooted_postorder_arr_.get());
+    } else {
+      incremental_fitch_.get()->load_tree(rooted_directional_tree_.get(),
+                                          rooted_directional_idx_arr_.get(),
+                                          rooted_postorder_arr_.get());
+    }
+    topology_hash_.get()->load_tree(rooted_directional_tree_.get(),
+                                    rooted_directional_idx_arr_.get(),
+                                    rooted_postorder_arr_.get());
+    // For each edge, exchange the internal edges to get 2 new trees
+    int length = num_edges_ * 2;
+    for (int i = 0; i < length; i += 2) {
+      int a = edges.get()[i];
+      int b = edges.get()[i + 1];
+      int a_child_idx = unrooted_undirectional_idx_arr_.get()[a];
+      int a_child = unrooted_undirectional_tree_.get()[a_child_idx];
+      a_child = a_child == b
+                    ? unrooted_undirectional_tree_.get()[a_child_idx + 1]
+                    : a_child;
+      int b_child_idx = unrooted_undirectional_idx_arr_.get()[b];
+      int b_child = -1;
+      // exchange b's j_th child in unrooted & undirectional tree
+      for (int j = 0; j < 2; j++) {
+        if (j) {
+          for (int k = 2; k >= 0; k--) {
+            b_child = unrooted_undirectional_tree_.get()[b_child_idx + k];
+            if (b_child != a)
+              break;
+          }
+        } else {
+          for (int k = 0; k < 3; k++) {
+            b_child = unrooted_undirectional_tree_.get()[b_child_idx + k];
+            if (b_child != a)
+              break;
+          }
+        }
+        // a topology seen before, in this round or an earlier one, is
+        // either queued already or cannot beat new_score
+        int a_other = get_third_neighbor(a, b, a_child);
+        int b_other = get_third_neighbor(b, a, b_child);
+        uint64_t tree_hash =
+            topology_hash_.get()->nearest_neighbor_interchage_hash(
+                a, b, a_child, b_child, a_other, b_other);
+        if (!topology_table_.get()->insert(tree_hash, round, first_round)) {
+          continue;
+        }
+        int score;
+        if (sankoff_up_down_.get() != nullptr) {
+          score = sankoff_up_down_.get()->score_nearest_neighbor_interchage(
+              a, b, a_child, b_child, a_other, b_other,
+              sankoff_scratch_.get());
+        } else {
+          score = incremental_fitch_.get()->try_nearest_neighbor_interchage(
+              a, b, a_child, b_child);
+          incremental_fitch_.get()->rollback();
+        }
+        // record the minmal one
+        if (score <= new_score) {
+          if (score < new_score) {
+            // first clear tmp list
+            tmp_unrooted_undirectional_tree_queue_.clear();
+            new_score = score;
+          }
+
+          // only the kept trees are built
+          for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+            cur_unrooted_undirectional_tree_.get()[i] =
+                unrooted_undirectional_tree_.get()[i];
+          }
+          nearest_neighbor_interchage(a, b, a_child, b_child);
+          pooled_copy_push_back(tmp_unrooted_undirectional_tree_queue_,
+                                cur_unrooted_undirectional_tree_);
+        }
+      }
+    }
+  }
+
+  /**
+   * Keep every subtree prune-and-regraft of the plateau tree
+   * unrooted_undirectional_tree_ within spr_radius_ that scores at most
+   * new_score. Every subtree is pruned in turn, both sides of every edge.
+   *
+   * @param round : the search round, for the topology table
+   * @param new_score : lowered when a regraft scores less, the trees kept so
+   * far are dropped then
+   */
+  void search_regrafts(int round, int &new_score) {
+    int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    int *tree = unrooted_undirectional_tree_.get();
+    for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+      cur_unrooted_undirectional_tree_.get()[i] = tree[i];
+    }
+    make_tree_rooted_directional();
+    fitch_up_down_.get()->load_tree(rooted_directional_tree_.get(),
+                                    rooted_directional_idx_arr_.get(),
+                                    rooted_postorder_arr_.get());
+    topology_hash_.get()->load_tree(rooted_directional_tree_.get(),
+                                    rooted_directional_idx_arr_.get(),
+                                    rooted_postorder_arr_.get());
+    int first_round;
+    for (int p = num_leaves_; p < num_nodes_; p++) {
+      for (int j = 0; j < 3; j++) {
+        int s = tree[idx_arr[p] + j];
+        fitch_spr_.get()->for_each_regraft(
+            *fitch_up_down_.get(), *topology_hash_.get(), idx_arr, tree, p, s,
+            [&](int x, int y, uint64_t tree_hash) {
+              // seen before, either queued already or cannot beat new_score
+              if (!topology_table_.get()->insert(tree_hash, round,
+                                                 first_round)) {
+                return;
+              }
+              int score = fitch_spr_.get()->regraft_score();
+              if (score <= new_score) {
+                if (score < new_score) {
+                  tmp_unrooted_undirectional_tree_queue_.clear();
+                  new_score = score;
+                }
+                // only the kept trees are built
+                for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+                  cur_unrooted_undirectional_tree_.get()[i] = tree[i];
+                }
+                subtree_prune_regraft(p, s, x, y);
+                pooled_copy_push_back(tmp_unrooted_undirectional_tree_queue_,
+                                      cur_unrooted_undirectional_tree_);
+              }
+            });
+      }
+    }
+  }
+
+  /**
+   * Keep every tree bisection-reconnection of the plateau tree
+   * unrooted_undirectional_tree_ within tbr_radius_ that scores at most
+   * new_score. Every edge is cut in turn, and the reconnections that cannot
+   * reach new_score are dropped before their topology is looked up.
+   *
+   * @param round : the search round, for the topology table
+   * @param new_score : lowered when a reconnection scores less, the trees
+   * kept so far are dropped then
+   */
+  void search_reconnections(int round, int &new_score) {
+    int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    int *tree = unrooted_undirectional_tree_.get();
+    for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+      cur_unrooted_undirectional_tree_.get()[i] = tree[i];
+    }
+    make_tree_rooted_directional();
+    fitch_up_down_.get()->load_tree(rooted_directional_tree_.get(),
+                                    rooted_directional_idx_arr_.get(),
+                                    rooted_postorder_arr_.get());
+    topology_hash_.get()->load_tree(rooted_directional_tree_.get(),
+                                    rooted_directional_idx_arr_.get(),
+                                    rooted_postorder_arr_.get());
+    int first_round;
+    for (int a = num_leaves_; a < num_nodes_; a++) {
+      for (int j = 0; j < 3; j++) {
+        // every edge once, from its internal end with the lower number
+        int b = tree[idx_arr[a] + j];
+        if (b >= num_leaves_ && b < a) {
+          continue;
+        }
+        fitch_tbr_.get()->for_each_reconnection(
+            *fitch_up_down_.get(), *topology_hash_.get(), idx_arr, tree, a, b,
+            new_score,
+            [&](int xa, int ya, int xb, int yb, uint64_t tree_hash,
+                int score) {
+              if (!topology_table_.get()->insert(tree_hash, round,
+                                                 first_round)) {
+                return;
+              }
+              if (score < new_score) {
+                tmp_unrooted_undirectional_tree_queue_.clear();
+                new_score = score;
+              }
+              for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+                cur_unrooted_undirectional_tree_.get()[i] = tree[i];
+              }
+              tree_bisection_reconnection(a, b, xa, ya, xb, yb);
+              pooled_copy_push_back(tmp_unrooted_undirectional_tree_queue_,
+                                    cur_unrooted_undirectional_tree_);
+            });
+      }
+    }
+  }
+
+  /**
+   * Run the tempering chains from the input tree, and put the best trees
+   * they have been on into tmp_unrooted_undirectional_tree_queue_
+   *
+   * @param round : the search round, for the topology table
+   * @param new_score : output, the score of those trees
+   */
+  void run_tempering(int round, int& new_score) {
+    TemperingCollector collector;
+    vector<unique_ptr<TemperingChain>> chain_arr(tempering_chains_);
+    vector<TemperingChain *> chain_ptr_arr(tempering_chains_);
+    for (int i = 0; i < tempering_chains_; i++) {
+      chain_arr[i].reset(new TemperingChain(fitch_parsimony_,
+                                            unrooted_undirectional_idx_arr_,
+                                            max(1, spr_radius_),
+                                            tempering_seed_ + i));
+      chain_ptr_arr[i] = chain_arr[i].get();
+      // geometric from the hottest chain down to the coldest
+      chain_arr[i].get()->temperature_ =
+          tempering_temperature_ *
+          pow(1.0 / 16, tempering_chains_ > 1
+                            ? double(i) / (tempering_chains_ - 1)
+                            : 0.0);
+      chain_arr[i].get()->load(unrooted_undirectional_tree_.get());
+      collector.offer(*chain_arr[i].get());
+    }
+
+    // the chains walk on their own between two rounds of swaps
+    mt19937 swap_generator(tempering_seed_);
+    for (int step = 0; step < tempering_steps_;
+         step += tempering_swap_steps_) {
+      int num_steps = tempering_steps_ - step;
+      if (num_steps > tempering_swap_steps_) {
+        num_steps = tempering_swap_steps_;
+      }
+      for (int i = 0; i < tempering_chains_; i++) {
+        TemperingChain *chain = chain_arr[i].get();
+        for (int k = 0; k < num_steps; k++) {
+          if (chain->step()) {
+            collector.offer(*chain);
+          }
+        }
+      }
+      TemperingChain::swap_temperatures(chain_ptr_arr, swap_generator);
+    }
+
+    vector<vector<int>> tree_arr;
+    vector<uint64_t> hash_arr;
+    collector.get_trees(tree_arr, hash_arr);
+    new_score = collector.best_score_;
+    tmp_unrooted_undirectional_tree_queue_.clear();
+    for (auto &tree : tree_arr) {
+      for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+        cur_unrooted_undirectional_tree_.get()[i] = tree[i];
+      }
+      pooled_copy_push_back(tmp_unrooted_undirectional_tree_queue_,
+                            cur_unrooted_undirectional_tree_);
+    }
+    int first_round;
+    for (uint64_t tree_hash : hash_arr) {
+      topology_table_.get()->insert(tree_hash, round, first_round);
+    }
+  }
+
   // Main entrance function
   void run_large_parsimony() {
     /*
      * input is undirected & unrooted tree; string list
-     * each time run a SmallParsimony, we got a directional&rooted array as well
+     * each time a tree is scored, we got a directional&rooted array as well
      * as a string list denoted the string for each node. Keep recording the
      * minumum one.
      */
 
-    // write to rooted_directional_tree_ and
-    // rooted_directional_idx_arr_
-    make_tree_rooted_directional();
-    // run small parsimony first
-    shared_ptr<SmallParsimony> small_parsimony = make_shared<SmallParsimony>(
-        rooted_directional_idx_arr_, rooted_directional_tree_,
-        cur_rooted_char_list_, num_char_trees_, num_nodes_ + 1);
-    small_parsimony.get()->run_small_parsimony_string();
-    // initialization
-    int new_score = small_parsimony.get()->total_score_;
-
-    // initialize deque. Noted that (new_score/new_string_list) are always the
-    // minimal (score/string_list) in the
-    // tmp_unrooted_undirectional_tree_queue_
-    deep_copy_push_back<int>(tmp_unrooted_undirectional_tree_queue_,
-                             unrooted_undirectional_tree_,
-                             unrooted_undirectional_tree_len_);
-    deep_copy_push_back<string>(tmp_string_list_queue_,
-                                small_parsimony.get()->string_list_,
-                                num_nodes_);
-    while (!tmp_unrooted_undirectional_tree_queue_.empty()) {
+    int new_score;
+    int round = 0;
+    int first_round = 0;
+    // the plateau trees before next_tree are searched already
+    int next_tree = 0;
+    if (!load_checkpoint(round, new_score, next_tree)) {
+      // write to rooted_directional_tree_ and
+      // rooted_directional_idx_arr_
+      make_tree_rooted_directional();
+      // run small parsimony first
+      if (sankoff_parsimony_.get() != nullptr) {
+        new_score = sankoff_parsimony_.get()->run_sankoff_score(
+            rooted_directional_tree_.get(), rooted_directional_idx_arr_.get(),
+            rooted_postorder_arr_.get(), sankoff_state_arr_.get());
+      } else {
+        new_score = fitch_parsimony_.get()->run_fitch_score(
+            rooted_directional_tree_.get(), rooted_directional_idx_arr_.get(),
+            rooted_postorder_arr_.get(), cur_state_arr_.get());
+      }
+      topology_table_.get()->insert(
+          topology_hash_.get()->load_tree(rooted_directional_tree_.get(),
+                                          rooted_directional_idx_arr_.get(),
+                                          rooted_postorder_arr_.get()),
+          round, first_round);
+
+      // initialize deque. Noted that new_score is always the minimal score
+      // in the tmp_unrooted_undirectional_tree_queue_, strings are only
+      // built afterwards by build_string_lists()
+      pooled_copy_push_back(tmp_unrooted_undirectional_tree_queue_,
+                            unrooted_undirectional_tree_);
+      if (tempering_steps_ > 0) {
+        run_tempering(round, new_score);
+      }
+    }
+    while (true) {
+      int num_trees = unrooted_undirectional_tree_queue_.size();
+      for (int t = next_tree; t < num_trees; t++) {
+        unrooted_undirectional_tree_ = unrooted_undirectional_tree_queue_[t];
+        if (tbr_radius_ > 0) {
+          search_reconnections(round, new_score);
+        } else if (spr_radius_ > 0) {
+          search_regrafts(round, new_score);
+        } else {
+          search_nearest_neighbor_interchages(round, new_score);
+        }
+        if (checkpoint_.get() != nullptr && checkpoint_.get()->due()) {
+          save_checkpoint(round, new_score, t + 1);
+        }
+      }
+      if (tmp_unrooted_undirectional_tree_queue_.empty()) {
+        break;
+      }
 
       // record tmp list to final list
       unrooted_undirectional_tree_queue_ =
           tmp_unrooted_undirectional_tree_queue_;
-      string_list_queue_ = tmp_string_list_queue_;
 
       // clear up tmp list
       tmp_unrooted_undirectional_tree_queue_ = deque<shared_ptr<int>>();
-      tmp_string_list_queue_ = deque<shared_ptr<string>>();
 
       // should use new_score -1 is for comparation (here compatible with
       // weichen's code)
-      min_large_parsimony_score_ = new_score--;
-
-      auto tree_i_ptr = unrooted_undirectional_tree_queue_.begin();
-      auto tree_end = unrooted_undirectional_tree_queue_.end();
-      auto string_i_ptr = string_list_queue_.begin();
-
-      for (; tree_i_ptr != tree_end; ++tree_i_ptr, ++string_i_ptr) {
-        unrooted_undirectional_tree_ = *tree_i_ptr;
-        // get all edges for unrooted_undirectional_tree_
-        // write to edges_ visited_
-        shared_ptr<int> edges = get_edges_from_unrooted_undirectional_tree();
-        // For each edge, exchange the internal edges to get 2 new trees
-        int length = num_edges_ * 2;
-        for (int i = 0; i < length; i += 2) {
-          int a = edges.get()[i];
-          int b = edges.get()[i + 1];
-          int a_child_idx = unrooted_undirectional_idx_arr_.get()[a];
-          int a_child = unrooted_undirectional_tree_.get()[a_child_idx];
-          a_child = a_child == b
-                        ? unrooted_undirectional_tree_.get()[a_child_idx + 1]
-                        : a_child;
-          int b_child_idx = unrooted_undirectional_idx_arr_.get()[b];
-          int b_child = -1;
-          // exchange b's j_th child in unrooted & undirectional tree
-          for (int j = 0; j < 2; j++) {
-            if (j) {
-              for (int k = 2; k >= 0; k--) {
-                b_child = unrooted_undirectional_tree_.get()[b_child_idx + k];
-                if (b_child != a)
-                  break;
-              }
-            } else {
-              for (int k = 0; k < 3; k++) {
-                b_child = unrooted_undirectional_tree_.get()[b_child_idx + k];
-                if (b_child != a)
-                  break;
-              }
-            }
-            // must reinitialize below
-            for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
-              cur_unrooted_undirectional_tree_.get()[i] =
-                  unrooted_undirectional_tree_.get()[i];
-            }
-            // begin interchange
-            // writed to cur_unrooted_undirectional_tree_
-            nearest_neighbor_interchage(a, b, a_child, b_child);
-            // write to rooted_directional_idx_arr_; rooted_directional_tree_;
-            // need to get the char list copy below
-            make_tree_rooted_directional();
-            int rooted_char_list_len = (num_nodes_ + 1) * num_char_trees_;
-            for (int i = 0; i < rooted_char_list_len; i++) {
-              cur_rooted_char_list_.get()[i] = rooted_char_list_.get()[i];
-            }
-            // run small parsimony
-            small_parsimony = make_shared<SmallParsimony>(
-                rooted_directional_idx_arr_, rooted_directional_tree_,
-                cur_rooted_char_list_, num_char_trees_, num_nodes_ + 1);
-            small_parsimony.get()->run_small_parsimony_string();
-            // record the minmal one
-            if (small_parsimony.get()->total_score_ <= new_score) {
-              if (small_parsimony.get()->total_score_ < new_score) {
-                // first clear tmp list
-                tmp_unrooted_undirectional_tree_queue_.clear();
-                tmp_string_list_queue_.clear();
-                new_score = small_parsimony.get()->total_score_;
-              }
+      // the search only scores informative columns, the dropped ones cost
+      // the same on every tree
+      min_large_parsimony_score_ =
+          new_score-- + site_patterns_.get()->uninformative_score_;
+      round++;
+      next_tree = 0;
+    }
 
-              deep_copy_push_back<int>(tmp_unrooted_undirectional_tree_queue_,
-                                       cur_unrooted_undirectional_tree_,
-                                       unrooted_undirectional_tree_len_);
-              deep_copy_push_back<string>(tmp_string_list_queue_,
-                                          small_parsimony.get()->string_list_,
-                                          num_nodes_);
-            }
-          }
-        }
+    // a rerun after the search ended goes straight to the output
+    if (checkpoint_.get() != nullptr) {
+      save_checkpoint(round, new_score,
+                      unrooted_undirectional_tree_queue_.size());
+      checkpoint_.get()->finish();
+    }
+  }
+
+  // a search like this one over site_patterns from tree, run to its end
+  shared_ptr<LargeParsimony> ratchet_search(
+      shared_ptr<int> tree, shared_ptr<SitePatterns> site_patterns) {
+    shared_ptr<LargeParsimony> search = make_shared<LargeParsimony>(
+        tree, unrooted_undirectional_idx_arr_, site_patterns, num_nodes_,
+        num_leaves_);
+    search.get()->set_cost_matrix(cost_arr_);
+    if (tbr_radius_ > 0) {
+      search.get()->set_tbr_radius(tbr_radius_);
+    } else if (spr_radius_ > 0) {
+      search.get()->set_spr_radius(spr_radius_);
+    }
+    search.get()->run_large_parsimony();
+    return search;
+  }
+
+  /**
+   * Add the trees of a search that score as low as the best ones, or take
+   * them instead when they score less
+   *
+   * @param search : a finished search over site_patterns_
+   * @param best_hash_set : split hashes of the best trees, each is kept once
+   */
+  void merge_ratchet_search(LargeParsimony &search,
+                            unordered_set<uint64_t> &best_hash_set) {
+    int score = search.min_large_parsimony_score_;
+    if (score > min_large_parsimony_score_) {
+      return;
+    }
+    if (score < min_large_parsimony_score_) {
+      min_large_parsimony_score_ = score;
+      unrooted_undirectional_tree_queue_.clear();
+      best_hash_set.clear();
+    }
+    int num_trees = search.unrooted_undirectional_tree_queue_.size();
+    for (int i = 0; i < num_trees; i++) {
+      if (best_hash_set.insert(search.get_tree_hash(i)).second) {
+        unrooted_undirectional_tree_queue_.push_back(
+            search.unrooted_undirectional_tree_queue_[i]);
+      }
+    }
+  }
+
+  /**
+   * Parsimony ratchet after run_large_parsimony(): each iteration searches
+   * from the last tree with some columns weighing double, then from the
+   * tree that gives with the input weights again. The best trees of every
+   * iteration join unrooted_undirectional_tree_queue_.
+   *
+   * @param num_iterations : number of iterations
+   * @param upweight : chance of a column to weigh double in an iteration
+   * @param seed : the same seed reweighs the same way
+   */
+  void run_ratchet(int num_iterations, double upweight, uint32_t seed) {
+    unordered_set<uint64_t> best_hash_set;
+    for (int i = 0; i < int(unrooted_undirectional_tree_queue_.size()); i++) {
+      best_hash_set.insert(get_tree_hash(i));
+    }
+    // one seed per iteration, as the parallel build draws them
+    mt19937 generator(seed);
+    vector<uint32_t> seed_arr(num_iterations);
+    for (auto &iteration_seed : seed_arr) {
+      iteration_seed = generator();
+    }
+
+    shared_ptr<int> tree = unrooted_undirectional_tree_queue_[0];
+    for (int iteration = 0; iteration < num_iterations; iteration++) {
+      mt19937 iteration_generator(seed_arr[iteration]);
+      shared_ptr<LargeParsimony> perturbed_search = ratchet_search(
+          tree, site_patterns_.get()->reweighted(iteration_generator,
+                                                 upweight));
+      shared_ptr<LargeParsimony> search = ratchet_search(
+          perturbed_search.get()->unrooted_undirectional_tree_queue_[0],
+          site_patterns_);
+      merge_ratchet_search(*search.get(), best_hash_set);
+      tree = search.get()->unrooted_undirectional_tree_queue_[0];
+    }
+  }
+
+  /**
+   * Replace the trees found with every most parsimonious tree, by branch and
+   * bound from the score they have. Only for few leaves, see
+   * BranchAndBound.hpp.
+   */
+  void run_branch_and_bound() {
+    // the search scores the informative patterns only
+    int max_score =
+        min_large_parsimony_score_ - site_patterns_.get()->uninformative_score_;
+    BranchAndBound branch_and_bound(unrooted_undirectional_idx_arr_,
+                                    site_patterns_, num_nodes_, num_leaves_,
+                                    max_score);
+    vector<vector<int>> tree_arr;
+    vector<int> score_arr;
+    for (auto &task : branch_and_bound.split(1)) {
+      branch_and_bound.search(task, tree_arr, score_arr);
+    }
+
+    int best_score = branch_and_bound.best_score_;
+    unrooted_undirectional_tree_queue_.clear();
+    for (int t = 0; t < int(tree_arr.size()); t++) {
+      if (score_arr[t] != best_score) {
+        continue;
+      }
+      for (int i = 0; i < unrooted_undirectional_tree_len_; i++) {
+        cur_unrooted_undirectional_tree_.get()[i] = tree_arr[t][i];
       }
+      pooled_copy_push_back(unrooted_undirectional_tree_queue_,
+                            cur_unrooted_undirectional_tree_);
     }
+    min_large_parsimony_score_ =
+        best_score + site_patterns_.get()->uninformative_score_;
   }
 };
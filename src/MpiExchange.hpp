@@ -0,0 +1,56 @@
+//
+//  MpiExchange.hpp
+//  LargeParsimonyProblem
+//
+//  SearchExchange over MPI. The search calls it from one thread at a time,
+//  so MPI has to be initialized with at least MPI_THREAD_SERIALIZED.
+//
+
+#ifndef MpiExchange_hpp
+#define MpiExchange_hpp
+
+#include <mpi.h>
+#include <vector>
+#include "SearchExchange.hpp"
+
+using namespace std;
+
+class MpiExchange : public SearchExchange {
+ public:
+  MPI_Comm comm_;
+
+  MpiExchange(MPI_Comm comm)
+      : SearchExchange{comm_rank(comm), comm_size(comm)}, comm_{comm} {}
+
+  ~MpiExchange() = default;
+
+  static int comm_rank(MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    return rank;
+  }
+
+  static int comm_size(MPI_Comm comm) {
+    int size;
+    MPI_Comm_size(comm, &size);
+    return size;
+  }
+
+ protected:
+  void all_gather_bytes(const char *data, int len,
+                        vector<char> &all_data) override {
+    vector<int> len_arr(num_ranks_);
+    MPI_Allgather(&len, 1, MPI_INT, len_arr.data(), 1, MPI_INT, comm_);
+    vector<int> offset_arr(num_ranks_);
+    int total_len = 0;
+    for (int r = 0; r < num_ranks_; r++) {
+      offset_arr[r] = total_len;
+      total_len += len_arr[r];
+    }
+    all_data.resize(total_len);
+    MPI_Allgatherv(data, len, MPI_BYTE, all_data.data(), len_arr.data(),
+                   offset_arr.data(), MPI_BYTE, comm_);
+  }
+};
+
+#endif /* MpiExchange_hpp */
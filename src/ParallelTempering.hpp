@@ -0,0 +1,288 @@
+//
+//  ParallelTempering.hpp
+//  LargeParsimonyProblem
+//
+//  Stochastic search: Metropolis chains at different temperatures that walk
+//  by random regrafts, and now and then swap temperatures so that a good
+//  tree found by a hot chain is refined by a cold one. The best trees any
+//  chain has been on are collected for the plateau walk that follows.
+//
+
+#ifndef ParallelTempering_hpp
+#define ParallelTempering_hpp
+
+#include <stdint.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "FitchParsimony.hpp"
+#include "FitchSpr.hpp"
+#include "FitchUpDown.hpp"
+#include "TopologyTable.hpp"
+
+using namespace std;
+
+class TemperingChain {
+ public:
+  int num_nodes_;
+
+  int num_leaves_;
+
+  int unrooted_undirectional_tree_len_;
+
+  // n nodes, never change!!!
+  shared_ptr<int> unrooted_undirectional_idx_arr_;
+
+  // a move costing delta is taken with probability exp(-delta / temperature_)
+  double temperature_;
+
+  // the tree the chain is on, its small parsimony score and split hash
+  shared_ptr<int> unrooted_undirectional_tree_;
+  int score_;
+  uint64_t tree_hash_;
+
+  /**
+   * @param fitch_parsimony : the leaves and weights every tree is scored with
+   * @param unrooted_undirectional_idx_arr : index arr of every tree
+   * @param radius : farthest regraft of a proposal in edges, 1 proposes the
+   * nearest neighbor interchanges
+   * @param seed : the proposals and their acceptance, the same seed walks the
+   * same way
+   */
+  TemperingChain(shared_ptr<FitchParsimony> fitch_parsimony,
+                 shared_ptr<int> unrooted_undirectional_idx_arr, int radius,
+                 uint32_t seed)
+      : num_nodes_{fitch_parsimony.get()->num_nodes_ - 1},
+        num_leaves_{fitch_parsimony.get()->num_leaves_},
+        unrooted_undirectional_tree_len_{(num_nodes_ - 1) * 2},
+        unrooted_undirectional_idx_arr_{unrooted_undirectional_idx_arr},
+        temperature_{1},
+        score_{0},
+        tree_hash_{0},
+        fitch_up_down_{fitch_parsimony},
+        topology_hash_{num_nodes_ + 1, num_leaves_},
+        fitch_spr_{fitch_parsimony, radius},
+        generator_{seed} {
+    unrooted_undirectional_tree_ =
+        shared_ptr<int>(new int[unrooted_undirectional_tree_len_],
+                        [](int *p) { delete[] p; });
+    rooted_directional_idx_arr_.resize(num_nodes_ + 1);
+    rooted_directional_tree_.resize((num_nodes_ + 1 - num_leaves_) * 2);
+    rooted_postorder_arr_.resize(num_nodes_ + 1 - num_leaves_);
+    rooted_parent_arr_.resize(num_nodes_ + 1);
+  }
+
+  ~TemperingChain() = default;
+
+  // put the chain on a copy of unrooted_undirectional_tree
+  void load(const int *unrooted_undirectional_tree) {
+    copy(unrooted_undirectional_tree,
+         unrooted_undirectional_tree + unrooted_undirectional_tree_len_,
+         unrooted_undirectional_tree_.get());
+    load_current();
+  }
+
+  /**
+   * Propose one random regraft and take it or not
+   *
+   * @return true if the chain moved
+   */
+  bool step() {
+    const int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    int *tree = unrooted_undirectional_tree_.get();
+    int p = num_leaves_ + generator_() % (num_nodes_ - num_leaves_);
+    int s = tree[idx_arr[p] + generator_() % 3];
+
+    // one of the regrafts of the subtree, all as likely
+    int num_regrafts = 0;
+    int move_x = -1;
+    int move_y = -1;
+    int move_score = 0;
+    fitch_spr_.for_each_regraft(
+        fitch_up_down_, topology_hash_, idx_arr, tree, p, s,
+        [&](int x, int y, uint64_t tree_hash) {
+          num_regrafts++;
+          if (generator_() % num_regrafts == 0) {
+            move_x = x;
+            move_y = y;
+            move_score = fitch_spr_.regraft_score();
+          }
+        });
+    if (move_x == -1) {
+      return false;
+    }
+    int delta = move_score - score_;
+    if (delta > 0 &&
+        uniform_real_distribution<double>(0, 1)(generator_) >=
+            exp(-delta / temperature_)) {
+      return false;
+    }
+    subtree_prune_regraft(p, s, move_x, move_y);
+    load_current();
+    return true;
+  }
+
+  /**
+   * Offer every neighboring pair of temperatures a swap of their chains,
+   * taken with the probability that keeps both chains in balance
+   *
+   * @param chain_arr : the chains, in any order
+   * @param generator : draws the swaps
+   */
+  static void swap_temperatures(const vector<TemperingChain *> &chain_arr,
+                                mt19937 &generator) {
+    vector<TemperingChain *> order_arr = chain_arr;
+    sort(order_arr.begin(), order_arr.end(),
+         [](const TemperingChain *x, const TemperingChain *y) {
+           return x->temperature_ < y->temperature_;
+         });
+    for (int i = 0; i + 1 < int(order_arr.size()); i++) {
+      TemperingChain *cold = order_arr[i];
+      TemperingChain *hot = order_arr[i + 1];
+      double log_ratio = (cold->score_ - hot->score_) *
+                         (1 / cold->temperature_ - 1 / hot->temperature_);
+      if (log_ratio >= 0 ||
+          uniform_real_distribution<double>(0, 1)(generator) <
+              exp(log_ratio)) {
+        swap(cold->temperature_, hot->temperature_);
+        // the hot chain is now the colder one of the next pair
+        swap(order_arr[i], order_arr[i + 1]);
+      }
+    }
+  }
+
+ private:
+  // Fitch sets and split hashes of the current tree
+  FitchUpDown fitch_up_down_;
+  TopologyHash topology_hash_;
+  FitchSpr fitch_spr_;
+  mt19937 generator_;
+
+  // the current tree rooted on the edge of node N - 1 and its first neighbor
+  vector<int> rooted_directional_idx_arr_;
+  vector<int> rooted_directional_tree_;
+  vector<int> rooted_postorder_arr_;
+  vector<int> rooted_parent_arr_;
+
+  // root the current tree, then score and hash it
+  void load_current() {
+    const int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    const int *tree = unrooted_undirectional_tree_.get();
+    int root = num_nodes_;
+    int left = num_nodes_ - 1;
+    int right = tree[idx_arr[left]];
+    int next_postorder = num_nodes_ - num_leaves_;
+    rooted_postorder_arr_[next_postorder--] = root;
+    rooted_directional_idx_arr_[root] = 0;
+    rooted_directional_tree_[0] = left;
+    rooted_directional_tree_[1] = right;
+    // the two sides of the root edge keep each other out
+    rooted_parent_arr_[left] = right;
+    rooted_parent_arr_[right] = left;
+    int next_children = 2;
+    // breadth first, children are the neighbors other than the parent
+    for (int i = 0; i < next_children; i++) {
+      int node = rooted_directional_tree_[i];
+      if (node < num_leaves_) {
+        continue;
+      }
+      rooted_postorder_arr_[next_postorder--] = node;
+      rooted_directional_idx_arr_[node] = next_children;
+      for (int j = 0; j < 3; j++) {
+        int neighbor = tree[idx_arr[node] + j];
+        if (neighbor != rooted_parent_arr_[node]) {
+          rooted_parent_arr_[neighbor] = node;
+          rooted_directional_tree_[next_children++] = neighbor;
+        }
+      }
+    }
+    score_ = fitch_up_down_.load_tree(rooted_directional_tree_.data(),
+                                      rooted_directional_idx_arr_.data(),
+                                      rooted_postorder_arr_.data());
+    tree_hash_ = topology_hash_.load_tree(rooted_directional_tree_.data(),
+                                          rooted_directional_idx_arr_.data(),
+                                          rooted_postorder_arr_.data());
+  }
+
+  // move the subtree that hangs from s at p onto the edge (x, y)
+  void subtree_prune_regraft(int p, int s, int x, int y) {
+    const int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    int *tree = unrooted_undirectional_tree_.get();
+    int q = -1;
+    int r = -1;
+    for (int k = idx_arr[p]; k < idx_arr[p] + 3; k++) {
+      if (tree[k] != s) {
+        (q == -1 ? q : r) = tree[k];
+      }
+    }
+    int move_arr[6][3] = {{q, p, r}, {r, p, q}, {x, y, p},
+                          {y, x, p}, {p, q, x}, {p, r, y}};
+    // each is (node, old neighbor, new neighbor)
+    for (auto &move : move_arr) {
+      int idx = idx_arr[move[0]];
+      while (tree[idx] != move[1]) {
+        idx++;
+      }
+      tree[idx] = move[2];
+    }
+  }
+};
+
+// the lowest scoring trees the chains have been on, each topology once
+class TemperingCollector {
+ public:
+  int best_score_;
+
+  TemperingCollector() : best_score_{INT_MAX} {}
+
+  ~TemperingCollector() = default;
+
+  // keep a copy of the tree of the chain if it is among the best ones. Safe
+  // to call from several threads.
+  void offer(const TemperingChain &chain) {
+    lock_guard<mutex> guard(lock_);
+    if (chain.score_ > best_score_) {
+      return;
+    }
+    if (chain.score_ < best_score_) {
+      best_score_ = chain.score_;
+      tree_map_.clear();
+    }
+    if (tree_map_.count(chain.tree_hash_) == 0) {
+      const int *tree = chain.unrooted_undirectional_tree_.get();
+      tree_map_[chain.tree_hash_] = vector<int>(
+          tree, tree + chain.unrooted_undirectional_tree_len_);
+    }
+  }
+
+  /**
+   * The best trees, ordered by hash so that they do not depend on which
+   * chain found them first
+   *
+   * @param tree_arr : output, the trees
+   * @param hash_arr : output, their hashes
+   */
+  void get_trees(vector<vector<int>> &tree_arr, vector<uint64_t> &hash_arr) {
+    lock_guard<mutex> guard(lock_);
+    hash_arr.clear();
+    for (auto &entry : tree_map_) {
+      hash_arr.push_back(entry.first);
+    }
+    sort(hash_arr.begin(), hash_arr.end());
+    tree_arr.clear();
+    for (uint64_t tree_hash : hash_arr) {
+      tree_arr.push_back(tree_map_[tree_hash]);
+    }
+  }
+
+ private:
+  mutex lock_;
+  unordered_map<uint64_t, vector<int>> tree_map_;
+};
+
+#endif /* ParallelTempering_hpp */
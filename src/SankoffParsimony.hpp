@@ -0,0 +1,364 @@
+//
+//  SankoffParsimony.hpp
+//  LargeParsimonyProblem
+//
+//  Sankoff scoring for DNA under a step matrix: the cost of every node
+//  choosing every char is a min-plus of the costs of its children, done on
+//  a chunk of sites at a time with 16-bit saturating lanes so that the
+//  compiler packs many sites into every vector instruction. The OpenMP
+//  build runs the min-plus through sankoff_node_ispc instead.
+//
+
+#ifndef SankoffParsimony_hpp
+#define SankoffParsimony_hpp
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+class SankoffParsimony {
+  // trees here are all rooted and directed
+ public:
+  // a char a leaf cannot have, every sum with it saturates here
+  static const uint16_t infinity_ = 0xFFFF;
+
+  // sites per pass over the tree, bounds the scratch of a score
+  static const int chunk_len_ = 256;
+
+  // number of sites (columns) scored
+  int num_char_trees_;
+
+  // chunk_len_ sites per chunk, the last one padded
+  int num_chunks_;
+
+  // N + 1, 1 is the root
+  int num_nodes_;
+
+  // leaves are always node 0 ... num_leaves_ - 1
+  int num_leaves_;
+
+  // cost of changing char i to j at cost_arr_[4 * i + j], A, C, G, T as
+  // 0 ... 3
+  int cost_arr_[16];
+
+  // the root sits on the edge between its children and takes the char of
+  // the first one, so that it adds no node to the tree: a cost that breaks
+  // the triangle inequality would otherwise be cut short through it
+  int root_cost_arr_[16];
+
+  // the min-plus of a node over a row of sites, the signature of
+  // sankoff_node_ispc in parsimony.ispc
+  typedef void (*NodeKernel)(int32_t num_sites, bool unit_cost,
+                             const int32_t *cost_arr, bool root,
+                             const uint16_t *left_states,
+                             const uint16_t *right_states,
+                             uint16_t *parent_states, int8_t *back_track_arr);
+
+  // runs every join() when set, the C++ loop of join() does otherwise
+  NodeKernel node_kernel_;
+
+  // how many alignment columns each site stands for, 0 for the padding
+  // length: num_chunks_ * chunk_len_
+  shared_ptr<int> weight_arr_;
+
+  // char index of every leaf at every site, -1 fits every char
+  // length: num_leaves_ * num_chunks_ * chunk_len_, the sites of one leaf
+  // are contiguous
+  shared_ptr<int8_t> leaf_state_arr_;
+
+  /**
+   * @param char_list : length: (str_len) * (N + 1), raw 'A'/'C'/'G'/'T',
+   * anything else fits every char
+   * @param weight_arr : length: str_len, the weight of each site
+   * @param num_char_trees : str_len
+   * @param num_nodes : N + 1
+   * @param num_leaves : number of leaves
+   * @param cost_arr : length 16, see cost_arr_, must pass fits()
+   */
+  SankoffParsimony(const char *char_list, const int *weight_arr,
+                   int num_char_trees, int num_nodes, int num_leaves,
+                   const int *cost_arr)
+      : num_char_trees_{num_char_trees},
+        num_chunks_{(num_char_trees + chunk_len_ - 1) / chunk_len_},
+        num_nodes_{num_nodes},
+        num_leaves_{num_leaves},
+        node_kernel_{nullptr} {
+    for (int i = 0; i < 16; i++) {
+      cost_arr_[i] = cost_arr[i];
+      root_cost_arr_[i] = i / 4 == i % 4 ? 0 : infinity_;
+    }
+    int num_sites = num_chunks_ * chunk_len_;
+    weight_arr_ =
+        shared_ptr<int>(new int[num_sites], [](int *p) { delete[] p; });
+    leaf_state_arr_ = shared_ptr<int8_t>(new int8_t[num_leaves_ * num_sites],
+                                         [](int8_t *p) { delete[] p; });
+    for (int site = 0; site < num_sites; site++) {
+      bool padding = site >= num_char_trees_;
+      weight_arr_.get()[site] = padding ? 0 : weight_arr[site];
+      for (int leaf = 0; leaf < num_leaves_; leaf++) {
+        leaf_state_arr_.get()[leaf * num_sites + site] =
+            padding ? -1 : map_state(char_list[site * num_nodes_ + leaf]);
+      }
+    }
+  }
+
+  ~SankoffParsimony() = default;
+
+  // 'A' 'C' 'G' 'T' to char index, -1 for anything else
+  static int8_t map_state(char c) {
+    switch (c) {
+      case 'A':
+        return 0;
+      case 'C':
+        return 1;
+      case 'G':
+        return 2;
+      case 'T':
+        return 3;
+      default:
+        return -1;
+    }
+  }
+
+  // whether every change costs 1, which Fitch scores faster
+  static bool is_unit_cost(const int *cost_arr) {
+    for (int i = 0; i < 16; i++) {
+      if (cost_arr[i] != int(i / 4 != i % 4)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Whether the cost of every node and char fits a lane. Giving all nodes
+   * of a subtree one char costs at most the largest change per leaf, so no
+   * score that can be reached gets near infinity_.
+   *
+   * @param cost_arr : length 16, a zero diagonal
+   * @param num_leaves : number of leaves
+   */
+  static bool fits(const int *cost_arr, int num_leaves) {
+    int max_cost = *max_element(cost_arr, cost_arr + 16);
+    return int64_t(max_cost) * num_leaves < infinity_;
+  }
+
+  // a + b, infinity_ when it does not fit
+  static inline uint16_t saturating_add(uint16_t a, uint16_t b) {
+    uint16_t sum = a + b;
+    return sum | -uint16_t(sum < a);
+  }
+
+  // length of the scratch of a score, 4 lanes per node and site of a chunk
+  int state_arr_len() const { return num_nodes_ * 4 * chunk_len_; }
+
+  /**
+   * Sankoff small parsimony score of a tree
+   *
+   * @param rooted_directional_tree : children of every internal node
+   * @param rooted_directional_idx_arr : where the children of a node start
+   * @param rooted_postorder_arr : internal nodes, children before parents,
+   * root last
+   * @param state_arr : scratch, length state_arr_len(), holds the costs of
+   * the last chunk afterwards
+   * @return the weighted score
+   */
+  int run_sankoff_score(int *rooted_directional_tree,
+                        int *rooted_directional_idx_arr,
+                        int *rooted_postorder_arr, uint16_t *state_arr) {
+    int score = 0;
+    for (int chunk = 0; chunk < num_chunks_; chunk++) {
+      score += score_chunk(chunk, rooted_directional_tree,
+                           rooted_directional_idx_arr, rooted_postorder_arr,
+                           state_arr);
+    }
+    return score;
+  }
+
+  /**
+   * Ancestral strings of a tree, the first cheapest char of the root and
+   * then of every child given the char of its parent
+   *
+   * @param state_arr : scratch, length state_arr_len()
+   * @param string_list : the chars of node i are appended to string_list[i],
+   * every node but the root
+   */
+  void run_sankoff_ancestral(int *rooted_directional_tree,
+                             int *rooted_directional_idx_arr,
+                             int *rooted_postorder_arr, uint16_t *state_arr,
+                             string *string_list) {
+    const char ACGT_arr[4] = {'A', 'C', 'G', 'T'};
+    int num_internal_nodes = num_nodes_ - num_leaves_;
+    int root = rooted_postorder_arr[num_internal_nodes - 1];
+    unique_ptr<int8_t[]> node_char_arr(new int8_t[num_nodes_ * chunk_len_]);
+    for (int i = 0; i < num_nodes_ - 1; i++) {
+      string_list[i].reserve(string_list[i].size() + num_char_trees_);
+    }
+
+    for (int chunk = 0; chunk < num_chunks_; chunk++) {
+      score_chunk(chunk, rooted_directional_tree, rooted_directional_idx_arr,
+                  rooted_postorder_arr, state_arr);
+      const uint16_t *root_states = state_arr + root * 4 * chunk_len_;
+      int8_t *root_chars = node_char_arr.get() + root * chunk_len_;
+      for (int site = 0; site < chunk_len_; site++) {
+        root_chars[site] = 0;
+        for (int k = 1; k < 4; k++) {
+          if (root_states[k * chunk_len_ + site] <
+              root_states[root_chars[site] * chunk_len_ + site]) {
+            root_chars[site] = k;
+          }
+        }
+      }
+
+      // walking the postorder backwards fills up the chars parents first
+      int num_sites =
+          min(int(chunk_len_), num_char_trees_ - chunk * chunk_len_);
+      for (int p = num_internal_nodes - 1; p >= 0; p--) {
+        int parent = rooted_postorder_arr[p];
+        const int8_t *parent_chars =
+            node_char_arr.get() + parent * chunk_len_;
+        int bias = rooted_directional_idx_arr[parent];
+        for (int j = bias; j < bias + 2; j++) {
+          int child = rooted_directional_tree[j];
+          const int *child_cost_arr =
+              parent == root && j == bias ? root_cost_arr_ : cost_arr_;
+          const uint16_t *child_states = state_arr + child * 4 * chunk_len_;
+          int8_t *child_chars = node_char_arr.get() + child * chunk_len_;
+          for (int site = 0; site < num_sites; site++) {
+            const int *costs = child_cost_arr + parent_chars[site] * 4;
+            uint16_t min_score = infinity_;
+            child_chars[site] = 0;
+            for (int l = 0; l < 4; l++) {
+              uint16_t score = saturating_add(
+                  child_states[l * chunk_len_ + site], uint16_t(costs[l]));
+              if (score < min_score) {
+                min_score = score;
+                child_chars[site] = l;
+              }
+            }
+            string_list[child] += ACGT_arr[int(child_chars[site])];
+          }
+        }
+      }
+    }
+  }
+
+  /**
+   * The cost of every char of a leaf, 0 if the leaf has it, infinity_ if not
+   *
+   * @param begin : first site
+   * @param row_len : sites of every char
+   * @param leaf_states : output, length 4 * row_len
+   */
+  void load_leaf_states(int leaf, int begin, int row_len,
+                        uint16_t *leaf_states) const {
+    const int8_t *chars =
+        leaf_state_arr_.get() + leaf * num_chunks_ * chunk_len_ + begin;
+    for (int k = 0; k < 4; k++) {
+      for (int site = 0; site < row_len; site++) {
+        leaf_states[k * row_len + site] =
+            chars[site] == -1 || chars[site] == k ? 0 : infinity_;
+      }
+    }
+  }
+
+  // the weighted sum over the sites of the cheapest char of a root
+  int weighted_min(const uint16_t *root_states, int begin, int row_len) const {
+    const int *weight_arr = weight_arr_.get() + begin;
+    int score = 0;
+    for (int site = 0; site < row_len; site++) {
+      uint16_t min_score =
+          min(min(root_states[site], root_states[row_len + site]),
+              min(root_states[2 * row_len + site],
+                  root_states[3 * row_len + site]));
+      score += weight_arr[site] * min_score;
+    }
+    return score;
+  }
+
+  /**
+   * Run every join() through a vectorized kernel, the ispc one in the OpenMP
+   * build, so that the search scores as the ancestral strings are built
+   *
+   * @param node_kernel : an ispc build of sankoff_node_ispc
+   */
+  void set_node_kernel(NodeKernel node_kernel) { node_kernel_ = node_kernel; }
+
+  /**
+   * The cost of a parent choosing each char, from the costs of its children
+   *
+   * @param root : whether the parent is the root, which takes the char of
+   * its left child, see root_cost_arr_
+   * @param row_len : sites of every char, the 4 rows of a node are
+   * contiguous
+   */
+  void join(bool root, const uint16_t *left_states,
+            const uint16_t *right_states, uint16_t *parent_states,
+            int row_len) const {
+    if (node_kernel_ != nullptr) {
+      node_kernel_(row_len, false, cost_arr_, root, left_states, right_states,
+                   parent_states, nullptr);
+      return;
+    }
+    const int *left_cost_arr = root ? root_cost_arr_ : cost_arr_;
+    for (int k = 0; k < 4; k++) {
+      const int *left_costs = left_cost_arr + k * 4;
+      const int *right_costs = cost_arr_ + k * 4;
+      uint16_t left_0 = left_costs[0];
+      uint16_t left_1 = left_costs[1];
+      uint16_t left_2 = left_costs[2];
+      uint16_t left_3 = left_costs[3];
+      uint16_t right_0 = right_costs[0];
+      uint16_t right_1 = right_costs[1];
+      uint16_t right_2 = right_costs[2];
+      uint16_t right_3 = right_costs[3];
+      uint16_t *out = parent_states + k * row_len;
+      for (int site = 0; site < row_len; site++) {
+        uint16_t left = min(
+            min(saturating_add(left_states[site], left_0),
+                saturating_add(left_states[row_len + site], left_1)),
+            min(saturating_add(left_states[2 * row_len + site], left_2),
+                saturating_add(left_states[3 * row_len + site], left_3)));
+        uint16_t right = min(
+            min(saturating_add(right_states[site], right_0),
+                saturating_add(right_states[row_len + site], right_1)),
+            min(saturating_add(right_states[2 * row_len + site], right_2),
+                saturating_add(right_states[3 * row_len + site],
+                               right_3)));
+        out[site] = saturating_add(left, right);
+      }
+    }
+  }
+
+ private:
+  // the score of one chunk, the costs of all its nodes are left in
+  // state_arr
+  int score_chunk(int chunk, const int *rooted_directional_tree,
+                  const int *rooted_directional_idx_arr,
+                  const int *rooted_postorder_arr, uint16_t *state_arr) {
+    int begin = chunk * chunk_len_;
+    for (int leaf = 0; leaf < num_leaves_; leaf++) {
+      load_leaf_states(leaf, begin, chunk_len_,
+                       state_arr + leaf * 4 * chunk_len_);
+    }
+
+    // the postorder hands out the nodes in ripe order
+    int num_internal_nodes = num_nodes_ - num_leaves_;
+    for (int p = 0; p < num_internal_nodes; p++) {
+      int parent = rooted_postorder_arr[p];
+      int bias = rooted_directional_idx_arr[parent];
+      bool is_root = p == num_internal_nodes - 1;
+      join(is_root, state_arr + rooted_directional_tree[bias] * 4 * chunk_len_,
+           state_arr + rooted_directional_tree[bias + 1] * 4 * chunk_len_,
+           state_arr + parent * 4 * chunk_len_, chunk_len_);
+    }
+
+    int root = rooted_postorder_arr[num_internal_nodes - 1];
+    return weighted_min(state_arr + root * 4 * chunk_len_, begin, chunk_len_);
+  }
+};
+
+#endif /* SankoffParsimony_hpp */
@@ -0,0 +1,188 @@
+//
+//  SankoffUpDown.hpp
+//  LargeParsimonyProblem
+//
+//  Sankoff costs of both sides of every edge of one tree under a step
+//  matrix, so that every nearest neighbor interchange can be scored from the
+//  four subtrees around its edge, as FitchUpDown does for unit costs.
+//
+
+#ifndef SankoffUpDown_hpp
+#define SankoffUpDown_hpp
+
+#include <stdint.h>
+#include <cstring>
+#include <memory>
+#include "SankoffParsimony.hpp"
+
+using namespace std;
+
+class SankoffUpDown {
+  // trees here are all rooted and directed
+ public:
+  shared_ptr<SankoffParsimony> sankoff_parsimony_;
+
+  // N + 1, 1 is the root
+  int num_nodes_;
+
+  int num_leaves_;
+
+  // sites of every char, the whole padded alignment in one pass
+  int row_len_;
+
+  // length of the costs of one node, 4 rows
+  int node_state_len_;
+
+  // -1 for the root
+  // length: N + 1
+  shared_ptr<int> parent_arr_;
+
+  // down pass: cost of the subtree below each node choosing each char
+  // length: (N + 1) * node_state_len_
+  shared_ptr<uint16_t> down_state_arr_;
+
+  // up pass: cost of everything outside the subtree of each node, hanging
+  // from the node across its parent edge, choosing each char
+  // length: (N + 1) * node_state_len_
+  shared_ptr<uint16_t> up_state_arr_;
+
+  // small parsimony score of the loaded tree
+  int total_score_;
+
+  SankoffUpDown(shared_ptr<SankoffParsimony> sankoff_parsimony)
+      : sankoff_parsimony_{sankoff_parsimony},
+        num_nodes_{sankoff_parsimony.get()->num_nodes_},
+        num_leaves_{sankoff_parsimony.get()->num_leaves_},
+        row_len_{sankoff_parsimony.get()->num_chunks_ *
+                 SankoffParsimony::chunk_len_},
+        node_state_len_{row_len_ * 4},
+        total_score_{0} {
+    parent_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    down_state_arr_ =
+        shared_ptr<uint16_t>(new uint16_t[num_nodes_ * node_state_len_],
+                             [](uint16_t *p) { delete[] p; });
+    up_state_arr_ =
+        shared_ptr<uint16_t>(new uint16_t[num_nodes_ * node_state_len_],
+                             [](uint16_t *p) { delete[] p; });
+    // the leaves never change
+    for (int i = 0; i < num_leaves_; i++) {
+      sankoff_parsimony_.get()->load_leaf_states(
+          i, 0, row_len_, down_state_arr_.get() + i * node_state_len_);
+    }
+  }
+
+  ~SankoffUpDown() = default;
+
+  // length of the scratch buffer score_nearest_neighbor_interchage needs
+  int scratch_len() const { return 3 * node_state_len_; }
+
+  /**
+   * Run the down pass and the up pass over a rooted & directed tree
+   *
+   * @param rooted_directional_tree : children arr of the tree
+   * @param rooted_directional_idx_arr : index arr of the tree
+   * @param rooted_postorder_arr : internal nodes, children before parents
+   * @return the small parsimony score of the tree
+   */
+  int load_tree(int *rooted_directional_tree, int *rooted_directional_idx_arr,
+                int *rooted_postorder_arr) {
+    auto sankoff_parsimony = sankoff_parsimony_.get();
+    auto parent_arr = parent_arr_.get();
+    auto down_state_arr = down_state_arr_.get();
+    auto up_state_arr = up_state_arr_.get();
+    int num_internal_nodes = num_nodes_ - num_leaves_;
+
+    // the root is scored apart, it only stands for the edge below it
+    for (int p = 0; p < num_internal_nodes - 1; p++) {
+      int node = rooted_postorder_arr[p];
+      int left = rooted_directional_tree[rooted_directional_idx_arr[node]];
+      int right = rooted_directional_tree[rooted_directional_idx_arr[node] + 1];
+      parent_arr[left] = node;
+      parent_arr[right] = node;
+      sankoff_parsimony->join(false, down_state_arr + left * node_state_len_,
+                              down_state_arr + right * node_state_len_,
+                              down_state_arr + node * node_state_len_,
+                              row_len_);
+    }
+
+    int root = rooted_postorder_arr[num_internal_nodes - 1];
+    int left = rooted_directional_tree[rooted_directional_idx_arr[root]];
+    int right = rooted_directional_tree[rooted_directional_idx_arr[root] + 1];
+    parent_arr[root] = -1;
+    parent_arr[left] = root;
+    parent_arr[right] = root;
+    total_score_ = score_edge(down_state_arr + left * node_state_len_,
+                              down_state_arr + right * node_state_len_,
+                              down_state_arr + root * node_state_len_);
+
+    // the two sides of the root edge see each other's down costs
+    size_t node_bytes = node_state_len_ * sizeof(uint16_t);
+    memcpy(up_state_arr + left * node_state_len_,
+           down_state_arr + right * node_state_len_, node_bytes);
+    memcpy(up_state_arr + right * node_state_len_,
+           down_state_arr + left * node_state_len_, node_bytes);
+
+    // the postorder backwards visits parents before children
+    for (int p = num_internal_nodes - 2; p >= 0; p--) {
+      int node = rooted_postorder_arr[p];
+      int bias = rooted_directional_idx_arr[node];
+      for (int j = 0; j < 2; j++) {
+        int child = rooted_directional_tree[bias + j];
+        int sibling = rooted_directional_tree[bias + 1 - j];
+        sankoff_parsimony->join(false, up_state_arr + node * node_state_len_,
+                                down_state_arr + sibling * node_state_len_,
+                                up_state_arr + child * node_state_len_,
+                                row_len_);
+      }
+    }
+    return total_score_;
+  }
+
+  // costs of the subtree that hangs from x, seen from its neighbor y
+  const uint16_t *get_subtree(int x, int y) const {
+    if (parent_arr_.get()[x] == y) {
+      return down_state_arr_.get() + x * node_state_len_;
+    }
+    // x is above y, or both hang from the root
+    return up_state_arr_.get() + y * node_state_len_;
+  }
+
+  /**
+   * Score the nearest neighbor interchange that exchanges a_child (a neighbor
+   * of a) and b_child (a neighbor of b) across the internal edge (a, b) of the
+   * loaded tree, which it leaves unchanged.
+   *
+   * @param a_other : the third neighbor of a
+   * @param b_other : the third neighbor of b
+   * @param scratch : length scratch_len()
+   * @return the small parsimony score of the interchanged tree
+   */
+  int score_nearest_neighbor_interchage(int a, int b, int a_child,
+                                        int b_child, int a_other, int b_other,
+                                        uint16_t *scratch) const {
+    auto sankoff_parsimony = sankoff_parsimony_.get();
+    // after the interchange a holds (a_other, b_child), b holds
+    // (b_other, a_child)
+    uint16_t *a_states = scratch;
+    uint16_t *b_states = scratch + node_state_len_;
+    sankoff_parsimony->join(false, get_subtree(a_other, a),
+                            get_subtree(b_child, b), a_states, row_len_);
+    sankoff_parsimony->join(false, get_subtree(b_other, b),
+                            get_subtree(a_child, a), b_states, row_len_);
+    return score_edge(a_states, b_states, scratch + 2 * node_state_len_);
+  }
+
+ private:
+  // the score of a tree split by an edge into two sides, rooted on the edge
+  // with the root taking the char of the first side
+  int score_edge(const uint16_t *first_states, const uint16_t *second_states,
+                 uint16_t *root_states) const {
+    auto sankoff_parsimony = sankoff_parsimony_.get();
+    sankoff_parsimony->join(true, first_states, second_states, root_states,
+                            row_len_);
+    return sankoff_parsimony->weighted_min(root_states, 0, row_len_);
+  }
+};
+
+#endif /* SankoffUpDown_hpp */
@@ -0,0 +1,436 @@
+//
+//  SearchCheckpoint.hpp
+//  LargeParsimonyProblem
+//
+//  Periodic checkpoints of the tree search, so that a preempted run picks up
+//  in the middle of the round it was stopped in. The search hands its state
+//  over between two plateau trees and a background thread writes it.
+//
+//  A checkpoint <file> is three files, all little-endian:
+//    <file>              the state, replaced atomically by every checkpoint:
+//                        "LPCK", uint32 version (1), uint32 N, uint32
+//                        num_leaves, uint32 num_patterns, uint64 input key,
+//                        int32 round, int32 new_score, int32 min score,
+//                        uint32 next_tree, uint32 tree file generation,
+//                        uint32 trees in the tree file, uint64 records in
+//                        the topology file, then uint32 plateau size and the
+//                        index of every plateau tree in the tree file, then
+//                        the same for the trees kept for the next round
+//    <file>.trees.<gen>  (N - 1) * 2 int32 per tree, only appended to until
+//                        it holds more dead trees than live ones, then the
+//                        live ones are written to generation gen + 1
+//    <file>.topologies   uint64 hash and int32 first round of every topology
+//                        the search has scored, only appended to
+//  Records past the counts of the state were written by a checkpoint that
+//  never finished, they are dropped on load.
+//
+
+#ifndef SearchCheckpoint_hpp
+#define SearchCheckpoint_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ArrayPool.hpp"
+#include "SitePatterns.hpp"
+
+using namespace std;
+
+// everything the search needs to carry on from where it was saved
+struct SearchState {
+  // rounds started so far
+  int round;
+  // a candidate scoring at most this is kept for the next round
+  int new_score;
+  // score of the plateau trees, uninformative columns included
+  int min_large_parsimony_score;
+  // the plateau trees before this one are searched already
+  int next_tree;
+  // trees of the round being searched
+  deque<shared_ptr<int>> plateau_queue;
+  // trees kept so far for the next round
+  deque<shared_ptr<int>> tmp_queue;
+  // (hash, first round) of the topologies recorded since the last
+  // checkpoint, of all of them when loaded
+  vector<pair<uint64_t, int>> topology_arr;
+};
+
+class SearchCheckpoint {
+ public:
+  /**
+   * Start the writer thread, load() must be called before the first save()
+   *
+   * @param file_name : the checkpoint, the other files are named after it
+   * @param interval : at least this many seconds between two checkpoints
+   * @param site_patterns : the input of the search, a checkpoint of another
+   * input is refused
+   * @param num_nodes : N
+   * @param num_leaves : number of leaves
+   */
+  SearchCheckpoint(const string &file_name, int interval,
+                   shared_ptr<SitePatterns> site_patterns, int num_nodes,
+                   int num_leaves)
+      : file_name_{file_name},
+        interval_{interval},
+        num_nodes_{num_nodes},
+        num_leaves_{num_leaves},
+        num_patterns_{site_patterns.get()->num_patterns_},
+        tree_len_{(num_nodes - 1) * 2},
+        input_key_{input_key(*site_patterns.get())},
+        tree_gen_{0},
+        num_file_trees_{0},
+        num_topologies_{0},
+        tree_file_{nullptr},
+        topology_file_{nullptr},
+        last_save_{chrono::steady_clock::now()},
+        writing_{false},
+        stopping_{false},
+        finished_{false} {
+    worker_ = thread([this] { run(); });
+  }
+
+  ~SearchCheckpoint() { finish(); }
+
+  /**
+   * Read the last checkpoint, or start a new one if there is none
+   *
+   * @param state : output, the saved state
+   * @param tree_pool : the trees of state are taken from here
+   * @return false if there was no checkpoint, exits if it cannot be read or
+   * belongs to another input
+   */
+  bool load(SearchState &state, ArrayPool<int> &tree_pool) {
+    FILE *file = fopen(file_name_.c_str(), "rb");
+    if (file == nullptr) {
+      // whatever an earlier run left next to it is stale
+      tree_file_ = open_file(tree_file_name(tree_gen_), "wb");
+      topology_file_ = open_file(topology_file_name(), "wb");
+      return false;
+    }
+    char magic[4];
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "LPCK", 4) != 0 ||
+        read_raw<uint32_t>(file) != 1) {
+      fail(file_name_, "not a checkpoint");
+    }
+    if (read_raw<uint32_t>(file) != uint32_t(num_nodes_) ||
+        read_raw<uint32_t>(file) != uint32_t(num_leaves_) ||
+        read_raw<uint32_t>(file) != uint32_t(num_patterns_) ||
+        read_raw<uint64_t>(file) != input_key_) {
+      fail(file_name_, "checkpoint of another input");
+    }
+    state.round = read_raw<int32_t>(file);
+    state.new_score = read_raw<int32_t>(file);
+    state.min_large_parsimony_score = read_raw<int32_t>(file);
+    state.next_tree = read_raw<uint32_t>(file);
+    tree_gen_ = read_raw<uint32_t>(file);
+    num_file_trees_ = read_raw<uint32_t>(file);
+    num_topologies_ = read_raw<uint64_t>(file);
+    vector<uint32_t> plateau_idx_arr(read_raw<uint32_t>(file));
+    for (auto &idx : plateau_idx_arr) {
+      idx = read_raw<uint32_t>(file);
+    }
+    vector<uint32_t> tmp_idx_arr(read_raw<uint32_t>(file));
+    for (auto &idx : tmp_idx_arr) {
+      idx = read_raw<uint32_t>(file);
+    }
+    fclose(file);
+
+    string tree_name = tree_file_name(tree_gen_);
+    file = open_file(tree_name, "rb");
+    for (uint32_t idx : plateau_idx_arr) {
+      state.plateau_queue.push_back(read_tree(file, tree_name, idx, tree_pool));
+    }
+    for (uint32_t idx : tmp_idx_arr) {
+      state.tmp_queue.push_back(read_tree(file, tree_name, idx, tree_pool));
+    }
+    fclose(file);
+
+    file = open_file(topology_file_name(), "rb");
+    state.topology_arr.resize(num_topologies_);
+    for (auto &entry : state.topology_arr) {
+      entry.first = read_raw<uint64_t>(file);
+      entry.second = read_raw<int32_t>(file);
+    }
+    fclose(file);
+
+    // drop what an unfinished checkpoint appended, then append after it
+    truncate_file(tree_name, uint64_t(num_file_trees_) * tree_len_ * 4);
+    truncate_file(topology_file_name(), num_topologies_ * 12);
+    tree_file_ = open_file(tree_name, "ab");
+    topology_file_ = open_file(topology_file_name(), "ab");
+    for (uint32_t i = 0; i < plateau_idx_arr.size(); i++) {
+      tree_idx_map_[state.plateau_queue[i].get()] = plateau_idx_arr[i];
+    }
+    for (uint32_t i = 0; i < tmp_idx_arr.size(); i++) {
+      tree_idx_map_[state.tmp_queue[i].get()] = tmp_idx_arr[i];
+    }
+    written_plateau_queue_ = state.plateau_queue;
+    written_tmp_queue_ = state.tmp_queue;
+    return true;
+  }
+
+  // whether the search should save now: the interval is over and the last
+  // checkpoint is written
+  bool due() {
+    lock_guard<mutex> guard(lock_);
+    return !writing_ && chrono::steady_clock::now() - last_save_ >=
+                            chrono::seconds(interval_);
+  }
+
+  /**
+   * Hand the state to the writer thread, waits only if the last checkpoint
+   * is still being written
+   *
+   * @param state : moved from. The trees must not change afterwards.
+   */
+  void save(SearchState &state) {
+    {
+      unique_lock<mutex> guard(lock_);
+      written_.wait(guard, [this] { return !writing_; });
+      pending_state_ = move(state);
+      writing_ = true;
+      last_save_ = chrono::steady_clock::now();
+    }
+    ready_.notify_one();
+  }
+
+  // write the pending checkpoint, then close the files
+  void finish() {
+    if (finished_) {
+      return;
+    }
+    finished_ = true;
+    {
+      lock_guard<mutex> guard(lock_);
+      stopping_ = true;
+    }
+    ready_.notify_one();
+    worker_.join();
+    if (tree_file_ != nullptr) {
+      fclose(tree_file_);
+    }
+    if (topology_file_ != nullptr) {
+      fclose(topology_file_);
+    }
+  }
+
+ private:
+  string file_name_;
+  int interval_;
+  int num_nodes_;
+  int num_leaves_;
+  int num_patterns_;
+  int tree_len_;
+  uint64_t input_key_;
+
+  // owned by the writer thread once load() returns
+  uint32_t tree_gen_;
+  uint32_t num_file_trees_;
+  uint64_t num_topologies_;
+  FILE *tree_file_;
+  FILE *topology_file_;
+  // place in the tree file of every tree of the last checkpoint, which the
+  // written queues keep alive so that no other tree can take its address
+  unordered_map<int *, uint32_t> tree_idx_map_;
+  deque<shared_ptr<int>> written_plateau_queue_;
+  deque<shared_ptr<int>> written_tmp_queue_;
+
+  thread worker_;
+  mutex lock_;
+  condition_variable ready_;
+  condition_variable written_;
+  chrono::steady_clock::time_point last_save_;
+  SearchState pending_state_;
+  bool writing_;
+  bool stopping_;
+  bool finished_;
+
+  // FNV-1a of the leaf chars and weights of every pattern
+  static uint64_t input_key(const SitePatterns &site_patterns) {
+    uint64_t key = 0xcbf29ce484222325ULL;
+    auto mix = [&key](uint64_t value) {
+      key = (key ^ value) * 0x100000001b3ULL;
+    };
+    const char *char_list = site_patterns.char_list_.get();
+    for (int p = 0; p < site_patterns.num_patterns_; p++) {
+      for (int leaf = 0; leaf < site_patterns.num_leaves_; leaf++) {
+        mix((unsigned char)char_list[p * site_patterns.num_nodes_ + leaf]);
+      }
+      mix(site_patterns.weight_arr_.get()[p]);
+    }
+    mix(site_patterns.uninformative_score_);
+    return key;
+  }
+
+  string tree_file_name(uint32_t gen) const {
+    return file_name_ + ".trees." + to_string(gen);
+  }
+
+  string topology_file_name() const { return file_name_ + ".topologies"; }
+
+  static void fail(const string &file_name, const string &reason) {
+    cerr << file_name << ": " << reason << endl;
+    exit(1);
+  }
+
+  static FILE *open_file(const string &file_name, const char *mode) {
+    FILE *file = fopen(file_name.c_str(), mode);
+    if (file == nullptr) {
+      fail(file_name, "cannot open checkpoint file");
+    }
+    return file;
+  }
+
+  template <class T>
+  T read_raw(FILE *file) {
+    T value;
+    if (fread(&value, sizeof(T), 1, file) != 1) {
+      fail(file_name_, "checkpoint ends early");
+    }
+    return value;
+  }
+
+  template <class T>
+  static void write_raw(FILE *file, T value) {
+    fwrite(&value, sizeof(T), 1, file);
+  }
+
+  shared_ptr<int> read_tree(FILE *file, const string &file_name, uint32_t idx,
+                            ArrayPool<int> &tree_pool) {
+    shared_ptr<int> tree = tree_pool.acquire();
+    if (idx >= num_file_trees_ ||
+        fseeko(file, off_t(idx) * tree_len_ * 4, SEEK_SET) != 0 ||
+        fread(tree.get(), 4, tree_len_, file) != size_t(tree_len_)) {
+      fail(file_name, "checkpoint ends early");
+    }
+    return tree;
+  }
+
+  static void truncate_file(const string &file_name, uint64_t len) {
+    if (truncate(file_name.c_str(), len) != 0) {
+      fail(file_name, "cannot truncate checkpoint file");
+    }
+  }
+
+  // on the disk before anything that refers to it
+  static void sync_file(FILE *file, const string &file_name) {
+    if (fflush(file) != 0 || ferror(file) || fsync(fileno(file)) != 0) {
+      fail(file_name, "cannot write checkpoint file");
+    }
+  }
+
+  void run() {
+    unique_lock<mutex> guard(lock_);
+    while (true) {
+      ready_.wait(guard, [this] { return writing_ || stopping_; });
+      if (!writing_) {
+        return;
+      }
+      guard.unlock();
+      write(pending_state_);
+      guard.lock();
+      writing_ = false;
+      written_.notify_all();
+    }
+  }
+
+  // the place of tree in the tree file, appended unless the last
+  // checkpoint wrote it already
+  uint32_t place_tree(const shared_ptr<int> &tree,
+                      unordered_map<int *, uint32_t> &tree_idx_map) {
+    auto it = tree_idx_map_.find(tree.get());
+    uint32_t idx;
+    if (it != tree_idx_map_.end()) {
+      idx = it->second;
+    } else {
+      idx = num_file_trees_++;
+      fwrite(tree.get(), 4, tree_len_, tree_file_);
+    }
+    tree_idx_map[tree.get()] = idx;
+    return idx;
+  }
+
+  void write(SearchState &state) {
+    for (auto &entry : state.topology_arr) {
+      write_raw<uint64_t>(topology_file_, entry.first);
+      write_raw<int32_t>(topology_file_, entry.second);
+    }
+    num_topologies_ += state.topology_arr.size();
+    sync_file(topology_file_, topology_file_name());
+
+    uint32_t num_live = state.plateau_queue.size() + state.tmp_queue.size();
+    uint32_t num_known = 0;
+    for (auto &tree : state.plateau_queue) {
+      num_known += tree_idx_map_.count(tree.get());
+    }
+    for (auto &tree : state.tmp_queue) {
+      num_known += tree_idx_map_.count(tree.get());
+    }
+    uint32_t old_gen = tree_gen_;
+    bool new_gen = num_file_trees_ - num_known > num_live;
+    if (new_gen) {
+      fclose(tree_file_);
+      tree_gen_++;
+      tree_file_ = open_file(tree_file_name(tree_gen_), "wb");
+      num_file_trees_ = 0;
+      tree_idx_map_.clear();
+    }
+    unordered_map<int *, uint32_t> tree_idx_map;
+    vector<uint32_t> plateau_idx_arr;
+    for (auto &tree : state.plateau_queue) {
+      plateau_idx_arr.push_back(place_tree(tree, tree_idx_map));
+    }
+    vector<uint32_t> tmp_idx_arr;
+    for (auto &tree : state.tmp_queue) {
+      tmp_idx_arr.push_back(place_tree(tree, tree_idx_map));
+    }
+    sync_file(tree_file_, tree_file_name(tree_gen_));
+
+    // the state goes last, it only refers to what is on the disk already
+    string tmp_name = file_name_ + ".tmp";
+    FILE *file = open_file(tmp_name, "wb");
+    fwrite("LPCK", 1, 4, file);
+    write_raw<uint32_t>(file, 1);
+    write_raw<uint32_t>(file, num_nodes_);
+    write_raw<uint32_t>(file, num_leaves_);
+    write_raw<uint32_t>(file, num_patterns_);
+    write_raw<uint64_t>(file, input_key_);
+    write_raw<int32_t>(file, state.round);
+    write_raw<int32_t>(file, state.new_score);
+    write_raw<int32_t>(file, state.min_large_parsimony_score);
+    write_raw<uint32_t>(file, state.next_tree);
+    write_raw<uint32_t>(file, tree_gen_);
+    write_raw<uint32_t>(file, num_file_trees_);
+    write_raw<uint64_t>(file, num_topologies_);
+    write_raw<uint32_t>(file, plateau_idx_arr.size());
+    fwrite(plateau_idx_arr.data(), 4, plateau_idx_arr.size(), file);
+    write_raw<uint32_t>(file, tmp_idx_arr.size());
+    fwrite(tmp_idx_arr.data(), 4, tmp_idx_arr.size(), file);
+    sync_file(file, tmp_name);
+    fclose(file);
+    if (rename(tmp_name.c_str(), file_name_.c_str()) != 0) {
+      fail(file_name_, "cannot replace checkpoint");
+    }
+    if (new_gen) {
+      remove(tree_file_name(old_gen).c_str());
+    }
+
+    tree_idx_map_ = move(tree_idx_map);
+    written_plateau_queue_ = move(state.plateau_queue);
+    written_tmp_queue_ = move(state.tmp_queue);
+    state.topology_arr.clear();
+  }
+};
+
+#endif /* SearchCheckpoint_hpp */
@@ -0,0 +1,218 @@
+//
+//  SearchDriver.hpp
+//  LargeParsimonyProblem
+//
+//  The body of every driver: read the input, run the searches the options
+//  ask for and write the best trees. It is templated on the search class,
+//  the sequential or the OpenMP LargeParsimony, and each driver includes
+//  the header of its own first. The MPI driver runs the same searches on
+//  every process, split by a SearchExchange, and writes from the root only.
+//
+
+#ifndef SearchDriver_hpp
+#define SearchDriver_hpp
+
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "BranchAndBound.hpp"
+#include "StepwiseAddition.hpp"
+#include "TreeWriter.hpp"
+#include "util.h"
+
+using namespace std;
+
+// the input and the searches that ended on the lowest score
+template <class Search>
+struct SearchResult {
+  InputTree input;
+  vector<shared_ptr<Search>> best_arr;
+};
+
+// builds the search from one starting tree, with what only its class takes
+template <class Search>
+using SearchFactory = function<shared_ptr<Search>(
+    shared_ptr<int> start_tree, const InputTree &input,
+    shared_ptr<SitePatterns> site_patterns)>;
+
+/**
+ * Run every search the options ask for
+ *
+ * @param file_name : input tree, or alignment with options.newick_file
+ * @param num_threads : threads of this process, 1 for the sequential search
+ * @param new_search : builds each search, before the options are applied
+ * @return the input and the best searches, exits on bad input
+ */
+template <class Search>
+SearchResult<Search> runSearch(const string &file_name, int num_threads,
+                               const Options &options,
+                               const SearchFactory<Search> &new_search) {
+  // tree and leaf sequences, read in place from the mapped file unless the
+  // input is an alignment with a separate Newick tree
+  SearchResult<Search> result;
+  result.input = options.newick_file.empty()
+                     ? readInputTree(file_name)
+                     : readAlignmentTree(file_name, options.newick_file);
+  const InputTree &input = result.input;
+  int num_leaves = input.num_leaves;
+  int num_char_trees = input.num_char_trees;
+  int num_undirected_nodes = input.num_undirected_nodes;
+  int num_directed_nodes = num_undirected_nodes + 1;
+  auto undirected_idx = input.undirected_idx;
+  auto neighbor_arr = input.neighbor_arr;
+  auto char_list = input.char_list;
+
+  // every change costs 1 unless a step matrix is given
+  int cost_arr[16];
+  readCostMatrix(options, cost_arr);
+  if (!SankoffParsimony::fits(cost_arr, num_leaves)) {
+    cerr << "step matrix too costly for " << num_leaves << " leaves" << endl;
+    exit(1);
+  }
+  bool unit_cost = SankoffParsimony::is_unit_cost(cost_arr);
+
+  // the exact search is only practical for few leaves
+  if (options.exact && num_leaves > BranchAndBound::max_num_leaves_) {
+    cerr << "--exact takes at most " << BranchAndBound::max_num_leaves_
+         << " leaves, the input has " << num_leaves << endl;
+    exit(1);
+  }
+
+  // identical columns are scored once, uninformative ones are not searched
+  auto site_patterns =
+      make_shared<SitePatterns>(char_list, num_char_trees, num_directed_nodes,
+                                num_leaves, unit_cost);
+
+  // one search from the input tree, or one from each of the stepwise
+  // addition trees, the input tree then only gives the leaves
+  int num_starts = max(1, options.replicates);
+  vector<shared_ptr<int>> start_tree_arr(num_starts, neighbor_arr);
+  if (options.replicates > 0) {
+    // the starting trees are built side by side, one per thread
+#ifdef OMP
+#pragma omp parallel num_threads(num_threads)
+#endif
+    {
+      StepwiseAddition stepwise_addition(undirected_idx, site_patterns,
+                                         num_undirected_nodes, num_leaves);
+#ifdef OMP
+#pragma omp for schedule(dynamic)
+#endif
+      for (int r = 0; r < num_starts; r++) {
+        shared_ptr<int> tree(new int[(num_undirected_nodes - 1) * 2],
+                             [](int *p) { delete[] p; });
+        stepwise_addition.build(options.seed + r, tree.get());
+        start_tree_arr[r] = tree;
+      }
+    }
+  }
+
+  // the searches that end on the lowest score
+  vector<shared_ptr<Search>> &best_arr = result.best_arr;
+  for (int r = 0; r < num_starts; r++) {
+    shared_ptr<Search> large_parsimony =
+        new_search(start_tree_arr[r], input, site_patterns);
+    large_parsimony.get()->set_cost_matrix(cost_arr);
+    if (options.spr_radius > 0) {
+      large_parsimony.get()->set_spr_radius(options.spr_radius);
+    }
+    if (options.tbr_radius > 0) {
+      large_parsimony.get()->set_tbr_radius(options.tbr_radius);
+    }
+    if (options.tempering_steps > 0) {
+      // one chain per thread
+      large_parsimony.get()->set_tempering(
+          options.tempering_steps,
+          options.tempering_chains > 0 ? options.tempering_chains : num_threads,
+          options.tempering_temperature, options.seed + r);
+    }
+    // a rerun with the same checkpoint resumes the search where it was
+    // saved, every replicate has its own
+    if (!options.checkpoint_file.empty()) {
+      string checkpoint_file = options.checkpoint_file;
+      if (options.replicates > 0) {
+        checkpoint_file += "." + to_string(r);
+      }
+      large_parsimony.get()->set_checkpoint(make_shared<SearchCheckpoint>(
+          checkpoint_file, options.checkpoint_interval, site_patterns,
+          num_undirected_nodes, num_leaves));
+    }
+    large_parsimony.get()->run_large_parsimony();
+    if (options.ratchet_iterations > 0) {
+      large_parsimony.get()->run_ratchet(options.ratchet_iterations,
+                                         options.ratchet_upweight,
+                                         options.seed + r);
+    }
+
+    int score = large_parsimony.get()->min_large_parsimony_score_;
+    if (!best_arr.empty() &&
+        score < best_arr[0].get()->min_large_parsimony_score_) {
+      best_arr.clear();
+    }
+    if (best_arr.empty() ||
+        score == best_arr[0].get()->min_large_parsimony_score_) {
+      best_arr.push_back(large_parsimony);
+    }
+  }
+
+  // every most parsimonious tree, from the score of the best search
+  if (options.exact) {
+    best_arr.resize(1);
+    best_arr[0].get()->run_branch_and_bound();
+  }
+  return result;
+}
+
+/**
+ * Write the trees of the best searches, each topology once
+ *
+ * @param result : from runSearch(), its tree queues are deduplicated
+ * @param outfile_name : output file
+ */
+template <class Search>
+void writeSearchResult(SearchResult<Search> &result,
+                       const string &outfile_name, const Options &options) {
+  const InputTree &input = result.input;
+  vector<shared_ptr<Search>> &best_arr = result.best_arr;
+  // formatted and written on a background thread, so the file fills up
+  // while the strings of the later trees are still being built
+  TreeWriter::Format format = TreeWriter::TEXT_FORMAT;
+  TreeWriter::format_from_name(options.output_format, format);
+  TreeWriter writer(outfile_name, format,
+                    best_arr[0].get()->min_large_parsimony_score_,
+                    input.num_undirected_nodes, input.num_leaves,
+                    input.undirected_idx, input.leaf_name_arr,
+                    input.char_list.get(), input.num_char_trees,
+                    options.write_ancestral);
+  // a tree found by several replicates is written once
+  unordered_set<uint64_t> written_hashes;
+  for (auto large_parsimony : best_arr) {
+    deque<shared_ptr<int>> &tree_queue =
+        large_parsimony.get()->unrooted_undirectional_tree_queue_;
+    deque<shared_ptr<int>> new_tree_queue;
+    for (int i = 0; i < int(tree_queue.size()); i++) {
+      if (written_hashes.insert(large_parsimony.get()->get_tree_hash(i))
+              .second) {
+        new_tree_queue.push_back(tree_queue[i]);
+      }
+    }
+    tree_queue = new_tree_queue;
+    // the search only scores, strings are built for the final trees alone
+    if (options.write_ancestral) {
+      large_parsimony.get()->build_string_lists(
+          [&](int i, shared_ptr<string> string_list) {
+            writer.push(tree_queue[i], string_list);
+          });
+    } else {
+      for (auto tree : tree_queue) {
+        writer.push(tree, nullptr);
+      }
+    }
+  }
+  writer.finish();
+}
+
+#endif /* SearchDriver_hpp */
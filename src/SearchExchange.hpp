@@ -0,0 +1,70 @@
+//
+//  SearchExchange.hpp
+//  LargeParsimonyProblem
+//
+//  One search split over several processes. Each process scores its share
+//  of the (tree, move) tasks of every slice, then the moves that may be kept
+//  and the topologies seen are exchanged, so that all processes go on with
+//  the same plateau and the same topology table. The transport is left to a
+//  subclass, see MpiExchange.hpp.
+//
+
+#ifndef SearchExchange_hpp
+#define SearchExchange_hpp
+
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+class SearchExchange {
+ public:
+  // this process, 0 is the root
+  int rank_;
+
+  int num_ranks_;
+
+  SearchExchange(int rank, int num_ranks)
+      : rank_{rank}, num_ranks_{num_ranks} {}
+
+  virtual ~SearchExchange() = default;
+
+  // the root process writes the output
+  bool is_root() const { return rank_ == 0; }
+
+  /**
+   * The contiguous share of this process of tasks 0 ... total_tasks - 1
+   *
+   * @param first_task : output, its first task
+   * @param num_tasks : output, its number of tasks
+   */
+  void share_tasks(int total_tasks, int &first_task, int &num_tasks) const {
+    first_task = (long long)total_tasks * rank_ / num_ranks_;
+    num_tasks =
+        (long long)total_tasks * (rank_ + 1) / num_ranks_ - first_task;
+  }
+
+  /**
+   * Every process gets the arrays of all, one after the other in rank
+   * order. Every process has to call it at the same point.
+   *
+   * @param local_arr : the array of this process, of plain structs
+   * @param all_arr : output
+   */
+  template <class T>
+  void all_gather(const vector<T> &local_arr, vector<T> &all_arr) {
+    vector<char> all_data;
+    all_gather_bytes(reinterpret_cast<const char *>(local_arr.data()),
+                     local_arr.size() * sizeof(T), all_data);
+    all_arr.resize(all_data.size() / sizeof(T));
+    memcpy(static_cast<void *>(all_arr.data()), all_data.data(),
+           all_data.size());
+  }
+
+ protected:
+  // every process gets the bytes of all, in rank order
+  virtual void all_gather_bytes(const char *data, int len,
+                                vector<char> &all_data) = 0;
+};
+
+#endif /* SearchExchange_hpp */
@@ -0,0 +1,240 @@
+//
+//  SitePatterns.hpp
+//  LargeParsimonyProblem
+//
+//  Collapse identical alignment columns into weighted site patterns and set
+//  the parsimony-uninformative ones aside.
+//
+
+#ifndef SitePatterns_hpp
+#define SitePatterns_hpp
+
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+class SitePatterns {
+ public:
+  // number of columns in the input alignment
+  int num_sites_;
+
+  // number of unique informative columns, this is the str_len every scoring
+  // path sees
+  int num_patterns_;
+
+  // N + 1, 1 is the root
+  int num_nodes_;
+
+  int num_leaves_;
+
+  // the input char list, leaves of the dropped columns are read from here
+  // length: num_sites_ * num_nodes_
+  shared_ptr<char> site_char_list_;
+
+  // char list of the patterns, same layout as the input char list
+  // length: num_patterns_ * num_nodes_
+  shared_ptr<char> char_list_;
+
+  // how many input columns each pattern stands for
+  // length: num_patterns_
+  shared_ptr<int> weight_arr_;
+
+  // site_pattern_arr_[site] == p means input column site is pattern p, -1
+  // means the column is parsimony-uninformative and was dropped
+  // length: num_sites_
+  shared_ptr<int> site_pattern_arr_;
+
+  // char given to every internal node at a dropped column
+  // length: num_sites_
+  shared_ptr<char> site_fill_arr_;
+
+  // cost of the dropped columns, the same on every topology
+  int uninformative_score_;
+
+  // every change costs 1, otherwise only the columns of one char are
+  // dropped, they cost nothing on any tree
+  bool unit_cost_;
+
+  /**
+   * Collapse identical leaf columns of a char list and drop the columns that
+   * cannot tell topologies apart
+   *
+   * A column is uninformative when at most one char appears on two or more
+   * leaves. Any tree then costs (number of distinct chars - 1) on it, reached
+   * by giving all internal nodes the most frequent char. Columns with chars
+   * other than A, C, G and T are always kept.
+   *
+   * @param char_list : length: (str_len) * (N + 1), only the leaves are read
+   * @param num_sites : str_len
+   * @param num_nodes : N + 1
+   * @param num_leaves : number of leaves
+   * @param unit_cost : false when the columns are scored under a step
+   * matrix, see unit_cost_
+   */
+  SitePatterns(shared_ptr<char> char_list, int num_sites, int num_nodes,
+               int num_leaves, bool unit_cost = true)
+      : num_sites_{num_sites},
+        num_patterns_{0},
+        num_nodes_{num_nodes},
+        num_leaves_{num_leaves},
+        site_char_list_{char_list},
+        uninformative_score_{0},
+        unit_cost_{unit_cost} {
+    site_pattern_arr_ =
+        shared_ptr<int>(new int[num_sites_], [](int *p) { delete[] p; });
+    site_fill_arr_ =
+        shared_ptr<char>(new char[num_sites_], [](char *p) { delete[] p; });
+    auto site_pattern_arr = site_pattern_arr_.get();
+    auto site_fill_arr = site_fill_arr_.get();
+    auto site_char_list = site_char_list_.get();
+
+    // leaves are node 0 ... num_leaves - 1, so a column's leaf chars are
+    // contiguous in the char list
+    unordered_map<string, int> pattern_idx;
+    vector<int> pattern_site;
+    for (int site = 0; site < num_sites_; site++) {
+      const char *column = site_char_list + site * num_nodes_;
+      char fill_char = '#';
+      int fixed_score = get_uninformative_score(column, fill_char);
+      if (fixed_score != -1) {
+        site_pattern_arr[site] = -1;
+        site_fill_arr[site] = fill_char;
+        uninformative_score_ += fixed_score;
+        continue;
+      }
+
+      string key(column, num_leaves_);
+      auto it = pattern_idx.find(key);
+      if (it == pattern_idx.end()) {
+        site_pattern_arr[site] = num_patterns_;
+        pattern_idx.emplace(key, num_patterns_++);
+        pattern_site.push_back(site);
+      } else {
+        site_pattern_arr[site] = it->second;
+      }
+    }
+
+    char_list_ = shared_ptr<char>(new char[num_patterns_ * num_nodes_],
+                                  [](char *p) { delete[] p; });
+    weight_arr_ =
+        shared_ptr<int>(new int[num_patterns_], [](int *p) { delete[] p; });
+    auto pattern_char_list = char_list_.get();
+    auto weight_arr = weight_arr_.get();
+    for (int pattern = 0; pattern < num_patterns_; pattern++) {
+      weight_arr[pattern] = 0;
+      for (int node = 0; node < num_nodes_; node++) {
+        pattern_char_list[pattern * num_nodes_ + node] =
+            site_char_list[pattern_site[pattern] * num_nodes_ + node];
+      }
+    }
+    for (int site = 0; site < num_sites_; site++) {
+      if (site_pattern_arr[site] != -1) {
+        weight_arr[site_pattern_arr[site]]++;
+      }
+    }
+  }
+
+  ~SitePatterns() = default;
+
+  /**
+   * The same patterns with each input column behind them counted once more
+   * at random, as a parsimony ratchet perturbs the weights. Everything but
+   * the weights is shared with this one.
+   *
+   * @param generator : draws the columns
+   * @param upweight : chance of a column to count twice
+   * @return the reweighted patterns
+   */
+  shared_ptr<SitePatterns> reweighted(mt19937 &generator,
+                                      double upweight) const {
+    shared_ptr<SitePatterns> site_patterns = make_shared<SitePatterns>(*this);
+    site_patterns.get()->weight_arr_ =
+        shared_ptr<int>(new int[num_patterns_], [](int *p) { delete[] p; });
+    auto weight_arr = site_patterns.get()->weight_arr_.get();
+    bernoulli_distribution upweighted(upweight);
+    for (int pattern = 0; pattern < num_patterns_; pattern++) {
+      weight_arr[pattern] = weight_arr_.get()[pattern];
+      for (int k = 0; k < weight_arr_.get()[pattern]; k++) {
+        weight_arr[pattern] += upweighted(generator);
+      }
+    }
+    return site_patterns;
+  }
+
+  /**
+   * Fixed cost of an uninformative column
+   *
+   * @param column : the leaf chars of the column
+   * @param fill_char : output, the most frequent char of the column
+   * @return the cost of the column on any tree, or -1 if it is informative
+   */
+  int get_uninformative_score(const char *column, char &fill_char) const {
+    const char ACGT_arr[4] = {'A', 'C', 'G', 'T'};
+    int count[4] = {0, 0, 0, 0};
+    for (int leaf = 0; leaf < num_leaves_; leaf++) {
+      int state = -1;
+      for (int k = 0; k < 4; k++) {
+        if (column[leaf] == ACGT_arr[k]) {
+          state = k;
+        }
+      }
+      if (state == -1) {
+        return -1;
+      }
+      count[state]++;
+    }
+
+    int num_states = 0;
+    int num_repeated = 0;
+    int fill_state = 0;
+    for (int k = 0; k < 4; k++) {
+      num_states += count[k] > 0;
+      num_repeated += count[k] > 1;
+      if (count[k] > count[fill_state]) {
+        fill_state = k;
+      }
+    }
+    if (num_repeated > 1 || (!unit_cost_ && num_states > 1)) {
+      return -1;
+    }
+    fill_char = ACGT_arr[fill_state];
+    return num_states - 1;
+  }
+
+  /**
+   * Expand per-pattern strings back to full alignment columns. Leaves get
+   * their input strings, internal nodes get the fill char at dropped columns.
+   *
+   * @param pattern_string_list : strings of length num_patterns_, node i at
+   * index i
+   * @param string_list : output, strings of length num_sites_
+   * @param num_strings : number of strings in both lists
+   */
+  void expand_string_list(const string *pattern_string_list,
+                          string *string_list, int num_strings) const {
+    auto site_pattern_arr = site_pattern_arr_.get();
+    auto site_fill_arr = site_fill_arr_.get();
+    auto site_char_list = site_char_list_.get();
+    for (int i = 0; i < num_strings; i++) {
+      const string &pattern_str = pattern_string_list[i];
+      string &str = string_list[i];
+      str.resize(num_sites_);
+      for (int site = 0; site < num_sites_; site++) {
+        int pattern = site_pattern_arr[site];
+        if (i < num_leaves_) {
+          str[site] = site_char_list[site * num_nodes_ + i];
+        } else if (pattern == -1) {
+          str[site] = site_fill_arr[site];
+        } else {
+          str[site] = pattern_str[pattern];
+        }
+      }
+    }
+  }
+};
+
+#endif /* SitePatterns_hpp */
@@ -0,0 +1,233 @@
+//
+//  StepwiseAddition.hpp
+//  LargeParsimonyProblem
+//
+//  Starting trees built by stepwise addition (Wagner trees): the leaves are
+//  taken in a random order, and each goes on the edge of the tree so far
+//  where it costs the least. The tree so far scores the same wherever it is
+//  rooted, so one pass down and one pass up give the cost of every edge.
+//
+
+#ifndef StepwiseAddition_hpp
+#define StepwiseAddition_hpp
+
+#include <stdint.h>
+#include <climits>
+#include <memory>
+#include <random>
+#include <vector>
+#include "FitchParsimony.hpp"
+#include "SitePatterns.hpp"
+
+using namespace std;
+
+class StepwiseAddition {
+ public:
+  // N, the leaves are node 0 ... num_leaves_ - 1
+  int num_nodes_;
+
+  int num_leaves_;
+
+  // n nodes, never change!!!
+  shared_ptr<int> unrooted_undirectional_idx_arr_;
+
+  // the informative patterns of the leaves, as the search scores them
+  shared_ptr<FitchParsimony> fitch_parsimony_;
+
+  // length of the bit-planes of one node
+  int node_state_len_;
+
+  /**
+   * @param unrooted_undirectional_idx_arr : index arr of every tree built, a
+   * leaf has 1 neighbor and other nodes 3
+   * @param site_patterns : leaf sequences
+   * @param num_nodes : N
+   * @param num_leaves : number of leaves
+   */
+  StepwiseAddition(shared_ptr<int> unrooted_undirectional_idx_arr,
+                   shared_ptr<SitePatterns> site_patterns, int num_nodes,
+                   int num_leaves)
+      : num_nodes_{num_nodes},
+        num_leaves_{num_leaves},
+        unrooted_undirectional_idx_arr_{unrooted_undirectional_idx_arr} {
+    fitch_parsimony_ = make_shared<FitchParsimony>(
+        site_patterns.get()->char_list_.get(),
+        site_patterns.get()->weight_arr_.get(),
+        site_patterns.get()->num_patterns_, num_nodes + 1, num_leaves);
+    node_state_len_ = fitch_parsimony_.get()->num_words_ * 4;
+    down_state_arr_ = shared_ptr<uint64_t>(
+        new uint64_t[fitch_parsimony_.get()->state_arr_len()],
+        [](uint64_t *p) { delete[] p; });
+    up_state_arr_ = shared_ptr<uint64_t>(
+        new uint64_t[fitch_parsimony_.get()->state_arr_len()],
+        [](uint64_t *p) { delete[] p; });
+    order_arr_.resize(num_nodes);
+    parent_arr_.resize(num_nodes);
+  }
+
+  ~StepwiseAddition() = default;
+
+  /**
+   * Build one starting tree
+   *
+   * @param seed : picks the order the leaves are added in, the same seed
+   * gives the same tree
+   * @param unrooted_undirectional_tree : output, length 2 * (N - 1)
+   * @return the small parsimony score of the tree over the informative
+   * patterns
+   */
+  int build(uint32_t seed, int *unrooted_undirectional_tree) {
+    auto fitch_parsimony = fitch_parsimony_.get();
+    const int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    mt19937 generator(seed);
+    vector<int> leaf_order(num_leaves_);
+    for (int i = 0; i < num_leaves_; i++) {
+      int j = generator() % (i + 1);
+      leaf_order[i] = leaf_order[j];
+      leaf_order[j] = i;
+    }
+
+    // the first three leaves around the first internal node
+    int center = num_leaves_;
+    for (int j = 0; j < 3; j++) {
+      unrooted_undirectional_tree[idx_arr[center] + j] = leaf_order[j];
+      unrooted_undirectional_tree[idx_arr[leaf_order[j]]] = center;
+    }
+    uint64_t *pair_states = down_state_arr_.get() + center * node_state_len_;
+    int score = fitch_parsimony->fitch_join(
+        fitch_parsimony->get_node_states(nullptr, leaf_order[0]),
+        fitch_parsimony->get_node_states(nullptr, leaf_order[1]), pair_states);
+    score += fitch_parsimony->fitch_join(
+        pair_states, fitch_parsimony->get_node_states(nullptr, leaf_order[2]),
+        up_state_arr_.get() + center * node_state_len_);
+
+    for (int i = 3; i < num_leaves_; i++) {
+      int leaf = leaf_order[i];
+      // node numbers follow the order the internal nodes are made in
+      int node = num_leaves_ + i - 2;
+      int cost;
+      int x = cheapest_edge(leaf_order[0],
+                            fitch_parsimony->get_node_states(nullptr, leaf),
+                            unrooted_undirectional_tree, cost);
+      int y = parent_arr_[x];
+      score += cost;
+      replace_neighbor(x, y, node, unrooted_undirectional_tree);
+      replace_neighbor(y, x, node, unrooted_undirectional_tree);
+      unrooted_undirectional_tree[idx_arr[node]] = x;
+      unrooted_undirectional_tree[idx_arr[node] + 1] = y;
+      unrooted_undirectional_tree[idx_arr[node] + 2] = leaf;
+      unrooted_undirectional_tree[idx_arr[leaf]] = node;
+    }
+    return score;
+  }
+
+ private:
+  // Fitch sets of the tree so far rooted at its first leaf: below each node,
+  // and outside of it seen from its parent edge
+  shared_ptr<uint64_t> down_state_arr_;
+  shared_ptr<uint64_t> up_state_arr_;
+  // the nodes of the tree so far, parents first, and their parents
+  vector<int> order_arr_;
+  vector<int> parent_arr_;
+
+  void replace_neighbor(int node, int old_neighbor, int new_neighbor,
+                        int *unrooted_undirectional_tree) {
+    int idx = unrooted_undirectional_idx_arr_.get()[node];
+    while (unrooted_undirectional_tree[idx] != old_neighbor) {
+      idx++;
+    }
+    unrooted_undirectional_tree[idx] = new_neighbor;
+  }
+
+  /**
+   * Find the edge of the tree so far where leaf_states costs the least, the
+   * first one on a tie
+   *
+   * @param root : a leaf of the tree so far
+   * @param cost : output, the cost of the edge
+   * @return x of the edge (x, parent_arr_[x])
+   */
+  int cheapest_edge(int root, const uint64_t *leaf_states,
+                    const int *unrooted_undirectional_tree, int &cost) {
+    auto fitch_parsimony = fitch_parsimony_.get();
+    const int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    uint64_t *down_state_arr = down_state_arr_.get();
+    uint64_t *up_state_arr = up_state_arr_.get();
+
+    // breadth first from the root leaf
+    int num_ordered = 0;
+    order_arr_[num_ordered++] = unrooted_undirectional_tree[idx_arr[root]];
+    parent_arr_[order_arr_[0]] = root;
+    for (int i = 0; i < num_ordered; i++) {
+      int node = order_arr_[i];
+      if (node < num_leaves_) {
+        continue;
+      }
+      for (int j = 0; j < 3; j++) {
+        int neighbor = unrooted_undirectional_tree[idx_arr[node] + j];
+        if (neighbor != parent_arr_[node]) {
+          parent_arr_[neighbor] = node;
+          order_arr_[num_ordered++] = neighbor;
+        }
+      }
+    }
+    // children before parents
+    for (int i = num_ordered - 1; i >= 0; i--) {
+      int node = order_arr_[i];
+      if (node < num_leaves_) {
+        continue;
+      }
+      int child_arr[2];
+      int num_children = 0;
+      for (int j = 0; j < 3; j++) {
+        int neighbor = unrooted_undirectional_tree[idx_arr[node] + j];
+        if (neighbor != parent_arr_[node]) {
+          child_arr[num_children++] = neighbor;
+        }
+      }
+      fitch_parsimony->fitch_join(
+          fitch_parsimony->get_node_states(down_state_arr, child_arr[0]),
+          fitch_parsimony->get_node_states(down_state_arr, child_arr[1]),
+          down_state_arr + node * node_state_len_);
+    }
+
+    // parents before children, the cost of each edge with them
+    int best_node = -1;
+    cost = INT_MAX;
+    const uint64_t *root_states =
+        fitch_parsimony->get_node_states(nullptr, root);
+    copy(root_states, root_states + node_state_len_,
+         up_state_arr + order_arr_[0] * node_state_len_);
+    for (int i = 0; i < num_ordered; i++) {
+      int node = order_arr_[i];
+      const uint64_t *up_states = up_state_arr + node * node_state_len_;
+      int edge_cost = fitch_parsimony->fitch_regraft_cost(
+          fitch_parsimony->get_node_states(down_state_arr, node), up_states,
+          leaf_states);
+      if (edge_cost < cost) {
+        cost = edge_cost;
+        best_node = node;
+      }
+      if (node < num_leaves_) {
+        continue;
+      }
+      int child_arr[2];
+      int num_children = 0;
+      for (int j = 0; j < 3; j++) {
+        int neighbor = unrooted_undirectional_tree[idx_arr[node] + j];
+        if (neighbor != parent_arr_[node]) {
+          child_arr[num_children++] = neighbor;
+        }
+      }
+      for (int j = 0; j < 2; j++) {
+        fitch_parsimony->fitch_join(
+            up_states,
+            fitch_parsimony->get_node_states(down_state_arr, child_arr[1 - j]),
+            up_state_arr + child_arr[j] * node_state_len_);
+      }
+    }
+    return best_node;
+  }
+};
+
+#endif /* StepwiseAddition_hpp */
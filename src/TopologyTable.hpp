@@ -0,0 +1,206 @@
+//
+//  TopologyTable.hpp
+//  LargeParsimonyProblem
+//
+//  Canonical split hashes of unrooted topologies and a concurrent table of
+//  the topologies the search has already scored.
+//
+
+#ifndef TopologyTable_hpp
+#define TopologyTable_hpp
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+class TopologyHash {
+  // trees here are all rooted and directed
+ public:
+  // N + 1, 1 is the root
+  int num_nodes_;
+
+  int num_leaves_;
+
+  // random key of every leaf, a split is the xor of the keys on one side
+  // length: num_leaves_
+  shared_ptr<uint64_t> leaf_key_arr_;
+
+  // xor of all leaf keys
+  uint64_t all_key_;
+
+  // -1 for the root
+  // length: N + 1
+  shared_ptr<int> parent_arr_;
+
+  // xor of the leaf keys below each node
+  // length: N + 1
+  shared_ptr<uint64_t> subtree_key_arr_;
+
+  // hash of the loaded tree
+  uint64_t tree_hash_;
+
+  TopologyHash(int num_nodes, int num_leaves)
+      : num_nodes_{num_nodes}, num_leaves_{num_leaves}, all_key_{0},
+        tree_hash_{0} {
+    leaf_key_arr_ = shared_ptr<uint64_t>(new uint64_t[num_leaves_],
+                                         [](uint64_t *p) { delete[] p; });
+    parent_arr_ =
+        shared_ptr<int>(new int[num_nodes_], [](int *p) { delete[] p; });
+    subtree_key_arr_ = shared_ptr<uint64_t>(new uint64_t[num_nodes_],
+                                            [](uint64_t *p) { delete[] p; });
+    // fixed seed, hashes are comparable across runs
+    uint64_t seed = 0x853c49e6748fea9bULL;
+    for (int leaf = 0; leaf < num_leaves_; leaf++) {
+      seed += 0x9e3779b97f4a7c15ULL;
+      leaf_key_arr_.get()[leaf] = mix64(seed);
+      all_key_ ^= leaf_key_arr_.get()[leaf];
+    }
+  }
+
+  ~TopologyHash() = default;
+
+  // splitmix64 finalizer
+  static uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  // hash of the split with key on one side, the same from either side
+  uint64_t split_hash(uint64_t key) const {
+    uint64_t other = all_key_ ^ key;
+    return mix64(key < other ? key : other);
+  }
+
+  /**
+   * Hash a rooted & directed tree as the sum of the hashes of its splits, so
+   * that it does not depend on the rooting or the node numbering
+   *
+   * @param rooted_directional_tree : children arr of the tree
+   * @param rooted_directional_idx_arr : index arr of the tree
+   * @param rooted_postorder_arr : internal nodes, children before parents
+   * @return the hash of the unrooted topology
+   */
+  uint64_t load_tree(int *rooted_directional_tree,
+                     int *rooted_directional_idx_arr,
+                     int *rooted_postorder_arr) {
+    auto parent_arr = parent_arr_.get();
+    auto subtree_key_arr = subtree_key_arr_.get();
+    int num_internal_nodes = num_nodes_ - num_leaves_;
+    for (int leaf = 0; leaf < num_leaves_; leaf++) {
+      subtree_key_arr[leaf] = leaf_key_arr_.get()[leaf];
+    }
+
+    tree_hash_ = 0;
+    for (int p = 0; p < num_internal_nodes; p++) {
+      int node = rooted_postorder_arr[p];
+      int bias = rooted_directional_idx_arr[node];
+      subtree_key_arr[node] = 0;
+      for (int j = 0; j < 2; j++) {
+        int child = rooted_directional_tree[bias + j];
+        parent_arr[child] = node;
+        subtree_key_arr[node] ^= subtree_key_arr[child];
+        // the two root edges are one unrooted edge, count it once
+        if (p != num_internal_nodes - 1 || j == 0) {
+          tree_hash_ += split_hash(subtree_key_arr[child]);
+        }
+      }
+    }
+    parent_arr[rooted_postorder_arr[num_internal_nodes - 1]] = -1;
+    return tree_hash_;
+  }
+
+  // xor of the leaf keys of the subtree that hangs from x, seen from its
+  // neighbor y
+  uint64_t get_subtree_key(int x, int y) const {
+    if (parent_arr_.get()[x] == y) {
+      return subtree_key_arr_.get()[x];
+    }
+    // x is above y, or both hang from the root
+    return all_key_ ^ subtree_key_arr_.get()[y];
+  }
+
+  /**
+   * Hash of the loaded tree after the nearest neighbor interchange of a_child
+   * and b_child across the internal edge (a, b). Only the split of (a, b)
+   * changes.
+   *
+   * @param a_other : the third neighbor of a
+   * @param b_other : the third neighbor of b
+   * @return the hash of the interchanged topology
+   */
+  uint64_t nearest_neighbor_interchage_hash(int a, int b, int a_child,
+                                            int b_child, int a_other,
+                                            int b_other) const {
+    uint64_t a_other_key = get_subtree_key(a_other, a);
+    uint64_t old_key = a_other_key ^ get_subtree_key(a_child, a);
+    uint64_t new_key = a_other_key ^ get_subtree_key(b_child, b);
+    return tree_hash_ - split_hash(old_key) + split_hash(new_key);
+  }
+};
+
+class TopologyTable {
+ public:
+  // independent locks, so threads rarely wait on each other
+  static const int num_shards_ = 64;
+
+  TopologyTable() : shard_arr_{new Shard[num_shards_]}, journal_{false} {}
+
+  ~TopologyTable() = default;
+
+  /**
+   * Record a topology. Safe to call from several threads.
+   *
+   * @param tree_hash : hash of the topology
+   * @param round : search round the topology is seen in
+   * @param first_round : output, the round the topology was first recorded in
+   * @return true if the topology was not known before
+   */
+  bool insert(uint64_t tree_hash, int round, int &first_round) {
+    Shard &shard = shard_arr_[tree_hash % num_shards_];
+    lock_guard<mutex> guard(shard.lock_);
+    auto it = shard.round_map_.emplace(tree_hash, round);
+    first_round = it.first->second;
+    if (it.second && journal_) {
+      shard.journal_.push_back(make_pair(tree_hash, round));
+    }
+    return it.second;
+  }
+
+  // also keep every new topology for drain_journal(), set before the
+  // search starts
+  void set_journal(bool journal) { journal_ = journal; }
+
+  /**
+   * Move the topologies recorded since the last call to the end of
+   * entry_arr
+   *
+   * @param entry_arr : output, (hash, first round) of each topology
+   */
+  void drain_journal(vector<pair<uint64_t, int>> &entry_arr) {
+    for (int i = 0; i < num_shards_; i++) {
+      Shard &shard = shard_arr_[i];
+      lock_guard<mutex> guard(shard.lock_);
+      entry_arr.insert(entry_arr.end(), shard.journal_.begin(),
+                       shard.journal_.end());
+      shard.journal_.clear();
+    }
+  }
+
+ private:
+  struct Shard {
+    mutex lock_;
+    unordered_map<uint64_t, int> round_map_;
+    // new since the last drain_journal()
+    vector<pair<uint64_t, int>> journal_;
+  };
+
+  unique_ptr<Shard[]> shard_arr_;
+  bool journal_;
+};
+
+#endif /* TopologyTable_hpp */
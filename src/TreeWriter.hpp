@@ -0,0 +1,333 @@
+//
+//  TreeWriter.hpp
+//  LargeParsimonyProblem
+//
+//  Writes the result trees from a background thread through one large
+//  buffer, as the edge list text, as Newick or as a compact binary tree set.
+//
+//  Binary tree set, little-endian:
+//    header   "LPTS", uint32 version (1), uint32 N, uint32 num_leaves,
+//             uint32 num_sites, int32 score, uint32 flags (1: ancestral
+//             strings), uint32 node_bytes (2 if N <= 65536, else 4)
+//    leaves   for every leaf: uint32 name length, the name, num_sites chars
+//    records  one per tree until the end of the file: the parent of every
+//             node but the root N - 1, node_bytes each, then with the
+//             ancestral flag num_sites chars of every internal node
+//
+
+#ifndef TreeWriter_hpp
+#define TreeWriter_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class TreeWriter {
+ public:
+  enum Format { TEXT_FORMAT, NEWICK_FORMAT, BINARY_FORMAT };
+
+  // the buffer goes to the file once it holds this many bytes
+  static const size_t flush_len_ = 1 << 20;
+
+  /**
+   * Open the output file and start the writer thread
+   *
+   * @param file_name : the output file, exits if it cannot be opened
+   * @param format : layout of the output
+   * @param score : the score of every tree
+   * @param num_nodes : N
+   * @param num_leaves : number of leaves
+   * @param unrooted_undirectional_idx_arr : index arr shared by every tree
+   * @param leaf_name_arr : the name of every leaf
+   * @param char_list : (num_sites) * (N + 1), the chars of the leaves
+   * @param num_sites : length of every sequence
+   * @param write_ancestral : whether every tree comes with its strings
+   */
+  TreeWriter(const string &file_name, Format format, int score, int num_nodes,
+             int num_leaves, shared_ptr<int> unrooted_undirectional_idx_arr,
+             const vector<string> &leaf_name_arr, const char *char_list,
+             int num_sites, bool write_ancestral)
+      : format_{format},
+        score_{score},
+        num_nodes_{num_nodes},
+        num_leaves_{num_leaves},
+        num_sites_{num_sites},
+        write_ancestral_{write_ancestral},
+        unrooted_undirectional_idx_arr_{unrooted_undirectional_idx_arr},
+        leaf_name_arr_{leaf_name_arr},
+        finished_{false} {
+    file_ = fopen(file_name.c_str(), "wb");
+    if (file_ == nullptr) {
+      cerr << file_name << ": cannot open for writing" << endl;
+      exit(1);
+    }
+    parent_arr_.resize(num_nodes_);
+    stack_arr_.reserve(num_nodes_);
+    if (format_ == BINARY_FORMAT) {
+      write_binary_header(char_list);
+    }
+    worker_ = thread([this] { run(); });
+  }
+
+  ~TreeWriter() { finish(); }
+
+  /**
+   * Map a --format name to a format
+   *
+   * @return false if the name is unknown
+   */
+  static bool format_from_name(const string &name, Format &format) {
+    if (name == "text") {
+      format = TEXT_FORMAT;
+    } else if (name == "newick") {
+      format = NEWICK_FORMAT;
+    } else if (name == "binary") {
+      format = BINARY_FORMAT;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Queue a tree for writing. Trees are written in the order they come in.
+   *
+   * @param unrooted_undirectional_tree : the tree, not changed afterwards
+   * @param string_list : its N strings, only read when writing ancestral
+   */
+  void push(shared_ptr<int> unrooted_undirectional_tree,
+            shared_ptr<string> string_list) {
+    {
+      lock_guard<mutex> guard(lock_);
+      tree_queue_.push_back(
+          make_pair(unrooted_undirectional_tree, string_list));
+    }
+    ready_.notify_one();
+  }
+
+  // write every queued tree, then close the file
+  void finish() {
+    if (finished_) {
+      return;
+    }
+    {
+      lock_guard<mutex> guard(lock_);
+      finished_ = true;
+    }
+    ready_.notify_one();
+    worker_.join();
+    fwrite(buffer_.data(), 1, buffer_.size(), file_);
+    fclose(file_);
+  }
+
+ private:
+  Format format_;
+  int score_;
+  int num_nodes_;
+  int num_leaves_;
+  int num_sites_;
+  bool write_ancestral_;
+  shared_ptr<int> unrooted_undirectional_idx_arr_;
+  vector<string> leaf_name_arr_;
+
+  FILE *file_;
+  string buffer_;
+  // scratch of the writer thread: parents rooted at node N - 1, and a DFS
+  // stack for Newick
+  vector<int> parent_arr_;
+  vector<int> stack_arr_;
+
+  thread worker_;
+  mutex lock_;
+  condition_variable ready_;
+  deque<pair<shared_ptr<int>, shared_ptr<string>>> tree_queue_;
+  bool finished_;
+
+  void run() {
+    while (true) {
+      pair<shared_ptr<int>, shared_ptr<string>> item;
+      {
+        unique_lock<mutex> guard(lock_);
+        ready_.wait(guard,
+                    [this] { return finished_ || !tree_queue_.empty(); });
+        if (tree_queue_.empty()) {
+          return;
+        }
+        item = tree_queue_.front();
+        tree_queue_.pop_front();
+      }
+      switch (format_) {
+        case TEXT_FORMAT:
+          append_text(item.first.get(), item.second.get());
+          break;
+        case NEWICK_FORMAT:
+          append_newick(item.first.get());
+          break;
+        case BINARY_FORMAT:
+          append_binary(item.first.get(), item.second.get());
+          break;
+      }
+      if (buffer_.size() >= flush_len_) {
+        fwrite(buffer_.data(), 1, buffer_.size(), file_);
+        buffer_.clear();
+      }
+    }
+  }
+
+  void append_int(int value) {
+    char digits[16];
+    int len = snprintf(digits, sizeof(digits), "%d", value);
+    buffer_.append(digits, len);
+  }
+
+  template <class T>
+  void append_raw(T value) {
+    buffer_.append((const char *)&value, sizeof(T));
+  }
+
+  // the edge list of every node, then the strings, as runBaseline always
+  // wrote them
+  void append_text(int *tree, string *string_list) {
+    int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    append_int(score_);
+    buffer_.push_back('\n');
+    for (int i = 0; i < num_nodes_; i++) {
+      int degree = i < num_leaves_ ? 1 : 3;
+      for (int j = 0; j < degree; j++) {
+        append_int(i);
+        buffer_.append("->");
+        append_int(tree[idx_arr[i] + j]);
+        buffer_.push_back('\n');
+      }
+    }
+    if (write_ancestral_) {
+      for (int i = 0; i < num_nodes_; i++) {
+        append_int(i);
+        buffer_.append("->");
+        buffer_.append(string_list[i]);
+        buffer_.push_back('\n');
+      }
+    }
+    buffer_.append("-----\n");
+  }
+
+  // parent_arr_ of the tree rooted at its last node, an internal node
+  void root_tree(int *tree) {
+    int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    int root = num_nodes_ - 1;
+    parent_arr_[root] = -1;
+    stack_arr_.clear();
+    stack_arr_.push_back(root);
+    while (!stack_arr_.empty()) {
+      int node = stack_arr_.back();
+      stack_arr_.pop_back();
+      int degree = node < num_leaves_ ? 1 : 3;
+      for (int j = 0; j < degree; j++) {
+        int neighbor = tree[idx_arr[node] + j];
+        if (neighbor != parent_arr_[node]) {
+          parent_arr_[neighbor] = node;
+          stack_arr_.push_back(neighbor);
+        }
+      }
+    }
+  }
+
+  void append_leaf_name(int leaf) {
+    const string &name = leaf_name_arr_[leaf];
+    if (name.find_first_of(" \t,():;[]'") == string::npos) {
+      buffer_.append(name);
+    } else {
+      buffer_.push_back('\'');
+      buffer_.append(name);
+      buffer_.push_back('\'');
+    }
+  }
+
+  // one tree per line, the score as a leading comment
+  void append_newick(int *tree) {
+    int *idx_arr = unrooted_undirectional_idx_arr_.get();
+    root_tree(tree);
+    buffer_.append("[parsimony=");
+    append_int(score_);
+    buffer_.append("] ");
+    // a node is pushed as ~node once its children are done
+    stack_arr_.clear();
+    stack_arr_.push_back(num_nodes_ - 1);
+    bool first_child = true;
+    while (!stack_arr_.empty()) {
+      int entry = stack_arr_.back();
+      stack_arr_.pop_back();
+      if (entry < 0) {
+        buffer_.push_back(')');
+        first_child = false;
+        continue;
+      }
+      if (!first_child) {
+        buffer_.push_back(',');
+      }
+      if (entry < num_leaves_) {
+        append_leaf_name(entry);
+        first_child = false;
+        continue;
+      }
+      buffer_.push_back('(');
+      first_child = true;
+      stack_arr_.push_back(~entry);
+      for (int j = 2; j >= 0; j--) {
+        int neighbor = tree[idx_arr[entry] + j];
+        if (neighbor != parent_arr_[entry]) {
+          stack_arr_.push_back(neighbor);
+        }
+      }
+    }
+    buffer_.append(";\n");
+  }
+
+  int node_bytes() const { return num_nodes_ <= 65536 ? 2 : 4; }
+
+  void write_binary_header(const char *char_list) {
+    buffer_.append("LPTS");
+    append_raw<uint32_t>(1);
+    append_raw<uint32_t>(num_nodes_);
+    append_raw<uint32_t>(num_leaves_);
+    append_raw<uint32_t>(num_sites_);
+    append_raw<int32_t>(score_);
+    append_raw<uint32_t>(write_ancestral_ ? 1 : 0);
+    append_raw<uint32_t>(node_bytes());
+    for (int leaf = 0; leaf < num_leaves_; leaf++) {
+      append_raw<uint32_t>(leaf_name_arr_[leaf].size());
+      buffer_.append(leaf_name_arr_[leaf]);
+      for (int site = 0; site < num_sites_; site++) {
+        buffer_.push_back(char_list[size_t(site) * (num_nodes_ + 1) + leaf]);
+      }
+    }
+  }
+
+  void append_binary(int *tree, string *string_list) {
+    root_tree(tree);
+    for (int node = 0; node < num_nodes_ - 1; node++) {
+      if (node_bytes() == 2) {
+        append_raw<uint16_t>(parent_arr_[node]);
+      } else {
+        append_raw<uint32_t>(parent_arr_[node]);
+      }
+    }
+    if (write_ancestral_) {
+      for (int node = num_leaves_; node < num_nodes_; node++) {
+        buffer_.append(string_list[node]);
+      }
+    }
+  }
+};
+
+#endif /* TreeWriter_hpp */
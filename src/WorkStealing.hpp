@@ -0,0 +1,98 @@
+//
+//  WorkStealing.hpp
+//  LargeParsimonyProblem
+//
+//  A range of task indices split across workers. A worker takes tasks from
+//  the front of its own slice, and once that is empty it steals the back
+//  half of another worker's slice.
+//
+
+#ifndef WorkStealing_hpp
+#define WorkStealing_hpp
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+using namespace std;
+
+class WorkStealingRange {
+ public:
+  int num_workers_;
+
+  // slice of each worker, (begin << 32) | end, updated with compare & swap
+  // length: num_workers_
+  unique_ptr<atomic<uint64_t>[]> slice_arr_;
+
+  WorkStealingRange(int num_workers)
+      : num_workers_{num_workers},
+        slice_arr_{new atomic<uint64_t>[num_workers]} {
+    reset(0, num_workers);
+  }
+
+  ~WorkStealingRange() = default;
+
+  static uint64_t pack(uint32_t begin, uint32_t end) {
+    return (uint64_t(begin) << 32) | end;
+  }
+
+  /**
+   * Hand out tasks first_task ... first_task + num_tasks - 1 in contiguous
+   * slices, one per worker. Not thread-safe, call it while no worker is
+   * taking tasks.
+   *
+   * @param num_tasks : number of tasks
+   * @param num_workers : number of workers taking tasks, at most the number
+   * the range was built for
+   * @param first_task : the first task, 0 unless other processes take the
+   * tasks before it
+   */
+  void reset(int num_tasks, int num_workers, int first_task = 0) {
+    for (int w = 0; w < num_workers_; w++) {
+      uint32_t begin = w < num_workers ? uint64_t(num_tasks) * w / num_workers
+                                       : num_tasks;
+      uint32_t end = w < num_workers
+                         ? uint64_t(num_tasks) * (w + 1) / num_workers
+                         : num_tasks;
+      slice_arr_[w].store(pack(first_task + begin, first_task + end));
+    }
+  }
+
+  /**
+   * Take the next task of a worker, stealing when its own slice is empty
+   *
+   * @param worker : the calling worker
+   * @param task : output, the task to run
+   * @return false once no task is left to take
+   */
+  bool next(int worker, int &task) {
+    atomic<uint64_t> &own = slice_arr_[worker];
+    uint64_t slice = own.load();
+    while (uint32_t(slice >> 32) < uint32_t(slice)) {
+      uint32_t begin = slice >> 32;
+      if (own.compare_exchange_weak(slice, pack(begin + 1, uint32_t(slice)))) {
+        task = begin;
+        return true;
+      }
+    }
+
+    for (int k = 1; k < num_workers_; k++) {
+      atomic<uint64_t> &victim = slice_arr_[(worker + k) % num_workers_];
+      uint64_t victim_slice = victim.load();
+      while (uint32_t(victim_slice >> 32) < uint32_t(victim_slice)) {
+        uint32_t begin = victim_slice >> 32;
+        uint32_t end = uint32_t(victim_slice);
+        uint32_t mid = begin + (end - begin) / 2;
+        if (victim.compare_exchange_weak(victim_slice, pack(begin, mid))) {
+          // the own slice is empty, so nobody else writes it now
+          own.store(pack(mid + 1, end));
+          task = mid;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+};
+
+#endif /* WorkStealing_hpp */
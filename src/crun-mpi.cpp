@@ -0,0 +1,79 @@
+//
+//  main.cpp
+//  LargeParsimonyProblem
+//
+//  Created by ShanLi on 2018/4/16.
+//  Copyright © 2018 WhistleStop. All rights reserved.
+//
+//
+#include <mpi.h>
+#include "LargeParsimony-omp.hpp"
+#include "MpiExchange.hpp"
+#include "SearchDriver.hpp"
+
+void runBaseline(string file_name, string outfile_name, int num_threads,
+                 const Options &options) {
+  // every process reads the input and runs the same searches, splitting the
+  // tasks of each slice with the others
+  auto exchange = make_shared<MpiExchange>(MPI_COMM_WORLD);
+  if (!options.checkpoint_file.empty()) {
+    if (exchange.get()->is_root()) {
+      cerr << "checkpoints are not supported over MPI" << endl;
+    }
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  // the ratchet iterations are not split, each process would run them all
+  if (options.ratchet_iterations > 0 && exchange.get()->num_ranks_ > 1) {
+    if (exchange.get()->is_root()) {
+      cerr << "the ratchet is not supported over several MPI processes"
+           << endl;
+    }
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
+  // the widest ispc target this CPU runs, unless --simd picks one
+  const IspcKernels *ispc_kernels = selectIspcKernels(options.simd_target);
+  if (ispc_kernels == nullptr) {
+    cerr << "unsupported simd target: "
+         << (options.simd_target.empty() ? "any" : options.simd_target)
+         << endl;
+    exit(1);
+  }
+
+  SearchResult<LargeParsimony> result = runSearch<LargeParsimony>(
+      file_name, num_threads, options,
+      [&](shared_ptr<int> start_tree, const InputTree &input,
+          shared_ptr<SitePatterns> site_patterns) {
+        auto large_parsimony = make_shared<LargeParsimony>(
+            start_tree, input.undirected_idx, site_patterns,
+            input.num_undirected_nodes, input.num_leaves, num_threads,
+            ispc_kernels);
+        large_parsimony.get()->set_exchange(exchange);
+        return large_parsimony;
+      });
+
+  // every process ends with the same trees, the root writes them
+  if (exchange.get()->is_root()) {
+    writeSearchResult(result, outfile_name, options);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  // the search calls MPI from one thread at a time
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+  if (provided < MPI_THREAD_SERIALIZED) {
+    cerr << "MPI_THREAD_SERIALIZED is not supported" << endl;
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  // mpirun -np <processes> ... input, output, num_threads (per process),
+  // [--no-ancestral] [--simd=<target>] [--tree=<file>] [--format=<format>]
+  // [--spr-radius=<edges>] [--tbr-radius=<edges>]
+  // [--replicates=<count>] [--seed=<seed>]
+  // [--tempering=<steps>] [--tempering-chains=<count>]
+  // [--tempering-temperature=<t>] [--exact]
+  // [--cost-matrix=<file>] [--transversion-cost=<cost>]
+  runBaseline(argv[1], argv[2], std::stoi(argv[3]),
+              parseOptions(argc, const_cast<const char **>(argv), 4));
+  MPI_Finalize();
+}
\ No newline at end of file
@@ -1,236 +1,778 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <algorithm>
-#include <cassert>
 #include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <memory>
-#include <queue>
 #include <string>
-#include <tuple>
 #include <unordered_map>
-#include <unordered_set>
+#include <vector>
 
 using namespace std;
 
+// a leaf sequence, in place in the mapped input file
+struct SequenceKey {
+  const char *chars;
+  int len;
+
+  bool operator==(const SequenceKey &other) const {
+    return len == other.len && memcmp(chars, other.chars, len) == 0;
+  }
+};
+
+// FNV-1a over the chars of a sequence
+struct SequenceKeyHash {
+  size_t operator()(const SequenceKey &key) const {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < key.len; i++) {
+      hash = (hash ^ (unsigned char)key.chars[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+  }
+};
+
+// the input tree and its leaf sequences
+struct InputTree {
+  int num_leaves;
+  // N, the leaves are node 0 ... num_leaves - 1
+  int num_undirected_nodes;
+  // length of every leaf sequence
+  int num_char_trees;
+  // undirected_idx[a] == b means that the neighbors of a are stored at
+  // neighbor_arr[b], 1 neighbor for a leaf and 3 for other nodes
+  // length: N and 2 * (N - 1)
+  shared_ptr<int> undirected_idx;
+  shared_ptr<int> neighbor_arr;
+  // length: (str_len) * (N + 1), only the chars of the leaves are set
+  shared_ptr<char> char_list;
+  // taxon names, or the leaf ids when the leaves are given by sequence
+  vector<string> leaf_name_arr;
+};
+
+void exitOnBadInput(const string &file_name, const string &reason) {
+  cerr << file_name << ": " << reason << endl;
+  exit(1);
+}
+
 /**
- * Read lines from a file
+ * Lay out the neighbors of every node of an unrooted binary tree
  *
- * @param file_name : the input file
- * @return a queue of strings, each of which is a line in file_name, with ending
- * '\n' stripped
+ * @param file_name : the input file, for error messages
+ * @param edge_arr : both ends of every edge, an edge may be given twice
+ * @param num_nodes : N, the leaves are node 0 ... input.num_leaves - 1
+ * @param input : output, its num_undirected_nodes, undirected_idx and
+ * neighbor_arr are set, exits if the edges are not a binary tree
  */
-queue<string> readLines(string file_name) {
-  queue<string> lines;
-  ifstream in(file_name.c_str());
-
-  if (!in) {
-    return lines;
+void buildUndirectedArr(const string &file_name, const vector<int> &edge_arr,
+                        int num_nodes, InputTree &input) {
+  // at most 3 neighbors per node, so a repeated edge is found in O(1)
+  vector<int> slot_arr(num_nodes * 3);
+  vector<int> degree_arr(num_nodes, 0);
+  int num_edge_ends = edge_arr.size();
+  for (int i = 0; i < num_edge_ends; i++) {
+    int node = edge_arr[i];
+    int neighbor = edge_arr[i ^ 1];
+    int *slots = slot_arr.data() + node * 3;
+    if (find(slots, slots + degree_arr[node], neighbor) !=
+        slots + degree_arr[node]) {
+      continue;
+    }
+    if (degree_arr[node] == 3) {
+      exitOnBadInput(file_name, "node with more than 3 neighbors");
+    }
+    slots[degree_arr[node]++] = neighbor;
   }
 
-  string str;
-  while (getline(in, str)) {
-    lines.emplace(str);
+  input.num_undirected_nodes = num_nodes;
+  input.undirected_idx =
+      shared_ptr<int>(new int[num_nodes], [](int *p) { delete[] p; });
+  input.neighbor_arr =
+      shared_ptr<int>(new int[(num_nodes - 1) * 2], [](int *p) { delete[] p; });
+  int next_neighbor = 0;
+  for (int node = 0; node < num_nodes; node++) {
+    if (degree_arr[node] != (node < input.num_leaves ? 1 : 3)) {
+      exitOnBadInput(file_name, "not an unrooted binary tree");
+    }
+    input.undirected_idx.get()[node] = next_neighbor;
+    for (int j = 0; j < degree_arr[node]; j++) {
+      input.neighbor_arr.get()[next_neighbor++] = slot_arr[node * 3 + j];
+    }
   }
-
-  return lines;
 }
 
 /**
- * Check whether a string is a number
+ * Write the leaf sequences to a new char list
  *
- * @param s : the input string
- * @return if the string is a number
+ * @param leaf_chars_arr : the sequence of every leaf, input.num_char_trees
+ * chars each
+ * @param input : output, its char_list is set
  */
-bool isNumber(const string &s) {
-  return !s.empty() &&
-         find_if(s.begin(), s.end(), [](char c) { return !isdigit(c); }) ==
-             s.end();
+void buildCharList(const vector<const char *> &leaf_chars_arr,
+                   InputTree &input) {
+  int num_directed_nodes = input.num_undirected_nodes + 1;
+  input.char_list = shared_ptr<char>(
+      new char[size_t(num_directed_nodes) * input.num_char_trees],
+      [](char *p) { delete[] p; });
+  auto char_list = input.char_list.get();
+  for (int leaf = 0; leaf < input.num_leaves; leaf++) {
+    const char *chars = leaf_chars_arr[leaf];
+    for (int site = 0; site < input.num_char_trees; site++) {
+      char_list[size_t(site) * num_directed_nodes + leaf] = chars[site];
+    }
+  }
 }
 
 /**
- * Given an input string (a node), find its corresponding node id
+ * Take the next non-empty line of the mapped file, '\r' and '\n' stripped
  *
- * @param assign : the assignment map for leaves
- * @param cur_leave : the node id of the next input leave
- * @param input_str : the input ndoe
- * @param output_num : the id of the node in the tree
+ * @param pos : start of the unread part, moved past the line
+ * @param end : end of the file
+ * @param line_begin : output, first char of the line
+ * @param line_end : output, one past the last char of the line
+ * @return false at the end of the file
  */
-void assign_number(unordered_map<string, int> &assign, int &cur_leave,
-                   const string &input_str, int &output_num) {
-  if (isNumber(input_str)) {
-    output_num = stoi(input_str);
-  } else {
-    if (assign.find(input_str) == assign.end()) {
-      output_num = cur_leave--;
-      assign.emplace(input_str, output_num);
-    } else {
-      output_num = assign.at(input_str);
+bool nextLine(const char *&pos, const char *end, const char *&line_begin,
+              const char *&line_end) {
+  while (pos < end) {
+    line_begin = pos;
+    const char *newline = (const char *)memchr(pos, '\n', end - pos);
+    line_end = newline == nullptr ? end : newline;
+    pos = newline == nullptr ? end : newline + 1;
+    while (line_end > line_begin && line_end[-1] == '\r') {
+      line_end--;
+    }
+    if (line_end > line_begin) {
+      return true;
     }
   }
+  return false;
 }
 
 /**
- * Given one line, extract the neighbors and store the information
+ * Node id of one side of an edge line: a number is an internal node, anything
+ * else is a leaf sequence
  *
- * @param line : the input string line
- * @param assign : the assignment map for leaves
- * @param cur_leave : the node id of the next input leave
- * @return : the pair of node ids in the line
+ * @param begin : first char of the token
+ * @param end : one past the last char of the token
+ * @param leaf_map : the leaf of every sequence seen so far
+ * @param leaf_seq_arr : the sequence of every leaf seen so far
+ * @param cur_leave : the node id of the next new sequence, counts down
+ * @return the node id, -1 if there are more sequences than leaves
  */
-tuple<int, int> getNeighborPair(string line, unordered_map<string, int> &assign,
-                                int &cur_leave) {
-  string delimiter = "->";
-  auto del_idx = line.find(delimiter);
-  string first = line.substr(0, del_idx);
-  string second = line.substr(del_idx + 2, line.length());
-  int first_number, second_number;
-
-  assign_number(assign, cur_leave, first, first_number);
-  assign_number(assign, cur_leave, second, second_number);
-
-  return tuple<int, int>(first_number, second_number);
+int tokenToNode(
+    const char *begin, const char *end,
+    unordered_map<SequenceKey, int, SequenceKeyHash> &leaf_map,
+    vector<SequenceKey> &leaf_seq_arr, int &cur_leave) {
+  int node = 0;
+  const char *c = begin;
+  while (c < end && *c >= '0' && *c <= '9') {
+    node = node * 10 + (*c++ - '0');
+  }
+  if (c == end && c != begin) {
+    return node;
+  }
+
+  SequenceKey key = {begin, int(end - begin)};
+  auto it = leaf_map.find(key);
+  if (it != leaf_map.end()) {
+    return it->second;
+  }
+  if (cur_leave < 0) {
+    return -1;
+  }
+  leaf_map.emplace(key, cur_leave);
+  leaf_seq_arr[cur_leave] = key;
+  return cur_leave--;
 }
 
 /**
- * Given a pair of node ids, store their neighboring information in a map
+ * Read the input file: the number of leaves on the first line, then one
+ * "a->b" edge per line where a leaf is given by its sequence and any other
+ * node by its id. The file is mapped and tokenized in place, each distinct
+ * sequence becomes a leaf (numbered down from num_leaves - 1 in order of
+ * first appearance) and its chars are written straight to the char list.
  *
- * @param neighbors : the map storing neighboring information
- * @param first : first node id
- * @param second : second node id
+ * @param file_name : the input file
+ * @return the parsed tree, exits if the file cannot be read or is not a
+ * binary tree
  */
-void connectNeighborPair(unordered_map<int, unordered_set<int>> &neighbors,
-                         int first, int second) {
-  if (neighbors.find(first) != neighbors.end()) {
-    neighbors[first].insert(second);
-  } else {
-    neighbors[first] = {second};
+InputTree readInputTree(const string &file_name) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    exitOnBadInput(file_name, "cannot read file");
   }
+  size_t file_size = file_stat.st_size;
+  void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    exitOnBadInput(file_name, "cannot map file");
+  }
+  madvise(mapped, file_size, MADV_SEQUENTIAL);
+  shared_ptr<const char> data((const char *)mapped, [file_size](const char *p) {
+    munmap((void *)p, file_size);
+  });
 
-  if (neighbors.find(second) != neighbors.end()) {
-    neighbors[second].insert(first);
-  } else {
-    neighbors[second] = {first};
+  const char *pos = data.get();
+  const char *end = pos + file_size;
+  const char *line_begin, *line_end;
+  InputTree input;
+  if (!nextLine(pos, end, line_begin, line_end)) {
+    exitOnBadInput(file_name, "empty file");
+  }
+  input.num_leaves = atoi(string(line_begin, line_end).c_str());
+  if (input.num_leaves < 2) {
+    exitOnBadInput(file_name, "bad number of leaves");
   }
+
+  unordered_map<SequenceKey, int, SequenceKeyHash> leaf_map;
+  vector<SequenceKey> leaf_seq_arr(input.num_leaves);
+  int cur_leave = input.num_leaves - 1;
+  // both ends of every edge line, an edge may be given in both directions
+  vector<int> edge_arr;
+  int max_node_idx = input.num_leaves - 1;
+  while (nextLine(pos, end, line_begin, line_end)) {
+    const char *arrow = line_begin;
+    while (arrow + 1 < line_end && !(arrow[0] == '-' && arrow[1] == '>')) {
+      arrow++;
+    }
+    if (arrow + 1 >= line_end) {
+      exitOnBadInput(file_name, "line without \"->\"");
+    }
+    int first = tokenToNode(line_begin, arrow, leaf_map, leaf_seq_arr,
+                            cur_leave);
+    int second = tokenToNode(arrow + 2, line_end, leaf_map, leaf_seq_arr,
+                             cur_leave);
+    if (first < 0 || second < 0) {
+      exitOnBadInput(file_name, "more sequences than leaves");
+    }
+    max_node_idx = max(max_node_idx, max(first, second));
+    edge_arr.push_back(first);
+    edge_arr.push_back(second);
+  }
+  if (cur_leave >= 0) {
+    exitOnBadInput(file_name, "fewer sequences than leaves");
+  }
+
+  buildUndirectedArr(file_name, edge_arr, max_node_idx + 1, input);
+
+  vector<const char *> leaf_chars_arr(input.num_leaves);
+  input.num_char_trees = leaf_seq_arr[0].len;
+  for (int leaf = 0; leaf < input.num_leaves; leaf++) {
+    if (leaf_seq_arr[leaf].len != input.num_char_trees) {
+      exitOnBadInput(file_name, "sequences of different lengths");
+    }
+    leaf_chars_arr[leaf] = leaf_seq_arr[leaf].chars;
+    input.leaf_name_arr.push_back(to_string(leaf));
+  }
+  buildCharList(leaf_chars_arr, input);
+  return input;
 }
 
 /**
- * Given a neighboring map, generate two arrays for the neighboring
- * relationships.
+ * Append the sequence chars of a line, upper case and without whitespace
  *
- * There are N nodes and N - 1 edges in the tree, thus there are 2 * (N - 1)
- * neighboring relationships
+ * @param begin : first char to read
+ * @param end : one past the last char to read
+ * @param seq : the sequence to append to
+ */
+void appendSequenceChars(const char *begin, const char *end, string &seq) {
+  for (const char *c = begin; c < end; c++) {
+    if (!isspace((unsigned char)*c)) {
+      seq.push_back(toupper((unsigned char)*c));
+    }
+  }
+}
+
+/**
+ * Read a FASTA or a relaxed PHYLIP alignment line by line, told apart by the
+ * first char ('>' for FASTA). PHYLIP starts with "ntax nchar", an "I" after
+ * them marks an interleaved file; a name is the first word of its line.
  *
- * @param neighbors : the map storing neighboring information
- * @param undirected_idx : undirected_idx[a] == b means that the neighbors of a
- * are stored at neighbor_arr[b]
- * @param neighbor_arr : self-explained
+ * @param file_name : the alignment file
+ * @param name_arr : output, the name of every taxon in file order
+ * @param seq_arr : output, the sequence of every taxon in file order
  */
-void convertNeighborsToUndirectedArr(
-    const unordered_map<int, unordered_set<int>> &neighbors,
-    shared_ptr<int> &undirected_idx, shared_ptr<int> &neighbor_arr) {
-  int next_neighbor = 0;
-  auto temp_idx = undirected_idx.get();
-  auto temp_arr = neighbor_arr.get();
+void readAlignment(const string &file_name, vector<string> &name_arr,
+                   vector<string> &seq_arr) {
+  ifstream in(file_name.c_str());
+  if (!in) {
+    exitOnBadInput(file_name, "cannot read file");
+  }
+  string line;
+  size_t first = string::npos;
+  while (first == string::npos && getline(in, line)) {
+    first = line.find_first_not_of(" \t\r");
+  }
+  if (first == string::npos) {
+    exitOnBadInput(file_name, "empty file");
+  }
+
+  if (line[first] == '>') {
+    do {
+      first = line.find_first_not_of(" \t\r");
+      if (first == string::npos) {
+        continue;
+      }
+      if (line[first] == '>') {
+        size_t name_end = line.find_first_of(" \t\r", first + 1);
+        name_arr.push_back(line.substr(first + 1, name_end == string::npos
+                                                      ? string::npos
+                                                      : name_end - first - 1));
+        seq_arr.push_back(string());
+      } else {
+        appendSequenceChars(line.c_str(), line.c_str() + line.size(),
+                            seq_arr.back());
+      }
+    } while (getline(in, line));
+    return;
+  }
 
-  for (auto it = neighbors.begin(); it != neighbors.end(); ++it) {
-    auto node_num = it->first;
-    auto temp_start = next_neighbor;
-    temp_idx[node_num] = temp_start;
-    for (auto sit = (it->second).begin(); sit != (it->second).end(); ++sit) {
-      temp_arr[temp_start++] = *sit;
+  char *header_end;
+  int num_taxa = strtol(line.c_str(), &header_end, 10);
+  int num_sites = strtol(header_end, &header_end, 10);
+  bool interleaved = false;
+  for (const char *c = header_end; *c != '\0'; c++) {
+    interleaved = interleaved || toupper((unsigned char)*c) == 'I';
+  }
+  if (num_taxa < 2 || num_sites < 1) {
+    exitOnBadInput(file_name, "bad PHYLIP header");
+  }
+  name_arr.resize(num_taxa);
+  seq_arr.assign(num_taxa, string());
+  // a sequential taxon continues until it is complete, an interleaved block
+  // gives every taxon one line in turn
+  int taxon = 0;
+  bool named = false;
+  int num_complete = 0;
+  while (num_complete < num_taxa && getline(in, line)) {
+    first = line.find_first_not_of(" \t\r");
+    if (first == string::npos) {
+      continue;
+    }
+    const char *chars = line.c_str() + first;
+    if (!named) {
+      size_t name_end = line.find_first_of(" \t", first);
+      name_end = name_end == string::npos ? line.size() : name_end;
+      name_arr[taxon] = line.substr(first, name_end - first);
+      chars = line.c_str() + name_end;
+    }
+    bool was_complete = int(seq_arr[taxon].size()) >= num_sites;
+    appendSequenceChars(chars, line.c_str() + line.size(), seq_arr[taxon]);
+    bool complete = int(seq_arr[taxon].size()) >= num_sites;
+    num_complete += complete && !was_complete;
+    if (interleaved) {
+      taxon = (taxon + 1) % num_taxa;
+      named = named || taxon == 0;
+    } else {
+      taxon += complete;
+      named = !complete;
     }
-    next_neighbor = temp_start;
+  }
+  if (num_complete < num_taxa) {
+    exitOnBadInput(file_name, "PHYLIP file ends early");
   }
 }
 
 /**
- * Given an unrooted undirected tree (N nodes, N - 1 edges, 2 * (N - 1)
- * neighboring relationships), generate a rooted directed tree (N + 1 nodes, N
- * edges, N directed relationships)
+ * Read a Newick tree, with its leaves named after the taxa of an alignment.
+ * Branch lengths, internal labels and [comments] are skipped. A rooted
+ * binary tree is unrooted by joining the two children of its root.
  *
- * @param num_undirected_nodes : N
- * @param num_leaves : number of leaves
- * @param undirected_idx : undirected_idx[a] == b means that the neighbors of a
- * are stored at neighbor_arr[b]
- * @param neighbor_arr : self-explained
- * @param directed_idx : directed_idx[a] == b means that the children of a are
- * stored at children_arr[b]
- * @param children_arr : self-explained
+ * @param file_name : the Newick file
+ * @param leaf_map : the leaf id of every taxon name
+ * @param num_leaves : number of taxa, the internal nodes get the ids after
+ * @param edge_arr : output, both ends of every edge
+ * @return N, the number of nodes of the unrooted tree
  */
-void covertUndirectedToDirected(const int num_undirected_nodes,
-                                const int num_leaves,
-                                shared_ptr<int> &undirected_idx,
-                                shared_ptr<int> &neighbor_arr,
-                                shared_ptr<int> &directed_idx,
-                                shared_ptr<int> &children_arr) {
-  auto tmp_undirected_idx = undirected_idx.get();
-  auto tmp_neighbor_arr = neighbor_arr.get();
-  auto tmp_directed_idx = directed_idx.get();
-  auto tmp_children_arr = children_arr.get();
-
-  int root = num_undirected_nodes;
-  int left = num_undirected_nodes - 1;
-  int right = tmp_neighbor_arr[tmp_undirected_idx[left]];
-  int next_children = 0;
-
-  for (int i = 0; i < num_undirected_nodes + 1; ++i) {
-    tmp_directed_idx[i] = -1;
-  }
-
-  auto temp_start = next_children;
-  tmp_directed_idx[root] = temp_start;
-  tmp_children_arr[temp_start++] = left;
-  tmp_children_arr[temp_start++] = right;
-  next_children = temp_start;
-
-  queue<int> q;
-  q.emplace(left);
-  q.emplace(right);
-  unordered_set<int> visited;
-  visited.insert(root);
-  visited.insert(left);
-  visited.insert(right);
-
-  while (!q.empty()) {
-    auto cur_node = q.front();
-    q.pop();
-
-    if (cur_node < num_leaves) {
+int readNewick(const string &file_name,
+               const unordered_map<string, int> &leaf_map, int num_leaves,
+               vector<int> &edge_arr) {
+  ifstream in(file_name.c_str());
+  if (!in) {
+    exitOnBadInput(file_name, "cannot read file");
+  }
+  string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+  // the internal nodes still open, innermost last
+  vector<int> open_arr;
+  vector<int> num_children_arr;
+  vector<bool> seen_arr(num_leaves, false);
+  int next_node = num_leaves;
+  int root = -1;
+  // a label right after ')' names the internal node, not a leaf
+  bool after_close = false;
+  size_t i = 0;
+  for (; i < text.size() && text[i] != ';'; i++) {
+    char c = text[i];
+    if (isspace((unsigned char)c) || c == ',') {
+      after_close = after_close && c != ',';
+      continue;
+    }
+    if (c == '[') {
+      i = text.find(']', i);
+      if (i == string::npos) {
+        exitOnBadInput(file_name, "unclosed comment");
+      }
+      continue;
+    }
+    if (c == ':') {
+      while (i + 1 < text.size() &&
+             string(",)[;").find(text[i + 1]) == string::npos) {
+        i++;
+      }
+      continue;
+    }
+    if (c == '(') {
+      int node = next_node++;
+      num_children_arr.push_back(0);
+      if (open_arr.empty()) {
+        root = node;
+      } else {
+        edge_arr.push_back(open_arr.back());
+        edge_arr.push_back(node);
+        num_children_arr[open_arr.back() - num_leaves]++;
+      }
+      open_arr.push_back(node);
+      after_close = false;
+      continue;
+    }
+    if (c == ')') {
+      if (open_arr.empty()) {
+        exitOnBadInput(file_name, "unbalanced parentheses");
+      }
+      open_arr.pop_back();
+      after_close = true;
+      continue;
+    }
+
+    // a label, quoted or up to the next delimiter
+    string label;
+    if (c == '\'') {
+      size_t close = text.find('\'', i + 1);
+      if (close == string::npos) {
+        exitOnBadInput(file_name, "unclosed quote");
+      }
+      label = text.substr(i + 1, close - i - 1);
+      i = close;
+    } else {
+      size_t label_end = text.find_first_of(" \t\r\n,():;[", i);
+      label_end = label_end == string::npos ? text.size() : label_end;
+      label = text.substr(i, label_end - i);
+      i = label_end - 1;
+    }
+    if (after_close) {
       continue;
     }
+    auto it = leaf_map.find(label);
+    if (it == leaf_map.end() || open_arr.empty()) {
+      exitOnBadInput(file_name, "unknown taxon " + label);
+    }
+    if (seen_arr[it->second]) {
+      exitOnBadInput(file_name, "repeated taxon " + label);
+    }
+    seen_arr[it->second] = true;
+    edge_arr.push_back(open_arr.back());
+    edge_arr.push_back(it->second);
+    num_children_arr[open_arr.back() - num_leaves]++;
+  }
+  if (i == text.size() || !open_arr.empty() || root < 0) {
+    exitOnBadInput(file_name, "not a complete Newick tree");
+  }
+  if (find(seen_arr.begin(), seen_arr.end(), false) != seen_arr.end()) {
+    exitOnBadInput(file_name, "taxa missing from the tree");
+  }
 
-    auto undirected_start_pos = tmp_undirected_idx[cur_node];
-    auto directed_start_pos = next_children;
-    tmp_directed_idx[cur_node] = directed_start_pos;
-    for (int i = undirected_start_pos; i < undirected_start_pos + 3; ++i) {
-      auto neighbor = tmp_neighbor_arr[i];
-      if (visited.find(neighbor) == visited.end()) {
-        tmp_children_arr[directed_start_pos++] = neighbor;
-        q.emplace(neighbor);
-        visited.insert(neighbor);
+  if (num_children_arr[root - num_leaves] == 2) {
+    // join the two children of the root, then the last internal node takes
+    // over the id of the root so that the ids stay contiguous
+    vector<int> root_edge;
+    vector<int> kept_edge_arr;
+    for (size_t e = 0; e < edge_arr.size(); e += 2) {
+      if (edge_arr[e] == root) {
+        root_edge.push_back(edge_arr[e + 1]);
+      } else {
+        kept_edge_arr.push_back(edge_arr[e]);
+        kept_edge_arr.push_back(edge_arr[e + 1]);
       }
     }
-    next_children = directed_start_pos;
+    kept_edge_arr.push_back(root_edge[0]);
+    kept_edge_arr.push_back(root_edge[1]);
+    int last = --next_node;
+    for (int &node : kept_edge_arr) {
+      node = node == last ? root : node;
+    }
+    edge_arr.swap(kept_edge_arr);
+  }
+  return next_node;
+}
+
+/**
+ * Read an alignment (FASTA or PHYLIP) and a Newick starting tree over its
+ * taxa. Leaf i is the i-th taxon of the alignment.
+ *
+ * @param alignment_file_name : the alignment file
+ * @param newick_file_name : the Newick file
+ * @return the parsed tree, exits if a file cannot be read or is malformed
+ */
+InputTree readAlignmentTree(const string &alignment_file_name,
+                            const string &newick_file_name) {
+  vector<string> name_arr;
+  vector<string> seq_arr;
+  readAlignment(alignment_file_name, name_arr, seq_arr);
+  InputTree input;
+  input.num_leaves = name_arr.size();
+  if (input.num_leaves < 3) {
+    exitOnBadInput(alignment_file_name, "fewer than 3 taxa");
+  }
+  unordered_map<string, int> leaf_map;
+  vector<const char *> leaf_chars_arr(input.num_leaves);
+  input.num_char_trees = seq_arr[0].size();
+  for (int leaf = 0; leaf < input.num_leaves; leaf++) {
+    if (!leaf_map.emplace(name_arr[leaf], leaf).second) {
+      exitOnBadInput(alignment_file_name, "repeated taxon " + name_arr[leaf]);
+    }
+    if (int(seq_arr[leaf].size()) != input.num_char_trees) {
+      exitOnBadInput(alignment_file_name, "sequences of different lengths");
+    }
+    leaf_chars_arr[leaf] = seq_arr[leaf].c_str();
+  }
+
+  vector<int> edge_arr;
+  int num_nodes =
+      readNewick(newick_file_name, leaf_map, input.num_leaves, edge_arr);
+  buildUndirectedArr(newick_file_name, edge_arr, num_nodes, input);
+  buildCharList(leaf_chars_arr, input);
+  input.leaf_name_arr = name_arr;
+  return input;
+}
+
+// optional flags given after the positional arguments
+struct Options {
+  // write the ancestral string of every node after each tree
+  bool write_ancestral = true;
+  // ispc target of the parallel build, empty to pick it from CPUID
+  string simd_target;
+  // Newick starting tree, the input is then a FASTA or PHYLIP alignment
+  string newick_file;
+  // text, newick or binary, see TreeWriter.hpp
+  string output_format = "text";
+  // checkpoint of the search, resumed from if it exists, see
+  // SearchCheckpoint.hpp
+  string checkpoint_file;
+  // seconds between two checkpoints
+  int checkpoint_interval = 600;
+  // search by subtree prune-and-regraft up to this many edges away, 0 for
+  // nearest neighbor interchanges
+  int spr_radius = 0;
+  // search by tree bisection-reconnection up to this many edges away from
+  // the cut, 0 for none
+  int tbr_radius = 0;
+  // searches from this many stepwise addition trees instead of the input
+  // tree, see StepwiseAddition.hpp
+  int replicates = 0;
+  // replicate r adds the leaves in the order seed + r picks, and its
+  // tempering chains walk from it
+  unsigned seed = 1;
+  // proposals of every parallel tempering chain before the plateau walk, 0
+  // for none, see ParallelTempering.hpp
+  int tempering_steps = 0;
+  // number of tempering chains, 0 for one per thread
+  int tempering_chains = 0;
+  // temperature of the hottest chain
+  double tempering_temperature = 2;
+  // parsimony ratchet iterations after the search, 0 for none
+  int ratchet_iterations = 0;
+  // chance of a column to weigh double in a ratchet iteration
+  double ratchet_upweight = 0.15;
+  // replace the trees found with every most parsimonious tree by branch and
+  // bound, see BranchAndBound.hpp
+  bool exact = false;
+  // step matrix of the char changes, see readCostMatrix(), empty for unit
+  // costs
+  string cost_matrix_file;
+  // cost of a transversion when a transition costs 1, without a step matrix
+  int transversion_cost = 1;
+};
+
+/**
+ * Parse the optional flags of the command line
+ *
+ * --no-ancestral : only write the score and the edges of each tree
+ * --simd=<target> : run the sse4, avx2 or avx512skx ispc kernels (parallel
+ * build only)
+ * --tree=<file> : start from this Newick tree, the input file is then a
+ * FASTA or PHYLIP alignment
+ * --format=<format> : write the trees as text (the edge list), newick or
+ * binary
+ * --checkpoint=<file> : save the search to this file now and then, and
+ * resume from it if it exists
+ * --checkpoint-interval=<seconds> : time between two checkpoints, 600 by
+ * default
+ * --spr-radius=<edges> : search by subtree prune-and-regraft instead of
+ * nearest neighbor interchange, regrafting at most this many edges away
+ * --tbr-radius=<edges> : search by tree bisection-reconnection instead,
+ * reconnecting at most this many edges away from the cut on either side
+ * --replicates=<count> : search from this many stepwise addition trees with
+ * random addition orders, and keep the best trees of them all
+ * --seed=<seed> : addition order of the first replicate and walk of its
+ * tempering chains, 1 by default
+ * --tempering=<steps> : walk parallel tempering chains from the starting
+ * tree for this many proposals each, then the plateau from their best trees
+ * --tempering-chains=<count> : number of chains, one per thread by default
+ * --tempering-temperature=<t> : temperature of the hottest chain, 2 by
+ * default, the coldest one runs at a sixteenth of it
+ * --ratchet=<iterations> : go on with this many parsimony ratchet
+ * iterations, each searches with some columns weighing double and then with
+ * the input weights again, run side by side in the parallel build, not
+ * checkpointed and rejected over several MPI processes
+ * --ratchet-upweight=<p> : chance of a column to weigh double, 0.15 by
+ * default
+ * --exact : search every tree by branch and bound after the heuristic
+ * search, whose best score is the first bound, and write all the most
+ * parsimonious ones. Rejected over BranchAndBound::max_num_leaves_ (20)
+ * leaves
+ * --cost-matrix=<file> : score every tree under this step matrix instead of
+ * unit costs, see readCostMatrix()
+ * --transversion-cost=<cost> : score a transition 1 and a transversion this
+ * much
+ *
+ * A step matrix other than unit costs is searched by nearest neighbor
+ * interchanges only, with a ratchet or not.
+ *
+ * @param argc : argc of main
+ * @param argv : argv of main
+ * @param first_option : index of the first optional argument
+ * @return the parsed options, exits on an unknown flag
+ */
+Options parseOptions(int argc, const char *argv[], int first_option) {
+  Options options;
+  for (int i = first_option; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--no-ancestral") {
+      options.write_ancestral = false;
+    } else if (arg == "--exact") {
+      options.exact = true;
+    } else if (arg.compare(0, 7, "--simd=") == 0) {
+      options.simd_target = arg.substr(7);
+    } else if (arg.compare(0, 7, "--tree=") == 0) {
+      options.newick_file = arg.substr(7);
+    } else if (arg.compare(0, 9, "--format=") == 0 &&
+               (arg == "--format=text" || arg == "--format=newick" ||
+                arg == "--format=binary")) {
+      options.output_format = arg.substr(9);
+    } else if (arg.compare(0, 13, "--checkpoint=") == 0) {
+      options.checkpoint_file = arg.substr(13);
+    } else if (arg.compare(0, 22, "--checkpoint-interval=") == 0 &&
+               atoi(arg.c_str() + 22) > 0) {
+      options.checkpoint_interval = atoi(arg.c_str() + 22);
+    } else if (arg.compare(0, 13, "--spr-radius=") == 0 &&
+               atoi(arg.c_str() + 13) > 0) {
+      options.spr_radius = atoi(arg.c_str() + 13);
+    } else if (arg.compare(0, 13, "--tbr-radius=") == 0 &&
+               atoi(arg.c_str() + 13) > 0) {
+      options.tbr_radius = atoi(arg.c_str() + 13);
+    } else if (arg.compare(0, 13, "--replicates=") == 0 &&
+               atoi(arg.c_str() + 13) > 0) {
+      options.replicates = atoi(arg.c_str() + 13);
+    } else if (arg.compare(0, 7, "--seed=") == 0) {
+      options.seed = strtoul(arg.c_str() + 7, nullptr, 10);
+    } else if (arg.compare(0, 12, "--tempering=") == 0 &&
+               atoi(arg.c_str() + 12) > 0) {
+      options.tempering_steps = atoi(arg.c_str() + 12);
+    } else if (arg.compare(0, 19, "--tempering-chains=") == 0 &&
+               atoi(arg.c_str() + 19) > 0) {
+      options.tempering_chains = atoi(arg.c_str() + 19);
+    } else if (arg.compare(0, 24, "--tempering-temperature=") == 0 &&
+               atof(arg.c_str() + 24) > 0) {
+      options.tempering_temperature = atof(arg.c_str() + 24);
+    } else if (arg.compare(0, 10, "--ratchet=") == 0 &&
+               atoi(arg.c_str() + 10) > 0) {
+      options.ratchet_iterations = atoi(arg.c_str() + 10);
+    } else if (arg.compare(0, 19, "--ratchet-upweight=") == 0 &&
+               atof(arg.c_str() + 19) > 0 && atof(arg.c_str() + 19) <= 1) {
+      options.ratchet_upweight = atof(arg.c_str() + 19);
+    } else if (arg.compare(0, 14, "--cost-matrix=") == 0) {
+      options.cost_matrix_file = arg.substr(14);
+    } else if (arg.compare(0, 20, "--transversion-cost=") == 0 &&
+               atoi(arg.c_str() + 20) > 0) {
+      options.transversion_cost = atoi(arg.c_str() + 20);
+    } else {
+      cerr << "unknown option: " << arg << endl;
+      exit(1);
+    }
+  }
+  if (!options.cost_matrix_file.empty() && options.transversion_cost != 1) {
+    cerr << "--cost-matrix and --transversion-cost exclude each other" << endl;
+    exit(1);
+  }
+  // regrafts, reconnections, tempering and branch and bound score by Fitch
+  if ((!options.cost_matrix_file.empty() || options.transversion_cost != 1) &&
+      (options.spr_radius > 0 || options.tbr_radius > 0 ||
+       options.tempering_steps > 0 || options.exact)) {
+    cerr << "a step matrix is searched by nearest neighbor interchanges only"
+         << endl;
+    exit(1);
   }
+  return options;
 }
 
 /**
- * Given a assignment map, populate the chars to a char list
- * @param char_list : length: (str_len) * (N + 1)
- * @param assign : the assignment map for leaves
- * @param num_char_trees : str_len
- * @param num_directed_nodes : N + 1
+ * The cost of every char change, unit costs unless the options give others
+ *
+ * A --cost-matrix file holds 16 integers separated by white space, four
+ * rows and four columns in the order A, C, G, T, so that row i column j is
+ * the cost of changing i to j. The matrix must be symmetric, as a tree is
+ * scored from an arbitrary root, with a zero diagonal and no negative costs.
+ *
+ * @param options : the parsed options
+ * @param cost_arr : output, length 16, cost_arr[4 * i + j] is the cost of
+ * changing i to j, exits if the file is not a valid matrix
  */
-void initializeCharList(shared_ptr<char> &char_list,
-                        unordered_map<string, int> &assign, int num_char_trees,
-                        int num_directed_nodes) {
-  auto tmp_char_list = char_list.get();
-  for (auto it = assign.begin(); it != assign.end(); ++it) {
-    const char *chars = (it->first).c_str();
-    int node = it->second;
-    for (int tree = 0; tree < num_char_trees; ++tree) {
-      auto char_pos = tree * num_directed_nodes + node;
-      tmp_char_list[char_pos] = chars[tree];
-    }
-  }
-}
\ No newline at end of file
+void readCostMatrix(const Options &options, int *cost_arr) {
+  // A <-> G and C <-> T are transitions, every other change a transversion
+  for (int i = 0; i < 16; i++) {
+    int from = i / 4;
+    int to = i % 4;
+    cost_arr[i] = from == to ? 0
+                  : from % 2 == to % 2 ? 1
+                                       : options.transversion_cost;
+  }
+  if (options.cost_matrix_file.empty()) {
+    return;
+  }
+
+  const string &file_name = options.cost_matrix_file;
+  ifstream file(file_name);
+  if (!file) {
+    exitOnBadInput(file_name, "cannot open the cost matrix");
+  }
+  for (int i = 0; i < 16; i++) {
+    if (!(file >> cost_arr[i])) {
+      exitOnBadInput(file_name, "expected 16 integer costs");
+    }
+  }
+  string extra;
+  if (file >> extra) {
+    exitOnBadInput(file_name, "more than 16 costs");
+  }
+  for (int i = 0; i < 16; i++) {
+    int from = i / 4;
+    int to = i % 4;
+    if (cost_arr[i] < 0 || (from == to && cost_arr[i] != 0) ||
+        cost_arr[i] != cost_arr[to * 4 + from]) {
+      exitOnBadInput(file_name,
+                     "costs must be symmetric, non-negative and 0 on the "
+                     "diagonal");
+    }
+  }
+}